@@ -2,11 +2,11 @@
 dosobj = src/sys_dos/main.obj src/sys_dos/keyb.obj src/sys_dos/mouse.obj src/sys_dos/timer.obj &
 	src/sys_dos/cdpmi.obj src/sys_dos/vidsys.obj src/sys_dos/drv_vga.obj src/sys_dos/drv_vbe.obj &
 	src/sys_dos/drv_s3.obj
-appobj = src/app.obj src/cmesh.obj src/darray.obj src/font.obj src/logger.obj &
-	src/meshgen.obj src/meshload.obj src/options.obj src/rbtree.obj src/geom.obj &
+appobj = src/acache.obj src/app.obj src/bvh.obj src/cmesh.obj src/cscene.obj src/darray.obj src/font.obj src/logger.obj &
+	src/mapfile.obj src/meshgen.obj src/meshload.obj src/options.obj src/packet.obj src/rbtree.obj src/geom.obj &
 	src/rend.obj src/rtk.obj src/rtk_draw.obj src/scene.obj src/scr_mod.obj &
 	src/modui.obj src/mtlui.obj src/scr_rend.obj src/texture.obj src/material.obj &
-	src/gfxutil.obj src/util.obj src/util_s.obj src/cpuid.obj src/cpuid_s.obj
+	src/gfxutil.obj src/tpool.obj src/trimesh.obj src/util.obj src/util_s.obj src/cpuid.obj src/cpuid_s.obj
 gawobj = src/gaw/gaw_sw.obj src/gaw/gawswtnl.obj src/gaw/polyclip.obj src/gaw/polyfill.obj
 
 incpath = -Isrc -Isrc/sys_dos -Ilibs -Ilibs/imago/src -Ilibs/treestor/include -Ilibs/drawtext
@@ -15,11 +15,11 @@ libpath = libpath libs/dos
 dosobj = src\sys_dos\main.obj src\sys_dos\keyb.obj src\sys_dos\mouse.obj src\sys_dos\timer.obj &
 	src\sys_dos\cdpmi.obj src\sys_dos\vidsys.obj src\sys_dos\drv_vga.obj src\sys_dos\drv_vbe.obj &
 	src\sys_dos\drv_s3.obj
-appobj = src\app.obj src\cmesh.obj src\darray.obj src\font.obj src\logger.obj &
-	src\meshgen.obj src\meshload.obj src\options.obj src\rbtree.obj src\geom.obj &
+appobj = src\acache.obj src\app.obj src\bvh.obj src\cmesh.obj src\cscene.obj src\darray.obj src\font.obj src\logger.obj &
+	src\mapfile.obj src\meshgen.obj src\meshload.obj src\options.obj src\packet.obj src\rbtree.obj src\geom.obj &
 	src\rend.obj src\rtk.obj src\rtk_draw.obj src\scene.obj src\scr_mod.obj &
 	src\modui.obj src\mtlui.obj src\scr_rend.obj src\texture.obj src\material.obj &
-	src\gfxutil.obj src\util.obj src\util_s.obj src\cpuid.obj src\cpuid_s.obj
+	src\gfxutil.obj src\tpool.obj src\trimesh.obj src\util.obj src\util_s.obj src\cpuid.obj src\cpuid_s.obj
 gawobj = src\gaw\gaw_sw.obj src\gaw\gawswtnl.obj src\gaw\polyclip.obj src\gaw\polyfill.obj
 
 incpath = -Isrc -Isrc\sys_dos -Ilibs -Ilibs\imago\src -Ilibs\treestor\include -Ilibs\drawtext
@@ -0,0 +1,6 @@
+# generated by configure
+build_opt = true
+opt = -O3
+build_dbg = true
+dbg = -g3
+build_gfx = gl
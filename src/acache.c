@@ -0,0 +1,392 @@
+/*
+RetroRay - integrated standalone vintage modeller/renderer
+Copyright (C) 2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "acache.h"
+#include "mapfile.h"
+#include "trimesh.h"
+#include "logger.h"
+
+#define CACHE_MAGIC		"RRACCEL"
+#define CACHE_VERSION	1
+#define CACHE_EXT		".rrc"
+#define CACHE_TMPEXT	".rc~"
+
+/* every array in the file starts at a multiple of this */
+#define ALIGN			16
+#define ALIGNED(x)		(((x) + (ALIGN - 1)) & ~(ALIGN - 1))
+
+/* File layout: header, mesh table, mesh file names, and then the nodes,
+ * primitive indices and vertices of each mesh, each aligned to 16 bytes. All
+ * offsets are from the start of the file, and everything is in native byte
+ * order; the version and node size don't match on incompatible systems.
+ */
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t node_size;				/* sizeof(struct bvhnode) */
+	uint32_t scn_hash, scn_size;	/* content hash of the scene file */
+	uint32_t num_meshes;
+	uint32_t unused;
+};
+
+struct cache_mesh {
+	uint32_t name_offs;
+	uint32_t src_hash, src_size;	/* content hash of the mesh file */
+	uint32_t method;				/* BVH_* build method */
+	uint32_t num_tri, num_nodes;
+	uint32_t nodes_offs, prims_offs, vert_offs;
+	uint32_t unused[3];
+};
+
+struct accel_cache {
+	struct mapfile mf;
+	const struct cache_header *hdr;
+	const struct cache_mesh *mesh;
+	int refcount;
+	int stale;
+};
+
+static char *cache_fname(const char *scnfname, const char *ext);
+static int valid_range(const struct accel_cache *ac, unsigned long offs, unsigned long size);
+static int valid_bvh(const struct bvhnode *nodes, int num_nodes, const int *prims, int num_prims);
+static int write_pad(FILE *fp, long *pos, long offs);
+
+
+/* FNV-1a */
+int hash_file(const char *fname, struct file_hash *fh)
+{
+	struct mapfile mf;
+	uint32_t hash = 2166136261u;
+	const unsigned char *ptr;
+	long i;
+
+	if(map_file(&mf, fname) == -1) {
+		return -1;
+	}
+	ptr = mf.data;
+	for(i=0; i<mf.size; i++) {
+		hash = (hash ^ *ptr++) * 16777619u;
+	}
+	fh->hash = hash;
+	fh->size = mf.size;
+	unmap_file(&mf);
+	return 0;
+}
+
+struct accel_cache *acache_open(const char *scnfname)
+{
+	char *fname;
+	struct accel_cache *ac;
+	struct file_hash scn;
+
+	if(!(fname = cache_fname(scnfname, CACHE_EXT))) {
+		return 0;
+	}
+	if(!(ac = calloc(1, sizeof *ac))) {
+		errormsg("failed to allocate acceleration cache\n");
+		free(fname);
+		return 0;
+	}
+	if(map_file(&ac->mf, fname) == -1) {
+		free(ac);
+		free(fname);
+		return 0;	/* no cache yet */
+	}
+	ac->hdr = ac->mf.data;
+	ac->mesh = (const struct cache_mesh*)(ac->hdr + 1);
+	ac->refcount = 1;
+
+	if(ac->mf.size < sizeof *ac->hdr || memcmp(ac->hdr->magic, CACHE_MAGIC, 8) != 0 ||
+			ac->hdr->version != CACHE_VERSION ||
+			ac->hdr->node_size != sizeof(struct bvhnode) ||
+			ac->hdr->num_meshes > ac->mf.size / sizeof *ac->mesh ||
+			!valid_range(ac, sizeof *ac->hdr, ac->hdr->num_meshes * sizeof *ac->mesh)) {
+		warnmsg("ignoring invalid or incompatible acceleration cache: %s\n", fname);
+		goto err;
+	}
+
+	if(hash_file(scnfname, &scn) == -1 || scn.hash != ac->hdr->scn_hash ||
+			scn.size != ac->hdr->scn_size) {
+		ac->stale = 1;
+	}
+
+	infomsg("using acceleration cache: %s (%d meshes)\n", fname, (int)ac->hdr->num_meshes);
+	free(fname);
+	return ac;
+
+err:
+	unmap_file(&ac->mf);
+	free(ac);
+	free(fname);
+	return 0;
+}
+
+void acache_close(struct accel_cache *ac)
+{
+	if(!ac || --ac->refcount > 0) return;
+
+	unmap_file(&ac->mf);
+	free(ac);
+}
+
+int acache_lookup(struct accel_cache *ac, const char *fname, const struct file_hash *src,
+		int method, struct trimesh *tm)
+{
+	int i;
+	const struct cache_mesh *cm;
+	const char *name;
+	char *base = ac->mf.data;
+
+	for(i=0; i<ac->hdr->num_meshes; i++) {
+		cm = ac->mesh + i;
+		if(cm->name_offs >= ac->mf.size) continue;
+		name = base + cm->name_offs;
+		if(!memchr(name, 0, ac->mf.size - cm->name_offs) || strcmp(name, fname) != 0) {
+			continue;
+		}
+
+		if(cm->src_hash != src->hash || cm->src_size != src->size || cm->method != method ||
+				cm->num_tri != tm->num_tri || !cm->num_nodes ||
+				cm->num_nodes > 2 * cm->num_tri ||
+				!valid_range(ac, cm->nodes_offs, cm->num_nodes * sizeof(struct bvhnode)) ||
+				!valid_range(ac, cm->prims_offs, cm->num_tri * sizeof(int)) ||
+				!valid_range(ac, cm->vert_offs, cm->num_tri * 9 * sizeof(float)) ||
+				!valid_bvh((struct bvhnode*)(base + cm->nodes_offs), cm->num_nodes,
+					(int*)(base + cm->prims_offs), cm->num_tri)) {
+			break;
+		}
+
+		/* the mapping is read-only, mesh BVHs are never modified */
+		tm->bvh.nodes = (struct bvhnode*)(base + cm->nodes_offs);
+		tm->bvh.num_nodes = cm->num_nodes;
+		tm->bvh.prims = (int*)(base + cm->prims_offs);
+		tm->bvh.num_prims = cm->num_tri;
+		tm->vert = (float*)(base + cm->vert_offs);
+		tm->cache = ac;
+		ac->refcount++;
+		return 0;
+	}
+
+	ac->stale = 1;
+	return -1;
+}
+
+int acache_stale(const struct accel_cache *ac)
+{
+	return ac->stale;
+}
+
+int acache_save(const char *scnfname, struct trimesh **meshes, int count)
+{
+	int i, num;
+	char *fname, *tmpname = 0;
+	FILE *fp = 0;
+	long pos, offs;
+	struct cache_header hdr;
+	struct cache_mesh *cm = 0;
+	struct trimesh *tm;
+	struct file_hash scn;
+
+	if(!(fname = cache_fname(scnfname, CACHE_EXT)) ||
+			!(tmpname = cache_fname(scnfname, CACHE_TMPEXT))) {
+		goto err;
+	}
+	if(hash_file(scnfname, &scn) == -1) {
+		errormsg("acache_save: failed to read scene file: %s\n", scnfname);
+		goto err;
+	}
+	if(count > 0 && !(cm = calloc(count, sizeof *cm))) {
+		errormsg("acache_save: failed to allocate mesh table\n");
+		goto err;
+	}
+
+	/* lay out the file: names first, then the arrays of each mesh */
+	num = count;
+	offs = sizeof hdr + num * sizeof *cm;
+	for(i=0; i<num; i++) {
+		cm[i].name_offs = offs;
+		offs += strlen(meshes[i]->fname) + 1;
+	}
+	for(i=0; i<num; i++) {
+		tm = meshes[i];
+		cm[i].src_hash = tm->src.hash;
+		cm[i].src_size = tm->src.size;
+		cm[i].method = tm->bvh_method;
+		cm[i].num_tri = tm->num_tri;
+		cm[i].num_nodes = tm->bvh.num_nodes;
+		cm[i].nodes_offs = offs = ALIGNED(offs);
+		offs += tm->bvh.num_nodes * sizeof *tm->bvh.nodes;
+		cm[i].prims_offs = offs = ALIGNED(offs);
+		offs += tm->num_tri * sizeof *tm->bvh.prims;
+		cm[i].vert_offs = offs = ALIGNED(offs);
+		offs += tm->num_tri * 9 * sizeof *tm->vert;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, CACHE_MAGIC, 8);
+	hdr.version = CACHE_VERSION;
+	hdr.node_size = sizeof(struct bvhnode);
+	hdr.scn_hash = scn.hash;
+	hdr.scn_size = scn.size;
+	hdr.num_meshes = num;
+
+	/* write to a temporary file, and replace the cache only once it's complete */
+	if(!(fp = fopen(tmpname, "wb"))) {
+		errormsg("acache_save: failed to open %s for writing\n", tmpname);
+		goto err;
+	}
+	if(fwrite(&hdr, sizeof hdr, 1, fp) < 1 || (num && fwrite(cm, sizeof *cm, num, fp) < num)) {
+		goto werr;
+	}
+	for(i=0; i<num; i++) {
+		if(fwrite(meshes[i]->fname, 1, strlen(meshes[i]->fname) + 1, fp) <= 0) {
+			goto werr;
+		}
+	}
+	pos = ftell(fp);
+	for(i=0; i<num; i++) {
+		tm = meshes[i];
+		if(write_pad(fp, &pos, cm[i].nodes_offs) == -1 ||
+				fwrite(tm->bvh.nodes, sizeof *tm->bvh.nodes, tm->bvh.num_nodes, fp) < tm->bvh.num_nodes) {
+			goto werr;
+		}
+		pos += tm->bvh.num_nodes * sizeof *tm->bvh.nodes;
+		if(write_pad(fp, &pos, cm[i].prims_offs) == -1 ||
+				fwrite(tm->bvh.prims, sizeof *tm->bvh.prims, tm->num_tri, fp) < tm->num_tri) {
+			goto werr;
+		}
+		pos += tm->num_tri * sizeof *tm->bvh.prims;
+		if(write_pad(fp, &pos, cm[i].vert_offs) == -1 ||
+				fwrite(tm->vert, 9 * sizeof *tm->vert, tm->num_tri, fp) < tm->num_tri) {
+			goto werr;
+		}
+		pos += tm->num_tri * 9 * sizeof *tm->vert;
+	}
+	if(fclose(fp) == EOF) {
+		fp = 0;
+		goto werr;
+	}
+	fp = 0;
+
+	if(rename(tmpname, fname) == -1) {
+		/* DOS can't rename over an existing file */
+		remove(fname);
+		if(rename(tmpname, fname) == -1) {
+			errormsg("acache_save: failed to rename %s to %s\n", tmpname, fname);
+			remove(tmpname);
+			goto err;
+		}
+	}
+
+	infomsg("wrote acceleration cache: %s (%d meshes)\n", fname, num);
+	free(cm);
+	free(tmpname);
+	free(fname);
+	return 0;
+
+werr:
+	errormsg("acache_save: failed to write %s\n", tmpname);
+	if(fp) fclose(fp);
+	remove(tmpname);
+err:
+	free(cm);
+	free(tmpname);
+	free(fname);
+	return -1;
+}
+
+/* replaces the extension of the scene file name */
+static char *cache_fname(const char *scnfname, const char *ext)
+{
+	char *fname, *dot, *sep;
+
+	if(!(fname = malloc(strlen(scnfname) + strlen(ext) + 1))) {
+		errormsg("failed to allocate cache filename\n");
+		return 0;
+	}
+	strcpy(fname, scnfname);
+
+	dot = strrchr(fname, '.');
+	if((sep = strrchr(fname, '/')) && dot < sep) dot = 0;
+	if((sep = strrchr(fname, '\\')) && dot < sep) dot = 0;
+	if(dot) *dot = 0;
+
+	strcat(fname, ext);
+	return fname;
+}
+
+static int valid_range(const struct accel_cache *ac, unsigned long offs, unsigned long size)
+{
+	return (offs & (ALIGN - 1)) == 0 && offs <= ac->mf.size && size <= ac->mf.size - offs;
+}
+
+/* The hashes only tell if the mesh changed, not if the cache file is damaged,
+ * so check that traversing the BVH can't reach outside of its arrays: every
+ * node except the root must be the child of exactly one node before it, no
+ * deeper than the traversal stacks allow, and leaves must refer to valid
+ * ranges of valid primitives.
+ */
+static int valid_bvh(const struct bvhnode *nodes, int num_nodes, const int *prims, int num_prims)
+{
+	int i, j, res = 0;
+	unsigned char *depth;
+
+	if(!(depth = calloc(num_nodes, 1))) {
+		return 0;
+	}
+	depth[0] = 1;	/* 0 means no parent found yet */
+
+	for(i=0; i<num_nodes; i++) {
+		if(!depth[i] || depth[i] > BVH_MAX_DEPTH) goto end;
+
+		if(nodes[i].count) {
+			if(nodes[i].count < 0 || nodes[i].idx < 0 || nodes[i].count > num_prims ||
+					nodes[i].idx > num_prims - nodes[i].count) {
+				goto end;
+			}
+			for(j=0; j<nodes[i].count; j++) {
+				if(prims[nodes[i].idx + j] < 0 || prims[nodes[i].idx + j] >= num_prims) {
+					goto end;
+				}
+			}
+		} else {
+			if(nodes[i].idx <= i || nodes[i].idx >= num_nodes - 1 ||
+					depth[nodes[i].idx] || depth[nodes[i].idx + 1]) {
+				goto end;
+			}
+			depth[nodes[i].idx] = depth[nodes[i].idx + 1] = depth[i] + 1;
+		}
+	}
+	res = 1;
+end:
+	free(depth);
+	return res;
+}
+
+static int write_pad(FILE *fp, long *pos, long offs)
+{
+	while(*pos < offs) {
+		if(fputc(0, fp) == EOF) {
+			return -1;
+		}
+		(*pos)++;
+	}
+	return 0;
+}
@@ -0,0 +1,60 @@
+/*
+RetroRay - integrated standalone vintage modeller/renderer
+Copyright (C) 2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef ACACHE_H_
+#define ACACHE_H_
+
+#include "sizeint.h"
+
+/* Acceleration structure cache: a binary file next to a scene file, with the
+ * BVH and packed vertices of every mesh it uses, so that loading the scene
+ * again doesn't have to rebuild them. The cache is memory-mapped, and meshes
+ * found in it point straight into the mapping. Each mesh is validated by the
+ * content hash of its source file, and the BVH method it was built with.
+ */
+struct accel_cache;
+struct trimesh;
+
+struct file_hash {
+	uint32_t hash, size;
+};
+
+int hash_file(const char *fname, struct file_hash *fh);
+
+/* opens the cache of a scene file, returns 0 if it doesn't exist or isn't
+ * valid. The cache has a single reference, released by acache_close.
+ */
+struct accel_cache *acache_open(const char *scnfname);
+void acache_close(struct accel_cache *ac);
+
+/* Looks up the mesh loaded from fname, and sets up the BVH and vertices of tm
+ * to point to the cached ones. tm->num_tri must be set, and tm gets a
+ * reference to the cache. Returns -1 if the mesh isn't in the cache, or is
+ * out of date, and marks the cache as stale.
+ */
+int acache_lookup(struct accel_cache *ac, const char *fname, const struct file_hash *src,
+		int method, struct trimesh *tm);
+
+/* true if the scene file changed, or any lookup failed since acache_open */
+int acache_stale(const struct accel_cache *ac);
+
+/* (re)writes the cache of a scene file, with the supplied meshes, which must
+ * all have been loaded from files
+ */
+int acache_save(const char *scnfname, struct trimesh **meshes, int count);
+
+#endif	/* ACACHE_H_ */
@@ -150,6 +150,7 @@ void app_shutdown(void)
 #endif
 
 	free_scene(scn);
+	rend_destroy();
 
 	cleanup_logger();
 }
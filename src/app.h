@@ -124,8 +124,10 @@ void app_fullscreen(int fs);
 void app_vsync(int vsync);
 void app_rband(int x, int y, int w, int h);
 
-/* defined in scr_mod.c for convenience */
-void primray(cgm_ray *ray, int x, int y);
+/* defined in scr_mod.c for convenience. Fractional pixel coordinates are
+ * allowed, for supersampling.
+ */
+void primray(cgm_ray *ray, float x, float y);
 
 void gui_begin(void);
 void gui_end(void);
@@ -0,0 +1,144 @@
+/*
+RetroRay - integrated standalone vintage modeller/renderer
+Copyright (C) 2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/* common code for the batch renderer and the benchmark: everything the
+ * renderer needs from the modeller, without the UI
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "batch.h"
+#include "app.h"
+#include "timer.h"
+#include "rend.h"
+#include "gfxutil.h"
+#include "gaw/gaw.h"
+#include "logger.h"
+
+#if defined(__unix__) || defined(unix) || defined(__APPLE__)
+#include <sys/time.h>
+#else
+#include <time.h>
+#endif
+
+/* normally provided by app.c and scr_mod.c */
+struct scene *scn;
+const char *scn_fname;
+struct view view = {0, 20, 8};
+
+static int xres, yres;
+static float inv_pv[16];
+
+/* same camera as the modeller viewport, see mdl_display and update_projmat in
+ * scr_mod.c
+ */
+void batch_camera(int width, int height)
+{
+	float view_matrix[16], proj_matrix[16];
+	float znear = view.dist < 2.0f ? 0.1f : 0.5f;
+
+	cgm_mtranslation(view_matrix, -view.pos.x, -view.pos.y, -view.pos.z);
+	cgm_mrotate_y(view_matrix, cgm_deg_to_rad(view.theta));
+	cgm_mrotate_x(view_matrix, cgm_deg_to_rad(view.phi));
+	cgm_mtranslate(view_matrix, 0, 0, -view.dist);
+
+	xres = width;
+	yres = height;
+
+	cgm_mperspective(proj_matrix, cgm_deg_to_rad(50), (float)xres / (float)yres,
+			znear, view.dist * 32.0f);
+
+	cgm_mcopy(inv_pv, view_matrix);
+	cgm_mmul(inv_pv, proj_matrix);
+	cgm_minverse(inv_pv);
+}
+
+void primray(cgm_ray *ray, float x, float y)
+{
+	cgm_vec3 npos, farpt;
+
+	cgm_vcons(&npos, x / (float)xres, ((float)yres - y) / (float)yres, 0.0f);
+	cgm_unproject(&ray->origin, &npos, inv_pv);
+	npos.z = 1.0f;
+	cgm_unproject(&farpt, &npos, inv_pv);
+
+	ray->dir.x = farpt.x - ray->origin.x;
+	ray->dir.y = farpt.y - ray->origin.y;
+	ray->dir.z = farpt.z - ray->origin.z;
+}
+
+/* the packed pixel layout of the render buffer depends on the graphics backend
+ * the renderer was built for, so unpack it to plain RGB before saving
+ */
+int batch_save_image(const char *fname)
+{
+	int i, res;
+	unsigned char *rgb, *dptr;
+	uint32_t *sptr = renderbuf.pixels;
+
+	if(!(rgb = malloc(xres * yres * 3))) {
+		errormsg("failed to allocate %dx%d output image\n", xres, yres);
+		return -1;
+	}
+	dptr = rgb;
+	for(i=0; i<xres * yres; i++) {
+		*dptr++ = UNP_RED(*sptr);
+		*dptr++ = UNP_GREEN(*sptr);
+		*dptr++ = UNP_BLUE(*sptr);
+		sptr++;
+	}
+
+	if((res = img_save_pixels(fname, rgb, xres, yres, IMG_FMT_RGB24)) == -1) {
+		errormsg("failed to save \"%s\"\n", fname);
+	}
+	free(rgb);
+	return res;
+}
+
+unsigned long get_msec(void)
+{
+#if defined(__unix__) || defined(unix) || defined(__APPLE__)
+	static struct timeval tv0;
+	struct timeval tv;
+
+	gettimeofday(&tv, 0);
+	if(tv0.tv_sec == 0 && tv0.tv_usec == 0) {
+		tv0 = tv;
+		return 0;
+	}
+	return (tv.tv_sec - tv0.tv_sec) * 1000 + (tv.tv_usec - tv0.tv_usec) / 1000;
+#else
+	return (unsigned long)clock() * 1000 / CLOCKS_PER_SEC;
+#endif
+}
+
+/* The mesh code is shared with the modeller, and draws through gaw. Nothing is
+ * ever drawn by the batch programs, so they just need to link.
+ */
+void gaw_vertex_array(int nelem, int stride, const void *ptr) {}
+void gaw_normal_array(int stride, const void *ptr) {}
+void gaw_texcoord_array(int nelem, int stride, const void *ptr) {}
+void gaw_color_array(int nelem, int stride, const void *ptr) {}
+void gaw_draw(int prim, int nverts) {}
+void gaw_draw_indexed(int prim, const unsigned int *idxarr, int nidx) {}
+void gaw_bsphere(float x, float y, float z, float rad) {}
+void gaw_begin(int prim) {}
+void gaw_end(void) {}
+void gaw_vertex3f(float x, float y, float z) {}
+int gaw_compile_begin(void) { return 0; }
+void gaw_compile_end(void) {}
+void gaw_draw_compiled(int id) {}
+void gaw_free_compiled(int id) {}
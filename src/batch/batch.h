@@ -0,0 +1,29 @@
+/*
+RetroRay - integrated standalone vintage modeller/renderer
+Copyright (C) 2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef BATCH_H_
+#define BATCH_H_
+
+/* sets up the camera used by primray, from the current view and the output
+ * resolution, the same way the modeller viewport does.
+ */
+void batch_camera(int width, int height);
+
+/* saves the contents of the render buffer */
+int batch_save_image(const char *fname);
+
+#endif	/* BATCH_H_ */
@@ -0,0 +1,648 @@
+/*
+RetroRay - integrated standalone vintage modeller/renderer
+Copyright (C) 2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/* retroray-bench: renders a set of canonical scenes built in code, and reports
+ * render times and ray throughput, in a machine-readable format.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "batch.h"
+#include "app.h"
+#include "timer.h"
+#include "rend.h"
+#include "scene.h"
+#include "cscene.h"
+#include "cmesh.h"
+#include "meshgen.h"
+#include "trimesh.h"
+#include "texture.h"
+#include "packet.h"
+#include "tpool.h"
+#include "options.h"
+#include "logger.h"
+
+enum { FMT_CSV, FMT_JSON };
+
+struct bench_scene {
+	const char *name;
+	int (*build)(struct scene *scn);
+};
+
+/* per-stage timings, measured single-threaded with the same compiled scene
+ * queries the renderer uses
+ */
+struct stage {
+	unsigned long count, msec;
+};
+
+struct result {
+	const char *name;
+	int num_obj, num_lights;
+	unsigned long rend_msec;
+	struct stage prim, shadow, refl;
+};
+
+static int build_spheres(struct scene *scn);
+static int build_boxes(struct scene *scn);
+static int build_lights(struct scene *scn);
+static int build_floor(struct scene *scn);
+static int build_mesh(struct scene *scn);
+
+static struct bench_scene scenes[] = {
+	{"spheres", build_spheres},
+	{"boxes", build_boxes},
+	{"lights", build_lights},
+	{"floor", build_floor},
+	{"mesh", build_mesh},
+	{0, 0}
+};
+
+static int xres = 640, yres = 480;
+static int repeats = 3;
+static int format = FMT_CSV;
+static const char *outfname;
+static int nosimd;
+static char *sel[16];
+static int num_sel;
+
+/* texture maps are not owned by their materials, and have to be freed here */
+static struct texture *textures[8];
+static int num_textures;
+
+static struct cscene csc;
+
+static int run_bench(struct bench_scene *bs, struct result *res);
+static void measure_stages(struct result *res);
+static void print_header(FILE *fp);
+static void print_result(FILE *fp, const struct result *res, int first);
+static void print_footer(FILE *fp);
+static int parse_args(int argc, char **argv);
+
+
+int main(int argc, char **argv)
+{
+	int i, j, count = 0;
+	struct result res;
+	FILE *fp = stdout;
+
+	init_logger();
+	add_log_stream(stderr);
+
+	load_options(CFGFILE);
+
+	if(parse_args(argc, argv) == -1) {
+		return 1;
+	}
+
+	if(outfname && !(fp = fopen(outfname, "wb"))) {
+		errormsg("failed to open output file: %s\n", outfname);
+		return 1;
+	}
+
+	if(rend_init() == -1) {
+		return 1;
+	}
+	if(nosimd) {
+		packet_init(0);
+	}
+	if(opt.rend_threads <= 0) {
+		opt.rend_threads = tpool_num_processors();
+	}
+
+	print_header(fp);
+	for(i=0; scenes[i].name; i++) {
+		if(num_sel) {
+			for(j=0; j<num_sel; j++) {
+				if(strcmp(sel[j], scenes[i].name) == 0) break;
+			}
+			if(j >= num_sel) continue;
+		}
+
+		if(run_bench(scenes + i, &res) == -1) {
+			return 1;
+		}
+		print_result(fp, &res, count++ == 0);
+		fflush(fp);
+	}
+	print_footer(fp);
+
+	if(fp != stdout) {
+		fclose(fp);
+	}
+	rend_destroy();
+	cleanup_logger();
+	return 0;
+}
+
+static int run_bench(struct bench_scene *bs, struct result *res)
+{
+	int i;
+	unsigned long t0, dt;
+
+	if(!(scn = create_scene())) {
+		return -1;
+	}
+	view.theta = 0;
+	view.phi = 20;
+	view.dist = 8;
+	cgm_vcons(&view.pos, 0, 0, 0);
+
+	if(bs->build(scn) == -1) {
+		errormsg("failed to build benchmark scene: %s\n", bs->name);
+		free_scene(scn);
+		return -1;
+	}
+	scn_update_accel(scn);
+
+	memset(res, 0, sizeof *res);
+	res->name = bs->name;
+	res->num_lights = scn_num_lights(scn);
+	res->num_obj = scn_num_objects(scn) - res->num_lights;
+
+	batch_camera(xres, yres);
+	rend_size(xres, yres);
+
+	/* keep the best of a few runs, to filter out noise */
+	for(i=0; i<repeats; i++) {
+		rend_invalidate();
+		rend_begin(0, 0, 0, 0);
+		t0 = get_msec();
+		while(render(0));
+		dt = get_msec() - t0;
+
+		if(!i || dt < res->rend_msec) {
+			res->rend_msec = dt;
+		}
+	}
+	infomsg("%s: %dx%d in %lu ms\n", bs->name, xres, yres, res->rend_msec);
+
+	csc_init(&csc);
+	if(csc_update(&csc, scn) != -1) {
+		measure_stages(res);
+	}
+	csc_destroy(&csc);
+
+	free_scene(scn);
+	scn = 0;
+	for(i=0; i<num_textures; i++) {
+		free_texture(textures[i]);
+	}
+	num_textures = 0;
+	return 0;
+}
+
+/* Breaks down the cost of the main kinds of rays: primary rays for every
+ * pixel, shadow rays from every primary hit to every light which casts
+ * shadows, and one bounce of reflection rays from reflective surfaces,
+ * constructed exactly like shade does.
+ */
+static void measure_stages(struct result *res)
+{
+	int i, j, npix = xres * yres, num_lights;
+	unsigned long t0;
+	struct rayhit *hits;
+	unsigned char *valid;
+	cgm_ray ray;
+	cgm_vec3 norm, vdir;
+	struct rayhit rhit;
+	struct light *lt;
+
+	if(!(hits = malloc(npix * sizeof *hits)) || !(valid = malloc(npix))) {
+		errormsg("failed to allocate %d hits for stage timings\n", npix);
+		free(hits);
+		return;
+	}
+
+	t0 = get_msec();
+	for(i=0; i<npix; i++) {
+		primray(&ray, (float)(i % xres), (float)(i / xres));
+		valid[i] = csc_intersect(&csc, &ray, hits + i);
+	}
+	res->prim.msec = get_msec() - t0;
+	res->prim.count = npix;
+
+	num_lights = scn_num_lights(scn);
+	t0 = get_msec();
+	for(i=0; i<npix; i++) {
+		if(!valid[i]) continue;
+		for(j=0; j<num_lights; j++) {
+			lt = scn->lights[j];
+			if(!lt->shadows) continue;
+
+			ray.origin = hits[i].pos;
+			ray.dir = lt->pos;
+			cgm_vsub(&ray.dir, &hits[i].pos);
+			csc_occluded(&csc, &ray);
+			res->shadow.count++;
+		}
+	}
+	res->shadow.msec = get_msec() - t0;
+
+	t0 = get_msec();
+	for(i=0; i<npix; i++) {
+		if(!valid[i] || !hits[i].obj->mtl->refl) continue;
+
+		primray(&ray, (float)(i % xres), (float)(i / xres));
+		norm = hits[i].norm;
+		cgm_vnormalize(&norm);
+		vdir = ray.dir;
+		cgm_vneg(&vdir);
+		cgm_vnormalize(&vdir);
+
+		ray.origin = hits[i].pos;
+		ray.dir = vdir;
+		cgm_vreflect(&ray.dir, &norm);
+		cgm_vscale(&ray.dir, -500.0f);
+		csc_intersect(&csc, &ray, &rhit);
+		res->refl.count++;
+	}
+	res->refl.msec = get_msec() - t0;
+
+	free(hits);
+	free(valid);
+}
+
+/* --- canonical scenes --- */
+
+static struct material *add_material(struct scene *scn, const char *name,
+		float r, float g, float b, float refl)
+{
+	struct material *mtl;
+
+	if(!(mtl = malloc(sizeof *mtl))) {
+		return 0;
+	}
+	mtl_init(mtl);
+	mtl_set_name(mtl, name);
+	cgm_vcons(&mtl->kd, r, g, b);
+	mtl->refl = refl;
+	scn_add_material(scn, mtl);
+	return mtl;
+}
+
+static struct object *add_object(struct scene *scn, int type, struct material *mtl,
+		float x, float y, float z, float sx, float sy, float sz)
+{
+	struct object *obj;
+
+	if(!(obj = create_object(type))) {
+		return 0;
+	}
+	cgm_vcons(&obj->pos, x, y, z);
+	cgm_vcons(&obj->scale, sx, sy, sz);
+	obj->xform_valid = 0;
+	obj->mtl = mtl;
+	scn_add_object(scn, obj);
+	return obj;
+}
+
+static struct light *add_light(struct scene *scn, float x, float y, float z, float energy)
+{
+	struct light *lt;
+
+	if(!(lt = create_light())) {
+		return 0;
+	}
+	cgm_vcons(&lt->pos, x, y, z);
+	set_light_energy(lt, energy);
+	scn_add_light(scn, lt);
+	return lt;
+}
+
+/* deterministic pseudo-random numbers, so that every run renders the same
+ * scenes, regardless of the C library
+ */
+static unsigned int rnd_state;
+
+static float frand(float low, float high)
+{
+	rnd_state = rnd_state * 1103515245 + 12345;
+	return low + (high - low) * (float)((rnd_state >> 8) & 0xffff) / 65535.0f;
+}
+
+/* a grid of 1024 small spheres: BVH traversal with many primitives */
+static int build_spheres(struct scene *scn)
+{
+	int i, j;
+	float x, z;
+	struct material *mtl[4];
+
+	rnd_state = 1;
+	if(!(mtl[0] = add_material(scn, "red", 1, 0.2, 0.2, 0)) ||
+			!(mtl[1] = add_material(scn, "green", 0.2, 1, 0.2, 0)) ||
+			!(mtl[2] = add_material(scn, "blue", 0.2, 0.2, 1, 0)) ||
+			!(mtl[3] = add_material(scn, "white", 1, 1, 1, 0))) {
+		return -1;
+	}
+
+	for(i=0; i<32; i++) {
+		for(j=0; j<32; j++) {
+			x = (j - 16) * 0.4f + 0.2f;
+			z = (i - 16) * 0.4f + 0.2f;
+			if(!add_object(scn, OBJ_SPHERE, mtl[(i + j) & 3], x, frand(-0.5, 0.5), z,
+						0.15, 0.15, 0.15)) {
+				return -1;
+			}
+		}
+	}
+	return add_light(scn, -5, 10, 5, 1) ? 0 : -1;
+}
+
+/* reflective boxes around a reflective sphere: secondary ray workload */
+static int build_boxes(struct scene *scn)
+{
+	int i;
+	float theta;
+	struct material *mirror, *mtl;
+	struct object *obj;
+
+	if(!(mirror = add_material(scn, "mirror", 0.2, 0.2, 0.2, 0.8)) ||
+			!(mtl = add_material(scn, "gold", 0.8, 0.6, 0.2, 0.4))) {
+		return -1;
+	}
+
+	for(i=0; i<16; i++) {
+		theta = (float)i * CGM_PI / 8.0f;
+		if(!(obj = add_object(scn, OBJ_BOX, mtl, cos(theta) * 3.0f, 0, sin(theta) * 3.0f,
+						0.6, 1.5, 0.6))) {
+			return -1;
+		}
+		cgm_qrotation(&obj->rot, theta, 0, 1, 0);
+	}
+	if(!add_object(scn, OBJ_SPHERE, mirror, 0, 0, 0, 1.5, 1.5, 1.5) ||
+			!add_object(scn, OBJ_BOX, mirror, 0, -2, 0, 10, 0.2, 10)) {
+		return -1;
+	}
+	return add_light(scn, 0, 8, 6, 1) ? 0 : -1;
+}
+
+/* a few objects lit by 16 shadow-casting lights: shadow ray workload */
+static int build_lights(struct scene *scn)
+{
+	int i;
+	float theta;
+	struct material *mtl;
+
+	rnd_state = 2;
+	if(!(mtl = add_material(scn, "white", 1, 1, 1, 0))) {
+		return -1;
+	}
+	for(i=0; i<24; i++) {
+		if(!add_object(scn, OBJ_SPHERE, mtl, frand(-3, 3), frand(-0.5, 1.5), frand(-3, 3),
+					0.4, 0.4, 0.4)) {
+			return -1;
+		}
+	}
+	if(!add_object(scn, OBJ_BOX, mtl, 0, -1.2, 0, 10, 0.2, 10)) {
+		return -1;
+	}
+
+	for(i=0; i<16; i++) {
+		theta = (float)i * CGM_PI / 8.0f;
+		if(!add_light(scn, cos(theta) * 6.0f, 6, sin(theta) * 6.0f, 1.0f / 8.0f)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* textured floor with a few objects: texture lookup and a large occluder */
+static int build_floor(struct scene *scn)
+{
+	struct material *floor, *mtl;
+	struct tex_chess *tex;
+
+	if(!(tex = (struct tex_chess*)create_texture(TEX_CHESS))) {
+		return -1;
+	}
+	textures[num_textures++] = (struct texture*)tex;
+	cgm_vcons(&tex->scale, 8, 8, 8);
+	cgm_vcons(tex->color, 1, 1, 1);
+	cgm_vcons(tex->color + 1, 0.1, 0.1, 0.1);
+
+	if(!(floor = add_material(scn, "floor", 1, 1, 1, 0.2)) ||
+			!(mtl = add_material(scn, "orange", 1, 0.5, 0.1, 0))) {
+		return -1;
+	}
+	floor->texmap = (struct texture*)tex;
+
+	if(!add_object(scn, OBJ_BOX, floor, 0, -1.2, 0, 20, 0.2, 20) ||
+			!add_object(scn, OBJ_SPHERE, mtl, -1.5, 0, 0, 1, 1, 1) ||
+			!add_object(scn, OBJ_BOX, mtl, 1.5, 0, 0, 1.5, 2, 1.5) ||
+			!add_object(scn, OBJ_SPHERE, floor, 0, 0.5, -3, 1.5, 1.5, 1.5)) {
+		return -1;
+	}
+	return add_light(scn, -4, 8, 6, 1) ? 0 : -1;
+}
+
+/* a few instances of a finely tesselated torus: triangle mesh traversal */
+static int build_mesh(struct scene *scn)
+{
+	int i;
+	float theta;
+	struct material *mtl, *floor;
+	struct cmesh *cm;
+	struct trimesh *tm;
+	struct object *obj;
+
+	if(!(mtl = add_material(scn, "blue", 0.3, 0.4, 1, 0.3)) ||
+			!(floor = add_material(scn, "floor", 1, 1, 1, 0))) {
+		return -1;
+	}
+
+	if(!(cm = cmesh_alloc())) {
+		return -1;
+	}
+	gen_torus(cm, 1, 0.4, 512, 256, 1, 1);
+	if(!(tm = create_trimesh(cm))) {
+		cmesh_free(cm);
+		return -1;
+	}
+
+	for(i=0; i<3; i++) {
+		theta = (float)i * CGM_PI * 2.0f / 3.0f;
+		if(!(obj = add_object(scn, OBJ_MESH, mtl, cos(theta) * 2.0f, 0, sin(theta) * 2.0f,
+						1, 1, 1))) {
+			free_trimesh(tm);
+			return -1;
+		}
+		cgm_qrotation(&obj->rot, theta, 1, 0, 0);
+		set_object_mesh((struct meshobj*)obj, tm);
+	}
+	free_trimesh(tm);	/* the objects hold their own references */
+
+	if(!add_object(scn, OBJ_BOX, floor, 0, -1.6, 0, 10, 0.2, 10)) {
+		return -1;
+	}
+	return add_light(scn, -4, 8, 6, 1) ? 0 : -1;
+}
+
+/* --- output --- */
+
+static double mrays(unsigned long count, unsigned long msec)
+{
+	return msec ? (double)count / ((double)msec * 1000.0) : 0.0;
+}
+
+static void print_header(FILE *fp)
+{
+	if(format == FMT_JSON) {
+		fprintf(fp, "{\n\t\"kernel\": \"%s\",\n\t\"threads\": %d,\n\t\"results\": [",
+				packet_kernel_name(), opt.rend_threads);
+	} else {
+		fprintf(fp, "scene,objects,lights,width,height,threads,kernel,render_ms,mpixels_sec,"
+				"primary_rays,primary_ms,primary_mrays_sec,shadow_rays,shadow_ms,"
+				"shadow_mrays_sec,refl_rays,refl_ms,refl_mrays_sec\n");
+	}
+}
+
+static void print_result(FILE *fp, const struct result *res, int first)
+{
+	double mpix = mrays((unsigned long)xres * yres, res->rend_msec);
+
+	if(format == FMT_JSON) {
+		fprintf(fp, "%s\n\t\t{\"scene\": \"%s\", \"objects\": %d, \"lights\": %d, "
+				"\"width\": %d, \"height\": %d, \"render_ms\": %lu, \"mpixels_sec\": %.3f,\n",
+				first ? "" : ",", res->name, res->num_obj, res->num_lights, xres, yres,
+				res->rend_msec, mpix);
+		fprintf(fp, "\t\t\"primary\": {\"rays\": %lu, \"ms\": %lu, \"mrays_sec\": %.3f},\n",
+				res->prim.count, res->prim.msec, mrays(res->prim.count, res->prim.msec));
+		fprintf(fp, "\t\t\"shadow\": {\"rays\": %lu, \"ms\": %lu, \"mrays_sec\": %.3f},\n",
+				res->shadow.count, res->shadow.msec, mrays(res->shadow.count, res->shadow.msec));
+		fprintf(fp, "\t\t\"reflection\": {\"rays\": %lu, \"ms\": %lu, \"mrays_sec\": %.3f}}",
+				res->refl.count, res->refl.msec, mrays(res->refl.count, res->refl.msec));
+	} else {
+		fprintf(fp, "%s,%d,%d,%d,%d,%d,%s,%lu,%.3f,", res->name, res->num_obj,
+				res->num_lights, xres, yres, opt.rend_threads, packet_kernel_name(),
+				res->rend_msec, mpix);
+		fprintf(fp, "%lu,%lu,%.3f,%lu,%lu,%.3f,%lu,%lu,%.3f\n",
+				res->prim.count, res->prim.msec, mrays(res->prim.count, res->prim.msec),
+				res->shadow.count, res->shadow.msec, mrays(res->shadow.count, res->shadow.msec),
+				res->refl.count, res->refl.msec, mrays(res->refl.count, res->refl.msec));
+	}
+}
+
+static void print_footer(FILE *fp)
+{
+	if(format == FMT_JSON) {
+		fprintf(fp, "\n\t]\n}\n");
+	}
+}
+
+static const char *usage_fmt = "Usage: %s [options] [scene names]\n"
+	"Options:\n"
+	"  -s <WxH>: render resolution (default: 640x480)\n"
+	"  -t <n>: number of render threads (default: one per processor)\n"
+	"  -r <n>: render each scene n times, and keep the best time (default: 3)\n"
+	"  -f <csv|json>: output format (default: csv)\n"
+	"  -o <file>: write results to a file instead of stdout\n"
+	"  -P: disable the SIMD packet kernel\n"
+	"  -l: list benchmark scenes and exit\n"
+	"  -h: print usage and exit\n"
+	"Runs all benchmark scenes, unless some are named on the command line.\n";
+
+static int parse_args(int argc, char **argv)
+{
+	int i, j;
+
+	for(i=1; i<argc; i++) {
+		if(argv[i][0] == '-') {
+			if(argv[i][2] != 0) {
+				goto inval;
+			}
+			switch(argv[i][1]) {
+			case 's':
+				if(!argv[++i]) goto missing;
+				if(sscanf(argv[i], "%dx%d", &xres, &yres) != 2 || xres <= 0 || yres <= 0) {
+					fprintf(stderr, "invalid resolution: %s\n", argv[i]);
+					return -1;
+				}
+				break;
+
+			case 't':
+				if(!argv[++i]) goto missing;
+				opt.rend_threads = atoi(argv[i]);
+				break;
+
+			case 'r':
+				if(!argv[++i] || (repeats = atoi(argv[i])) < 1) {
+					fprintf(stderr, "-r must be followed by a positive number of runs\n");
+					return -1;
+				}
+				break;
+
+			case 'f':
+				if(!argv[++i]) goto missing;
+				if(strcmp(argv[i], "csv") == 0) {
+					format = FMT_CSV;
+				} else if(strcmp(argv[i], "json") == 0) {
+					format = FMT_JSON;
+				} else {
+					fprintf(stderr, "invalid output format: %s\n", argv[i]);
+					return -1;
+				}
+				break;
+
+			case 'o':
+				if(!argv[++i]) goto missing;
+				outfname = argv[i];
+				break;
+
+			case 'P':
+				nosimd = 1;
+				break;
+
+			case 'l':
+				for(j=0; scenes[j].name; j++) {
+					printf("%s\n", scenes[j].name);
+				}
+				exit(0);
+
+			case 'h':
+				printf(usage_fmt, argv[0]);
+				exit(0);
+
+			default:
+				goto inval;
+			}
+
+		} else {
+			for(j=0; scenes[j].name; j++) {
+				if(strcmp(scenes[j].name, argv[i]) == 0) break;
+			}
+			if(!scenes[j].name) {
+				fprintf(stderr, "unknown benchmark scene: %s\n", argv[i]);
+				return -1;
+			}
+			if(num_sel >= sizeof sel / sizeof *sel) {
+				fprintf(stderr, "too many scenes on the command line\n");
+				return -1;
+			}
+			sel[num_sel++] = argv[i];
+		}
+	}
+	return 0;
+
+missing:
+	fprintf(stderr, "%s must be followed by an argument\n", argv[i - 1]);
+	return -1;
+inval:
+	fprintf(stderr, "invalid option: %s\n", argv[i]);
+	fprintf(stderr, usage_fmt, argv[0]);
+	return -1;
+}
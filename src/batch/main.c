@@ -0,0 +1,247 @@
+/*
+RetroRay - integrated standalone vintage modeller/renderer
+Copyright (C) 2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/* retroray-render: headless batch renderer, without any of the UI and graphics
+ * dependencies of the modeller
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "batch.h"
+#include "app.h"
+#include "timer.h"
+#include "rend.h"
+#include "scene.h"
+#include "options.h"
+#include "logger.h"
+#include "cmesh.h"
+
+static const char *outfname;
+static const char *mesh_fname;
+static int xres, yres;
+static int maxdepth = -1;
+
+static int convert_mesh(const char *fname);
+static int parse_args(int argc, char **argv);
+
+
+int main(int argc, char **argv)
+{
+	int res = 1, passes = 0;
+	unsigned long t0, dt;
+
+	init_logger();
+	add_log_stream(stderr);
+
+	load_options(CFGFILE);
+	xres = opt.xres;
+	yres = opt.yres;
+
+	if(parse_args(argc, argv) == -1) {
+		goto end;
+	}
+
+	/* before loading the scene, so that meshes are loaded with the render threads */
+	if(rend_init() == -1) {
+		goto end;
+	}
+	if(mesh_fname) {
+		if(convert_mesh(mesh_fname) != -1) {
+			res = 0;
+		}
+		goto end;
+	}
+	if(!outfname) {
+		outfname = "render.png";
+	}
+
+	if(!(scn = create_scene())) {
+		goto end;
+	}
+	if(scn_load(scn, scn_fname) == -1) {
+		goto end;
+	}
+	if(maxdepth >= 0) {
+		max_ray_depth = maxdepth;
+	}
+	batch_camera(xres, yres);
+
+	rend_size(xres, yres);
+	rend_begin(0, 0, 0, 0);
+
+	t0 = get_msec();
+	while(render(0)) {
+		passes++;
+	}
+	dt = get_msec() - t0;
+	infomsg("rendered %dx%d (%d passes) in %lu.%03lu sec\n", xres, yres, passes + 1,
+			dt / 1000, dt % 1000);
+
+	if(batch_save_image(outfname) == -1) {
+		goto end;
+	}
+	infomsg("saved render: %s\n", outfname);
+	res = 0;
+
+end:
+	/* all of these are safe to call even if the corresponding init failed */
+	rend_destroy();
+	free_scene(scn);
+	cleanup_logger();
+	return res;
+}
+
+/* writes the mesh in the binary format, which cmesh_load maps without parsing */
+static int convert_mesh(const char *fname)
+{
+	struct cmesh *cm;
+	char *suffix, *binfname = 0;
+
+	if(!outfname) {
+		if(!(binfname = malloc(strlen(fname) + 5))) {
+			errormsg("failed to allocate output filename\n");
+			return -1;
+		}
+		strcpy(binfname, fname);
+		if((suffix = strrchr(binfname, '.')) && !strpbrk(suffix, "/\\")) {
+			*suffix = 0;
+		}
+		strcat(binfname, ".rrm");
+		outfname = binfname;
+	}
+
+	if(!(cm = cmesh_alloc())) {
+		errormsg("failed to allocate mesh\n");
+		free(binfname);
+		return -1;
+	}
+	if(cmesh_load(cm, fname) == -1) {
+		cmesh_free(cm);
+		free(binfname);
+		return -1;
+	}
+	if(cmesh_dump_bin(cm, outfname) == -1) {
+		errormsg("failed to write binary mesh: %s\n", outfname);
+		cmesh_free(cm);
+		free(binfname);
+		return -1;
+	}
+	infomsg("saved binary mesh: %s\n", outfname);
+
+	cmesh_free(cm);
+	free(binfname);
+	return 0;
+}
+
+static const char *usage_fmt = "Usage: %s [options] <scene file>\n"
+	"Options:\n"
+	"  -o <file>: output image filename (default: render.png)\n"
+	"  -s <WxH>: output resolution (default: from " CFGFILE ", or 640x480)\n"
+	"  -t <n>: number of render threads (default: one per processor)\n"
+	"  -d <n>: maximum ray depth\n"
+	"  -a <n>: antialiasing with NxN supersampling on every pixel\n"
+	"  -A <n>: adaptive antialiasing, NxN supersampling where neighbouring pixels differ\n"
+	"  -T <thres>: adaptive antialiasing threshold (0-255, default: 16)\n"
+	"  -m <mesh>: convert a mesh file to the binary mesh format and exit\n"
+	"             (output: -o, or the mesh filename with a .rrm suffix)\n"
+	"  -h: print usage and exit\n";
+
+static int parse_args(int argc, char **argv)
+{
+	int i;
+
+	for(i=1; i<argc; i++) {
+		if(argv[i][0] == '-') {
+			if(argv[i][2] != 0) {
+				goto inval;
+			}
+			switch(argv[i][1]) {
+			case 'o':
+				if(!argv[++i]) goto missing;
+				outfname = argv[i];
+				break;
+
+			case 's':
+				if(!argv[++i]) goto missing;
+				if(sscanf(argv[i], "%dx%d", &xres, &yres) != 2 || xres <= 0 || yres <= 0) {
+					fprintf(stderr, "invalid resolution: %s\n", argv[i]);
+					return -1;
+				}
+				break;
+
+			case 't':
+				if(!argv[++i]) goto missing;
+				opt.rend_threads = atoi(argv[i]);
+				break;
+
+			case 'd':
+				if(!argv[++i] || (maxdepth = atoi(argv[i])) < 1) {
+					fprintf(stderr, "-d must be followed by a positive ray depth\n");
+					return -1;
+				}
+				break;
+
+			case 'a':
+			case 'A':
+				if(!argv[++i] || (opt.rend_aa = atoi(argv[i])) < 1) {
+					fprintf(stderr, "%s must be followed by the supersampling grid size\n", argv[i - 1]);
+					return -1;
+				}
+				opt.rend_aa_adaptive = argv[i - 1][1] == 'A';
+				break;
+
+			case 'T':
+				if(!argv[++i]) goto missing;
+				opt.rend_aa_thres = atoi(argv[i]);
+				break;
+
+			case 'm':
+				if(!argv[++i]) goto missing;
+				mesh_fname = argv[i];
+				break;
+
+			case 'h':
+				printf(usage_fmt, argv[0]);
+				exit(0);
+
+			default:
+				goto inval;
+			}
+
+		} else {
+			if(scn_fname) {
+				fprintf(stderr, "unexpected argument: %s\n", argv[i]);
+				return -1;
+			}
+			scn_fname = argv[i];
+		}
+	}
+
+	if(!scn_fname && !mesh_fname) {
+		fprintf(stderr, usage_fmt, argv[0]);
+		return -1;
+	}
+	return 0;
+
+missing:
+	fprintf(stderr, "%s must be followed by an argument\n", argv[i - 1]);
+	return -1;
+inval:
+	fprintf(stderr, "invalid option: %s\n", argv[i]);
+	fprintf(stderr, usage_fmt, argv[0]);
+	return -1;
+}
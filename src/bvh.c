@@ -0,0 +1,926 @@
+/*
+RetroRay - integrated standalone vintage modeller/renderer
+Copyright (C) 2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include "bvh.h"
+#include "tpool.h"
+#include "timer.h"
+#include "logger.h"
+#include "sizeint.h"
+
+#define SAH_BINS		16
+#define SAH_TRAV_COST	1.0f
+#define SAH_ISECT_COST	1.0f
+/* SAH leaves can hold more than BVH_LEAF_PRIMS, when splitting doesn't pay off */
+#define SAH_MAX_LEAF	16
+
+/* parallel builds only for large hierarchies, split in at least this many
+ * subtree tasks per thread, of no fewer than PAR_MIN_TASK primitives each
+ */
+#define PAR_MIN_PRIMS	16384
+#define PAR_TASKS		8
+#define PAR_MIN_TASK	1024
+
+/* only log builds of this size as info, smaller ones are just debug messages */
+#define LOG_MIN_PRIMS	1024
+
+struct subtree {
+	int nidx, start, count, depth;
+};
+
+struct build {
+	const struct aabox *primbox;
+	const cgm_vec3 *cent;	/* primitive centroids */
+	const uint32_t *code;	/* morton codes of the centroids, for BVH_LBVH */
+	int *prims;
+	int method;
+
+	struct bvhnode *nodes;
+	int num_nodes;
+
+	/* parallel build: subtrees up to task_prims get deferred in the task list,
+	 * and are built later each into their own part of the scratch node array
+	 */
+	int task_prims;
+	struct subtree *tasks;
+	int num_tasks;
+	struct bvhnode *scratch;
+};
+
+static void build_node(struct build *b, int nidx, int start, int count, int depth);
+static int split_median(struct build *b, const struct aabox *cbox, int start, int count);
+static int split_sah(struct build *b, const struct bvhnode *node,
+		const struct aabox *cbox, int start, int count, int depth);
+static int split_morton(struct build *b, int start, int count, int depth);
+static void select_nth(int *prims, const cgm_vec3 *cent, int axis, int count, int nth);
+static int calc_morton(struct build *b, uint32_t **code, int nprim);
+static void build_task(int task, int tid, void *cls);
+static void merge_subtree(struct build *b, const struct subtree *st);
+static float aabox_area(const struct aabox *box);
+static void calc_inv_dir(const cgm_ray *ray, float *inv_dir);
+static int ray_slabs(const cgm_ray *ray, const float *inv_dir, const struct aabox *box,
+		float tmax, float *tnear);
+
+static const char *method_name[] = {"median", "sah", "lbvh"};
+
+static struct thread_pool *build_tpool;
+
+
+void bvh_init(struct bvh *bvh)
+{
+	bvh->nodes = 0;
+	bvh->num_nodes = 0;
+	bvh->prims = 0;
+	bvh->num_prims = 0;
+}
+
+void bvh_destroy(struct bvh *bvh)
+{
+	free(bvh->nodes);
+	free(bvh->prims);
+	bvh_init(bvh);
+}
+
+void bvh_set_threads(struct thread_pool *tp)
+{
+	build_tpool = tp;
+}
+
+int bvh_build(struct bvh *bvh, const struct aabox *primbox, int nprim, int method)
+{
+	int i, nthr;
+	unsigned long t0, dt;
+	cgm_vec3 *cent;
+	uint32_t *code = 0;
+	struct build b;
+	float cost;
+
+	bvh_destroy(bvh);
+	if(nprim <= 0) return 0;
+
+	t0 = get_msec();
+
+	if(method < 0 || method > BVH_LBVH) {
+		method = BVH_SAH;
+	}
+
+	/* a binary tree with nprim leaves at most, can't have more than 2n-1 nodes */
+	if(!(bvh->nodes = malloc((2 * nprim - 1) * sizeof *bvh->nodes)) ||
+			!(bvh->prims = malloc(nprim * sizeof *bvh->prims)) ||
+			!(cent = malloc(nprim * sizeof *cent))) {
+		errormsg("bvh_build: failed to allocate BVH for %d primitives\n", nprim);
+		bvh_destroy(bvh);
+		return -1;
+	}
+
+	for(i=0; i<nprim; i++) {
+		bvh->prims[i] = i;
+		cent[i].x = (primbox[i].vmin.x + primbox[i].vmax.x) * 0.5f;
+		cent[i].y = (primbox[i].vmin.y + primbox[i].vmax.y) * 0.5f;
+		cent[i].z = (primbox[i].vmin.z + primbox[i].vmax.z) * 0.5f;
+	}
+	bvh->num_prims = nprim;
+
+	memset(&b, 0, sizeof b);
+	b.primbox = primbox;
+	b.cent = cent;
+	b.prims = bvh->prims;
+	b.method = method;
+	b.nodes = bvh->nodes;
+	b.num_nodes = 1;
+
+	if(method == BVH_LBVH && calc_morton(&b, &code, nprim) == -1) {
+		b.method = method = BVH_MEDIAN;
+	}
+
+	/* Large hierarchies are built in two steps: the top of the tree is split
+	 * serially, until the subtrees are small enough to go around the worker
+	 * threads, then each subtree is built in parallel, in its own part of a
+	 * scratch node array, and finally they're merged into the BVH node array.
+	 */
+	nthr = build_tpool ? tpool_num_threads(build_tpool) : 1;
+	if(nthr > 1 && nprim >= PAR_MIN_PRIMS) {
+		b.task_prims = nprim / (nthr * PAR_TASKS);
+		if(b.task_prims < PAR_MIN_TASK) b.task_prims = PAR_MIN_TASK;
+
+		if(!(b.tasks = malloc((nprim / (BVH_LEAF_PRIMS + 1) + 1) * sizeof *b.tasks)) ||
+				!(b.scratch = malloc(2 * nprim * sizeof *b.scratch))) {
+			warnmsg("bvh_build: not enough memory for a parallel build\n");
+			free(b.tasks);
+			b.tasks = 0;
+		}
+	}
+
+	build_node(&b, 0, 0, nprim, 0);
+
+	if(b.tasks) {
+		tpool_run(build_tpool, b.num_tasks, build_task, &b);
+		for(i=0; i<b.num_tasks; i++) {
+			merge_subtree(&b, b.tasks + i);
+		}
+		free(b.tasks);
+		free(b.scratch);
+	}
+	bvh->num_nodes = b.num_nodes;
+
+	free(code);
+	free(cent);
+
+	dt = get_msec() - t0;
+	cost = bvh_sah_cost(bvh);
+	if(nprim >= LOG_MIN_PRIMS) {
+		infomsg("BVH (%s): %d primitives, %d nodes, built in %lu ms, SAH cost: %.2f\n",
+				method_name[method], nprim, bvh->num_nodes, dt, cost);
+	} else {
+		dbgmsg("BVH (%s): %d primitives, %d nodes, built in %lu ms, SAH cost: %.2f\n",
+				method_name[method], nprim, bvh->num_nodes, dt, cost);
+	}
+	return 0;
+}
+
+static void build_node(struct build *b, int nidx, int start, int count, int depth)
+{
+	int i, split;
+	struct bvhnode *node = b->nodes + nidx;
+	struct aabox cbox;
+
+	aabox_init(&node->box);
+	aabox_init(&cbox);
+	for(i=0; i<count; i++) {
+		int pidx = b->prims[start + i];
+		const cgm_vec3 *c = b->cent + pidx;
+
+		aabox_union(&node->box, b->primbox + pidx);
+
+		if(c->x < cbox.vmin.x) cbox.vmin.x = c->x;
+		if(c->y < cbox.vmin.y) cbox.vmin.y = c->y;
+		if(c->z < cbox.vmin.z) cbox.vmin.z = c->z;
+		if(c->x > cbox.vmax.x) cbox.vmax.x = c->x;
+		if(c->y > cbox.vmax.y) cbox.vmax.y = c->y;
+		if(c->z > cbox.vmax.z) cbox.vmax.z = c->z;
+	}
+
+	if(count <= BVH_LEAF_PRIMS || depth >= BVH_MAX_DEPTH - 1) {
+		goto leaf;
+	}
+
+	if(b->tasks && count <= b->task_prims) {
+		struct subtree *st = b->tasks + b->num_tasks++;
+		st->nidx = nidx;
+		st->start = start;
+		st->count = count;
+		st->depth = depth;
+		return;
+	}
+
+	switch(b->method) {
+	case BVH_SAH:
+		split = split_sah(b, node, &cbox, start, count, depth);
+		break;
+	case BVH_LBVH:
+		split = split_morton(b, start, count, depth);
+		break;
+	default:
+		split = split_median(b, &cbox, start, count);
+	}
+	if(split <= 0) goto leaf;
+
+	node->idx = b->num_nodes;
+	node->count = 0;
+	b->num_nodes += 2;
+
+	build_node(b, node->idx, start, split, depth + 1);
+	build_node(b, node->idx + 1, start + split, count - split, depth + 1);
+	return;
+
+leaf:
+	node->idx = start;
+	node->count = count;
+}
+
+/* Splits at the object median of the centroids along the longest axis of their
+ * bounds. Not as good as SAH, but always balanced, so the tree depth is bounded
+ * by log2(n), which is also why the other methods fall back to it past half
+ * the maximum depth. Returns the number of primitives on the left.
+ */
+static int split_median(struct build *b, const struct aabox *cbox, int start, int count)
+{
+	int axis, half;
+	float ext[3];
+
+	ext[0] = cbox->vmax.x - cbox->vmin.x;
+	ext[1] = cbox->vmax.y - cbox->vmin.y;
+	ext[2] = cbox->vmax.z - cbox->vmin.z;
+	axis = ext[0] > ext[1] ? (ext[0] > ext[2] ? 0 : 2) : (ext[1] > ext[2] ? 1 : 2);
+
+	half = count / 2;
+	select_nth(b->prims + start, b->cent, axis, count, half);
+	return half;
+}
+
+#define CENT(p)	(*(&cent[p].x + axis))
+
+#define CALC_BIN(bin, p) \
+	do { \
+		(bin) = (int)((CENT(p) - cmin) * binscale); \
+		if((bin) >= SAH_BINS) (bin) = SAH_BINS - 1; \
+	} while(0)
+
+/* Binned SAH (Wald 2007): centroids are binned in SAH_BINS slabs along each
+ * axis, and the split between slabs with the lowest cost is chosen:
+ *   trav + isect * (area(left) * nleft + area(right) * nright) / area(node)
+ * Returns the number of primitives on the left, or 0 to make a leaf, if that's
+ * cheaper than any split.
+ */
+static int split_sah(struct build *b, const struct bvhnode *node,
+		const struct aabox *cbox, int start, int count, int depth)
+{
+	int i, j, axis, bin, best_axis, best_bin, nleft, tmp;
+	int *prims = b->prims + start;
+	const cgm_vec3 *cent = b->cent;
+	float cmin, binscale, cost, best_cost, best_scale, best_min, area;
+	struct aabox binbox[SAH_BINS], acc;
+	int bincount[SAH_BINS];
+	float right_area[SAH_BINS];
+	int right_count[SAH_BINS];
+
+	if(depth >= BVH_MAX_DEPTH / 2) {
+		return split_median(b, cbox, start, count);
+	}
+
+	/* costs are compared multiplied by the node area, to skip the division */
+	area = aabox_area(&node->box);
+	best_cost = count <= SAH_MAX_LEAF ? SAH_ISECT_COST * count * area : FLT_MAX;
+	best_axis = -1;
+	best_bin = 0;
+	best_scale = best_min = 0.0f;
+
+	for(axis=0; axis<3; axis++) {
+		cmin = (&cbox->vmin.x)[axis];
+		if((&cbox->vmax.x)[axis] - cmin <= 0.0f) continue;
+		binscale = SAH_BINS / ((&cbox->vmax.x)[axis] - cmin);
+
+		for(i=0; i<SAH_BINS; i++) {
+			aabox_init(binbox + i);
+			bincount[i] = 0;
+		}
+		for(i=0; i<count; i++) {
+			CALC_BIN(bin, prims[i]);
+			aabox_union(binbox + bin, b->primbox + prims[i]);
+			bincount[bin]++;
+		}
+
+		/* sweep from the right for the bounds of everything after each split,
+		 * then from the left, evaluating the cost of splitting before bin i
+		 */
+		aabox_init(&acc);
+		j = 0;
+		for(i=SAH_BINS-1; i>0; i--) {
+			aabox_union(&acc, binbox + i);
+			j += bincount[i];
+			right_area[i] = aabox_area(&acc);
+			right_count[i] = j;
+		}
+		aabox_init(&acc);
+		j = 0;
+		for(i=1; i<SAH_BINS; i++) {
+			aabox_union(&acc, binbox + i - 1);
+			j += bincount[i - 1];
+			if(!j || !right_count[i]) continue;
+
+			cost = SAH_TRAV_COST * area + SAH_ISECT_COST *
+				(aabox_area(&acc) * j + right_area[i] * right_count[i]);
+			if(cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_bin = i;
+				best_scale = binscale;
+				best_min = cmin;
+			}
+		}
+	}
+
+	if(best_axis == -1) {
+		/* either a leaf is cheaper, or all the centroids coincide */
+		return count <= SAH_MAX_LEAF ? 0 : split_median(b, cbox, start, count);
+	}
+
+	axis = best_axis;
+	cmin = best_min;
+	binscale = best_scale;
+	i = 0;
+	j = count - 1;
+	while(i <= j) {
+		CALC_BIN(bin, prims[i]);
+		if(bin < best_bin) {
+			i++;
+		} else {
+			tmp = prims[i];
+			prims[i] = prims[j];
+			prims[j--] = tmp;
+		}
+	}
+	nleft = i;
+
+	if(nleft <= 0 || nleft >= count) {
+		return split_median(b, cbox, start, count);
+	}
+	return nleft;
+}
+
+/* LBVH (Lauterbach et al. 2009): primitives are already sorted by the morton
+ * codes of their centroids, so the split is where the highest bit which
+ * differs in the range flips from 0 to 1. Identical codes are split in the
+ * middle.
+ */
+static int split_morton(struct build *b, int start, int count, int depth)
+{
+	int lo, hi, mid;
+	uint32_t first, last, bit;
+	const int *prims = b->prims + start;
+
+	first = b->code[prims[0]];
+	last = b->code[prims[count - 1]];
+	if(first == last || depth >= BVH_MAX_DEPTH / 2) {
+		return count / 2;
+	}
+
+	bit = (uint32_t)1 << 29;
+	while(!((first ^ last) & bit)) {
+		bit >>= 1;
+	}
+
+	/* first primitive with the bit set */
+	lo = 0;
+	hi = count - 1;
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(b->code[prims[mid]] & bit) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return lo;
+}
+
+/* quickselect: partially sorts prims, so that the nth element is in its sorted
+ * position, with all smaller centroids before it, and all larger after it.
+ */
+static void select_nth(int *prims, const cgm_vec3 *cent, int axis, int count, int nth)
+{
+	int i, j, lo, hi, tmp;
+	float pivot;
+
+	lo = 0;
+	hi = count - 1;
+	while(lo < hi) {
+		pivot = CENT(prims[(lo + hi) / 2]);
+		i = lo;
+		j = hi;
+		while(i <= j) {
+			while(CENT(prims[i]) < pivot) i++;
+			while(CENT(prims[j]) > pivot) j--;
+			if(i <= j) {
+				tmp = prims[i];
+				prims[i] = prims[j];
+				prims[j] = tmp;
+				i++;
+				j--;
+			}
+		}
+		if(nth <= j) {
+			hi = j;
+		} else if(nth >= i) {
+			lo = i;
+		} else {
+			break;
+		}
+	}
+}
+
+/* spreads the low 10 bits of x, to every third bit */
+static uint32_t spread_bits(uint32_t x)
+{
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+/* calculates 30-bit morton codes of the centroids, quantized to 1024 steps
+ * within their bounds, and radix sorts the primitives by them, 8 bits at a time
+ */
+static int calc_morton(struct build *b, uint32_t **code_ret, int nprim)
+{
+	int i, pass, shift, sum, tmp;
+	uint32_t *code;
+	int *tmpprims, *src, *dst, *swp;
+	int hist[256];
+	struct aabox cbox;
+	float scale[3];
+	const cgm_vec3 *c;
+
+	if(!(code = malloc(nprim * sizeof *code)) ||
+			!(tmpprims = malloc(nprim * sizeof *tmpprims))) {
+		warnmsg("bvh_build: not enough memory for LBVH, falling back to median splits\n");
+		free(code);
+		return -1;
+	}
+
+	aabox_init(&cbox);
+	for(i=0; i<nprim; i++) {
+		c = b->cent + i;
+		if(c->x < cbox.vmin.x) cbox.vmin.x = c->x;
+		if(c->y < cbox.vmin.y) cbox.vmin.y = c->y;
+		if(c->z < cbox.vmin.z) cbox.vmin.z = c->z;
+		if(c->x > cbox.vmax.x) cbox.vmax.x = c->x;
+		if(c->y > cbox.vmax.y) cbox.vmax.y = c->y;
+		if(c->z > cbox.vmax.z) cbox.vmax.z = c->z;
+	}
+	for(i=0; i<3; i++) {
+		float ext = (&cbox.vmax.x)[i] - (&cbox.vmin.x)[i];
+		scale[i] = ext > 0.0f ? 1023.0f / ext : 0.0f;
+	}
+
+	for(i=0; i<nprim; i++) {
+		c = b->cent + i;
+		code[i] = (spread_bits((uint32_t)((c->x - cbox.vmin.x) * scale[0])) << 2) |
+			(spread_bits((uint32_t)((c->y - cbox.vmin.y) * scale[1])) << 1) |
+			spread_bits((uint32_t)((c->z - cbox.vmin.z) * scale[2]));
+	}
+
+	/* 4 passes, so the sorted result ends up back in b->prims */
+	src = b->prims;
+	dst = tmpprims;
+	for(pass=0; pass<4; pass++) {
+		shift = pass * 8;
+		memset(hist, 0, sizeof hist);
+		for(i=0; i<nprim; i++) {
+			hist[(code[src[i]] >> shift) & 0xff]++;
+		}
+		sum = 0;
+		for(i=0; i<256; i++) {
+			tmp = hist[i];
+			hist[i] = sum;
+			sum += tmp;
+		}
+		for(i=0; i<nprim; i++) {
+			dst[hist[(code[src[i]] >> shift) & 0xff]++] = src[i];
+		}
+		swp = src;
+		src = dst;
+		dst = swp;
+	}
+
+	free(tmpprims);
+	b->code = code;
+	*code_ret = code;
+	return 0;
+}
+
+/* builds a deferred subtree in the scratch node array. A subtree of n
+ * primitives needs at most 2n-1 nodes, so starting at twice its first
+ * primitive index, it can't overlap with any other subtree.
+ */
+static void build_task(int task, int tid, void *cls)
+{
+	struct build *b = cls;
+	struct build sub;
+	const struct subtree *st = b->tasks + task;
+
+	sub = *b;
+	sub.nodes = b->scratch + 2 * st->start;
+	sub.num_nodes = 1;
+	sub.tasks = 0;
+
+	build_node(&sub, 0, st->start, st->count, st->depth);
+
+	/* stash the node count in the unused first scratch slot after the subtree */
+	sub.nodes[2 * st->count - 1].count = sub.num_nodes;
+}
+
+/* moves a subtree from the scratch array into the BVH, its root to the node
+ * which was deferred, and the rest appended to the end, so children still
+ * come after their parents.
+ */
+static void merge_subtree(struct build *b, const struct subtree *st)
+{
+	int i, num, base;
+	struct bvhnode *src, *dst;
+
+	src = b->scratch + 2 * st->start;
+	num = src[2 * st->count - 1].count;
+
+	base = b->num_nodes - 1;	/* local index 1 goes to num_nodes */
+	dst = b->nodes + st->nidx;
+	*dst = src[0];
+	if(!dst->count) dst->idx += base;
+
+	dst = b->nodes + b->num_nodes;
+	for(i=1; i<num; i++) {
+		*dst = src[i];
+		if(!dst->count) dst->idx += base;
+		dst++;
+	}
+	b->num_nodes += num - 1;
+}
+
+float bvh_sah_cost(const struct bvh *bvh)
+{
+	int i;
+	float area, root_area, cost = 0.0f;
+	const struct bvhnode *node = bvh->nodes;
+
+	if(!bvh->num_nodes || (root_area = aabox_area(&node->box)) <= 0.0f) {
+		return 0.0f;
+	}
+
+	for(i=0; i<bvh->num_nodes; i++) {
+		area = aabox_area(&node->box);
+		if(node->count) {
+			cost += SAH_ISECT_COST * node->count * area;
+		} else {
+			cost += SAH_TRAV_COST * area;
+		}
+		node++;
+	}
+	return cost / root_area;
+}
+
+int bvh_method(const char *name)
+{
+	int i;
+
+	for(i=0; i<sizeof method_name / sizeof *method_name; i++) {
+		if(strcmp(name, method_name[i]) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+const char *bvh_method_name(int method)
+{
+	if(method < 0 || method >= sizeof method_name / sizeof *method_name) {
+		return "unknown";
+	}
+	return method_name[method];
+}
+
+void bvh_refit(struct bvh *bvh, const struct aabox *primbox)
+{
+	int i, j;
+	struct bvhnode *node;
+
+	/* children are always allocated after their parents, so walking the node
+	 * array backwards visits every child before its parent
+	 */
+	node = bvh->nodes + bvh->num_nodes - 1;
+	for(i=0; i<bvh->num_nodes; i++) {
+		if(node->count) {
+			aabox_init(&node->box);
+			for(j=0; j<node->count; j++) {
+				aabox_union(&node->box, primbox + bvh->prims[node->idx + j]);
+			}
+		} else {
+			node->box = bvh->nodes[node->idx].box;
+			aabox_union(&node->box, &bvh->nodes[node->idx + 1].box);
+		}
+		node--;
+	}
+}
+
+/* per-primitive callbacks on top of the leaf traversals */
+struct prim_func {
+	bvh_isect_func func;
+	void *cls;
+};
+
+static int leaf_prims(const cgm_ray *ray, const struct bvh *bvh, int first, int count,
+		float *tmax, void *cls)
+{
+	int i, res = 0;
+	struct prim_func *pf = cls;
+
+	for(i=0; i<count; i++) {
+		if(pf->func(ray, bvh->prims[first + i], tmax, pf->cls)) {
+			res = 1;
+		}
+	}
+	return res;
+}
+
+static int leaf_prims_any(const cgm_ray *ray, const struct bvh *bvh, int first, int count,
+		float *tmax, void *cls)
+{
+	int i;
+	struct prim_func *pf = cls;
+
+	for(i=0; i<count; i++) {
+		if(pf->func(ray, bvh->prims[first + i], tmax, pf->cls)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int bvh_intersect(const struct bvh *bvh, const cgm_ray *ray, float tmax,
+		bvh_isect_func func, void *cls)
+{
+	struct prim_func pf;
+	pf.func = func;
+	pf.cls = cls;
+	return bvh_intersect_leaves(bvh, ray, tmax, leaf_prims, &pf);
+}
+
+int bvh_any_hit(const struct bvh *bvh, const cgm_ray *ray, float tmax,
+		bvh_isect_func func, void *cls)
+{
+	struct prim_func pf;
+	pf.func = func;
+	pf.cls = cls;
+	return bvh_any_hit_leaves(bvh, ray, tmax, leaf_prims_any, &pf);
+}
+
+int bvh_intersect_leaves(const struct bvh *bvh, const cgm_ray *ray, float tmax,
+		bvh_leaf_func func, void *cls)
+{
+	int top, res = 0;
+	int hit_left, hit_right;
+	float inv_dir[3], tleft, tright, tmp;
+	const struct bvhnode *node, *left, *right, *tmpnode;
+	struct {
+		const struct bvhnode *node;
+		float tnear;
+	} stack[BVH_MAX_DEPTH];
+
+	if(!bvh->num_nodes) return 0;
+
+	calc_inv_dir(ray, inv_dir);
+
+	node = bvh->nodes;
+	if(!ray_slabs(ray, inv_dir, &node->box, tmax, &tleft)) {
+		return 0;
+	}
+
+	top = 0;
+	for(;;) {
+		if(node->count) {
+			if(func(ray, bvh, node->idx, node->count, &tmax, cls)) {
+				res = 1;
+			}
+		} else {
+			left = bvh->nodes + node->idx;
+			right = left + 1;
+			hit_left = ray_slabs(ray, inv_dir, &left->box, tmax, &tleft);
+			hit_right = ray_slabs(ray, inv_dir, &right->box, tmax, &tright);
+
+			if(hit_left && hit_right) {
+				/* descend into the nearest, and defer the other one */
+				if(tright < tleft) {
+					tmpnode = left;
+					left = right;
+					right = tmpnode;
+					tmp = tleft;
+					tleft = tright;
+					tright = tmp;
+				}
+				stack[top].node = right;
+				stack[top++].tnear = tright;
+				node = left;
+				continue;
+			}
+			if(hit_left) {
+				node = left;
+				continue;
+			}
+			if(hit_right) {
+				node = right;
+				continue;
+			}
+		}
+
+		/* pop deferred nodes, skipping any that are now further than tmax */
+		node = 0;
+		while(top > 0) {
+			top--;
+			if(stack[top].tnear <= tmax) {
+				node = stack[top].node;
+				break;
+			}
+		}
+		if(!node) break;
+	}
+
+	return res;
+}
+
+int bvh_any_hit_leaves(const struct bvh *bvh, const cgm_ray *ray, float tmax,
+		bvh_leaf_func func, void *cls)
+{
+	int top;
+	float inv_dir[3], tnear;
+	const struct bvhnode *node, *left;
+	const struct bvhnode *stack[BVH_MAX_DEPTH];
+
+	if(!bvh->num_nodes) return 0;
+
+	calc_inv_dir(ray, inv_dir);
+
+	/* no need to sort children here; any hit will do */
+	stack[0] = bvh->nodes;
+	top = 1;
+	while(top > 0) {
+		node = stack[--top];
+		if(!ray_slabs(ray, inv_dir, &node->box, tmax, &tnear)) {
+			continue;
+		}
+
+		if(node->count) {
+			if(func(ray, bvh, node->idx, node->count, &tmax, cls)) {
+				return 1;
+			}
+		} else {
+			left = bvh->nodes + node->idx;
+			stack[top++] = left + 1;
+			stack[top++] = left;
+		}
+	}
+	return 0;
+}
+
+static void calc_inv_dir(const cgm_ray *ray, float *inv_dir)
+{
+	int i;
+
+	for(i=0; i<3; i++) {
+		float d = *(&ray->dir.x + i);
+		/* avoid 0 * inf = NaN in the slab test for axis-aligned rays */
+		if(d == 0.0f) {
+			inv_dir[i] = 1e30f;
+		} else {
+			inv_dir[i] = 1.0f / d;
+		}
+	}
+}
+
+static int ray_slabs(const cgm_ray *ray, const float *inv_dir, const struct aabox *box,
+		float tmax, float *tnear)
+{
+	int i;
+	float t0, t1, tmin = 0.0f;
+	const float *orig = &ray->origin.x;
+	const float *bmin = &box->vmin.x;
+	const float *bmax = &box->vmax.x;
+
+	for(i=0; i<3; i++) {
+		/* pick the near and far planes by the direction of the ray, instead of
+		 * swapping t0 and t1, so that empty boxes (min > max) always miss
+		 */
+		if(inv_dir[i] >= 0.0f) {
+			t0 = (bmin[i] - orig[i]) * inv_dir[i];
+			t1 = (bmax[i] - orig[i]) * inv_dir[i];
+		} else {
+			t0 = (bmax[i] - orig[i]) * inv_dir[i];
+			t1 = (bmin[i] - orig[i]) * inv_dir[i];
+		}
+		if(t0 > tmin) tmin = t0;
+		if(t1 < tmax) tmax = t1;
+		if(tmin > tmax) return 0;
+	}
+
+	*tnear = tmin;
+	return 1;
+}
+
+int aabox_ray(const struct aabox *box, const cgm_ray *ray, float tmax)
+{
+	float inv_dir[3], t;
+
+	calc_inv_dir(ray, inv_dir);
+	return ray_slabs(ray, inv_dir, box, tmax, &t);
+}
+
+
+void aabox_init(struct aabox *box)
+{
+	box->vmin.x = box->vmin.y = box->vmin.z = FLT_MAX;
+	box->vmax.x = box->vmax.y = box->vmax.z = -FLT_MAX;
+}
+
+void aabox_union(struct aabox *a, const struct aabox *b)
+{
+	if(b->vmin.x < a->vmin.x) a->vmin.x = b->vmin.x;
+	if(b->vmin.y < a->vmin.y) a->vmin.y = b->vmin.y;
+	if(b->vmin.z < a->vmin.z) a->vmin.z = b->vmin.z;
+	if(b->vmax.x > a->vmax.x) a->vmax.x = b->vmax.x;
+	if(b->vmax.y > a->vmax.y) a->vmax.y = b->vmax.y;
+	if(b->vmax.z > a->vmax.z) a->vmax.z = b->vmax.z;
+}
+
+/* transforms the box and calculates the new axis-aligned bounds, by projecting
+ * the half-extents onto each axis (Arvo, Graphics Gems 1990)
+ */
+void aabox_xform(struct aabox *box, const float *m)
+{
+	int i;
+	cgm_vec3 c, ext;
+	float *bmin, *bmax, *cp, e;
+
+	if(aabox_empty(box)) return;
+
+	c.x = (box->vmin.x + box->vmax.x) * 0.5f;
+	c.y = (box->vmin.y + box->vmax.y) * 0.5f;
+	c.z = (box->vmin.z + box->vmax.z) * 0.5f;
+	ext.x = box->vmax.x - c.x;
+	ext.y = box->vmax.y - c.y;
+	ext.z = box->vmax.z - c.z;
+
+	cgm_vmul_m4v3(&c, m);
+
+	bmin = &box->vmin.x;
+	bmax = &box->vmax.x;
+	cp = &c.x;
+	for(i=0; i<3; i++) {
+		e = fabs(m[i]) * ext.x + fabs(m[4 + i]) * ext.y + fabs(m[8 + i]) * ext.z;
+		bmin[i] = cp[i] - e;
+		bmax[i] = cp[i] + e;
+	}
+}
+
+int aabox_empty(const struct aabox *box)
+{
+	return box->vmin.x > box->vmax.x || box->vmin.y > box->vmax.y ||
+		box->vmin.z > box->vmax.z;
+}
+
+static float aabox_area(const struct aabox *box)
+{
+	float dx, dy, dz;
+
+	if(aabox_empty(box)) return 0.0f;
+
+	dx = box->vmax.x - box->vmin.x;
+	dy = box->vmax.y - box->vmin.y;
+	dz = box->vmax.z - box->vmin.z;
+	return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
@@ -0,0 +1,111 @@
+/*
+RetroRay - integrated standalone vintage modeller/renderer
+Copyright (C) 2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef BVH_H_
+#define BVH_H_
+
+#include "cgmath/cgmath.h"
+
+#define BVH_MAX_DEPTH	64
+#define BVH_LEAF_PRIMS	4
+
+/* build methods */
+enum {
+	BVH_MEDIAN,		/* object median splits: balanced, fast to build */
+	BVH_SAH,		/* binned surface area heuristic: best for tracing, slowest to build */
+	BVH_LBVH		/* linear BVH from morton codes: fastest build, for interactive edits */
+};
+
+struct thread_pool;
+
+struct aabox {
+	cgm_vec3 vmin, vmax;
+};
+
+struct bvhnode {
+	struct aabox box;
+	int idx;	/* leaf: first entry in bvh->prims, interior: left child (right is idx+1) */
+	int count;	/* number of primitives for leaf nodes, 0 for interior nodes */
+};
+
+struct bvh {
+	struct bvhnode *nodes;	/* nodes[0] is the root */
+	int num_nodes;
+	int *prims;				/* primitive indices, grouped by leaf */
+	int num_prims;
+};
+
+/* called for every primitive in a leaf pierced by the ray. Should return 1 and
+ * lower *tmax to the hit distance, if the primitive was hit closer than *tmax.
+ */
+typedef int (*bvh_isect_func)(const cgm_ray *ray, int prim, float *tmax, void *cls);
+
+/* called for every leaf pierced by the ray, with the range of bvh->prims it
+ * contains. Same return value and tmax handling as bvh_isect_func.
+ */
+typedef int (*bvh_leaf_func)(const cgm_ray *ray, const struct bvh *bvh, int first,
+		int count, float *tmax, void *cls);
+
+void bvh_init(struct bvh *bvh);
+void bvh_destroy(struct bvh *bvh);
+
+/* thread pool used to build large hierarchies in parallel. Builds must not
+ * run concurrently with anything else using the pool.
+ */
+void bvh_set_threads(struct thread_pool *tp);
+
+/* build the hierarchy over nprim primitives with the supplied bounding boxes,
+ * using one of the BVH_* methods. Logs the build time and SAH cost.
+ */
+int bvh_build(struct bvh *bvh, const struct aabox *primbox, int nprim, int method);
+/* recalculate node bounds after primitives moved, keeping the same topology */
+void bvh_refit(struct bvh *bvh, const struct aabox *primbox);
+
+/* expected cost of tracing a ray through the hierarchy, relative to the cost
+ * of a primitive intersection, for rays uniformly hitting the root box
+ */
+float bvh_sah_cost(const struct bvh *bvh);
+
+/* BVH_* method by name ("median", "sah", "lbvh"), or -1 */
+int bvh_method(const char *name);
+const char *bvh_method_name(int method);
+
+/* calls func for every candidate primitive, front to back, culling any subtree
+ * further than the current tmax. Returns 1 if func reported any hit.
+ */
+int bvh_intersect(const struct bvh *bvh, const cgm_ray *ray, float tmax,
+		bvh_isect_func func, void *cls);
+/* occlusion query: returns 1 as soon as func reports a hit, in no particular
+ * order. Primitives are culled against the original tmax.
+ */
+int bvh_any_hit(const struct bvh *bvh, const cgm_ray *ray, float tmax,
+		bvh_isect_func func, void *cls);
+
+/* same as bvh_intersect and bvh_any_hit, but calling func once per leaf */
+int bvh_intersect_leaves(const struct bvh *bvh, const cgm_ray *ray, float tmax,
+		bvh_leaf_func func, void *cls);
+int bvh_any_hit_leaves(const struct bvh *bvh, const cgm_ray *ray, float tmax,
+		bvh_leaf_func func, void *cls);
+
+void aabox_init(struct aabox *box);		/* empty box, ready for union operations */
+void aabox_union(struct aabox *a, const struct aabox *b);
+void aabox_xform(struct aabox *box, const float *xform);
+int aabox_empty(const struct aabox *box);
+/* returns 1 if the ray hits the box, anywhere along [0, tmax] */
+int aabox_ray(const struct aabox *box, const cgm_ray *ray, float tmax);
+
+#endif	/* BVH_H_ */
@@ -1,11 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 #include <float.h>
 #include <assert.h>
 #include "sizeint.h"
 #include "gaw/gaw.h"
 #include "cmesh.h"
+#include "mapfile.h"
 
 #define USE_DLIST
 
@@ -71,18 +73,58 @@ struct cmesh {
 	cgm_vec3 bsph_center;
 	float bsph_radius;
 	int bsph_valid;
+
+	/* binary mesh file the vertex and index arrays point into, if loaded
+	 * by cmesh_map. Copied to the heap by detach before any modification.
+	 */
+	struct mapfile map;
+};
+
+/* binary mesh file layout: header, followed by the attribute arrays, the index
+ * array, the submesh table, and the names, in native byte order (the version
+ * doesn't match otherwise). Offsets are from the start of the file, and all
+ * arrays are aligned to BIN_ALIGN bytes.
+ */
+#define BIN_MAGIC	"CMESHBIN"
+#define BIN_VERSION	1
+#define BIN_ALIGN	16
+
+struct bin_attr {
+	uint32_t nelem, count, offs, pad;
+};
+
+struct bin_submesh {
+	uint32_t istart, icount, vstart, vcount;
+	uint32_t nfaces, name_offs;
+};
+
+struct bin_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nverts, nfaces, icount;	/* icount is 0 for non-indexed meshes */
+	uint32_t idx_offs;
+	uint32_t num_sub, sub_offs;
+	uint32_t name_offs;					/* 0 if the mesh has no name */
+	float aabb_min[3], aabb_max[3];
+	float bsph_center[3], bsph_radius;
+	struct bin_attr attr[CMESH_NUM_ATTR];
 };
 
 
 static int clone(struct cmesh *cmdest, const struct cmesh *cmsrc, struct submesh *sub);
 static int pre_draw(const struct cmesh *cm, int start);
 static void post_draw(const struct cmesh *cm, int cur_sdr);
+#ifndef USE_VBO
+static void set_draw_bounds(const struct cmesh *cm);
+#endif
 static void update_buffers(struct cmesh *cm);
 #ifdef USE_VBO
 static void update_wire_ibo(struct cmesh *cm);
 #endif
 static void calc_aabb(struct cmesh *cm);
 static void calc_bsph(struct cmesh *cm);
+static int detach(struct cmesh *cm);
+static void free_data(struct cmesh *cm);
 
 static int def_nelem[CMESH_NUM_ATTR] = {3, 3, 3, 2, 4, 4, 4, 2};
 
@@ -155,14 +197,8 @@ int cmesh_init(struct cmesh *cm)
 
 void cmesh_destroy(struct cmesh *cm)
 {
-	int i;
-
 	free(cm->name);
-
-	for(i=0; i<CMESH_NUM_ATTR; i++) {
-		free(cm->vattr[i].data);
-	}
-	free(cm->idata);
+	free_data(cm);
 
 	cmesh_clear_submeshes(cm);
 
@@ -184,13 +220,14 @@ void cmesh_clear(struct cmesh *cm)
 {
 	int i;
 
+	free_data(cm);
+
 	for(i=0; i<CMESH_NUM_ATTR; i++) {
 		cm->vattr[i].nelem = 0;
 #ifdef USE_VBO
 		cm->vattr[i].vbo_valid = 0;
 		cm->vattr[i].data_valid = 0;
 #endif
-		free(cm->vattr[i].data);
 		cm->vattr[i].data = 0;
 		cm->vattr[i].count = 0;
 	}
@@ -198,7 +235,6 @@ void cmesh_clear(struct cmesh *cm)
 	cm->ibo_valid = 0;
 #endif
 	cm->idata_valid = 0;
-	free(cm->idata);
 	cm->idata = 0;
 	cm->icount = 0;
 
@@ -424,6 +460,9 @@ float *cmesh_set_attrib(struct cmesh *cm, int attr, int nelem, unsigned int num,
 	if(cm->nverts && num != cm->nverts) {
 		return 0;
 	}
+	if(detach(cm) == -1) {
+		return 0;
+	}
 
 	if(!(newarr = malloc(num * nelem * sizeof *newarr))) {
 		return 0;
@@ -456,6 +495,9 @@ float *cmesh_attrib(struct cmesh *cm, int attr)
 	if(attr < 0 || attr >= CMESH_NUM_ATTR) {
 		return 0;
 	}
+	if(detach(cm) == -1) {
+		return 0;
+	}
 #ifdef USE_VBO
 	cm->vattr[attr].vbo_valid = 0;
 #endif
@@ -531,6 +573,9 @@ int cmesh_push_attrib(struct cmesh *cm, int attr, float *v)
 	float *vptr;
 	int i, cursz, newsz;
 
+	if(detach(cm) == -1) {
+		return -1;
+	}
 	if(!cm->vattr[attr].nelem) {
 		cm->vattr[attr].nelem = def_nelem[attr];
 	}
@@ -614,6 +659,9 @@ unsigned int *cmesh_set_index(struct cmesh *cm, int num, const unsigned int *ind
 	if(nidx && num != nidx) {
 		return 0;
 	}
+	if(detach(cm) == -1) {
+		return 0;
+	}
 
 	if(!(tmp = malloc(num * sizeof *tmp))) {
 		return 0;
@@ -641,6 +689,9 @@ unsigned int *cmesh_set_index(struct cmesh *cm, int num, const unsigned int *ind
 
 unsigned int *cmesh_index(struct cmesh *cm)
 {
+	if(detach(cm) == -1) {
+		return 0;
+	}
 #ifdef USE_VBO
 	cm->ibo_valid = 0;
 #endif
@@ -696,6 +747,10 @@ int cmesh_push_index(struct cmesh *cm, unsigned int idx)
 {
 	unsigned int *iptr;
 	unsigned int cur_sz = cm->icount;
+
+	if(detach(cm) == -1) {
+		return -1;
+	}
 	if(!(iptr = realloc(cm->idata, (cur_sz + 1) * sizeof *iptr))) {
 		return -1;
 	}
@@ -963,6 +1018,9 @@ int cmesh_vertex(struct cmesh *cm, float x, float y, float z)
 {
 	int i;
 
+	if(detach(cm) == -1) {
+		return -1;
+	}
 	cgm_wcons(cm->cur_val + CMESH_ATTR_VERTEX, x, y, z, 1.0f);
 	cm->vattr[CMESH_ATTR_VERTEX].data_valid = 1;
 	cm->vattr[CMESH_ATTR_VERTEX].nelem = 3;
@@ -1320,6 +1378,7 @@ void cmesh_draw(const struct cmesh *cm)
 		glDrawArrays(GL_TRIANGLES, 0, cm->nverts);
 	}
 #else
+	set_draw_bounds(cm);
 #ifdef USE_DLIST
 	if(cm->dlist) {
 		gaw_draw_compiled(cm->dlist);
@@ -1332,6 +1391,7 @@ void cmesh_draw(const struct cmesh *cm)
 		/*glDrawArrays(GL_TRIANGLES, 0, cm->nverts);*/
 		gaw_draw(GAW_TRIANGLES, cm->nverts);
 	}
+	gaw_bsphere(0, 0, 0, -1);
 #endif
 
 	post_draw(cm, cur_sdr);
@@ -1354,11 +1414,13 @@ void cmesh_draw_range(const struct cmesh *cm, int start, int count)
 		glDrawArrays(GL_TRIANGLES, start, count);
 	}
 #else
+	set_draw_bounds(cm);
 	if(cm->idata_valid) {
 		gaw_draw_indexed(GAW_TRIANGLES, cm->idata + start, count);
 	} else {
 		gaw_draw(GAW_TRIANGLES, count);
 	}
+	gaw_bsphere(0, 0, 0, -1);
 #endif
 
 	post_draw(cm, cur_sdr);
@@ -1380,6 +1442,18 @@ void cmesh_draw_submesh(const struct cmesh *cm, int subidx)
 	}
 }
 
+#ifndef USE_VBO
+/* lets the software renderer cull or skip clipping the whole mesh at once */
+static void set_draw_bounds(const struct cmesh *cm)
+{
+	cgm_vec3 c;
+	float rad;
+
+	cmesh_bsphere(cm, &c, &rad);
+	gaw_bsphere(c.x, c.y, c.z, rad);
+}
+#endif
+
 static void post_draw(const struct cmesh *cm, int cur_sdr)
 {
 #ifdef USE_VBO
@@ -1738,6 +1812,330 @@ void cmesh_texcoord_gen_plane(struct cmesh *cm, cgm_vec3 *norm, cgm_vec3 *tang);
 void cmesh_texcoord_gen_box(struct cmesh *cm);
 void cmesh_texcoord_gen_cylinder(struct cmesh *cm);
 
+/* make private copies of all the arrays of a mapped mesh, and release the
+ * mapping, before anything is modified
+ */
+static int detach(struct cmesh *cm)
+{
+	int i;
+	float *varr[CMESH_NUM_ATTR] = {0};
+	unsigned int *iarr = 0;
+
+	if(!cm->map.data) return 0;
+
+	for(i=0; i<CMESH_NUM_ATTR; i++) {
+		if(!cm->vattr[i].data) continue;
+		if(!(varr[i] = malloc(cm->vattr[i].count * sizeof(float)))) {
+			goto err;
+		}
+		memcpy(varr[i], cm->vattr[i].data, cm->vattr[i].count * sizeof(float));
+	}
+	if(cm->idata) {
+		if(!(iarr = malloc(cm->icount * sizeof *iarr))) {
+			goto err;
+		}
+		memcpy(iarr, cm->idata, cm->icount * sizeof *iarr);
+	}
+
+	unmap_file(&cm->map);
+	memset(&cm->map, 0, sizeof cm->map);
+
+	for(i=0; i<CMESH_NUM_ATTR; i++) {
+		cm->vattr[i].data = varr[i];
+	}
+	cm->idata = iarr;
+	return 0;
+
+err:
+	for(i=0; i<CMESH_NUM_ATTR; i++) {
+		free(varr[i]);
+	}
+	return -1;
+}
+
+static void free_data(struct cmesh *cm)
+{
+	int i;
+
+	if(cm->map.data) {
+		unmap_file(&cm->map);
+		memset(&cm->map, 0, sizeof cm->map);
+		return;
+	}
+
+	for(i=0; i<CMESH_NUM_ATTR; i++) {
+		free(cm->vattr[i].data);
+	}
+	free(cm->idata);
+}
+
+/* checks that an array of num elements of the given size at offs lies within
+ * the file, and is aligned for direct access
+ */
+static int bin_array_valid(const struct mapfile *mf, uint32_t offs, uint32_t num, int size)
+{
+	if((offs & 3) || offs > mf->size) {
+		return 0;
+	}
+	return num <= (unsigned long)(mf->size - offs) / size;
+}
+
+static int bin_name_valid(const struct mapfile *mf, uint32_t offs)
+{
+	return offs > 0 && offs < mf->size &&
+		memchr((char*)mf->data + offs, 0, mf->size - offs) != 0;
+}
+
+int cmesh_map(struct cmesh *cm, struct mapfile *mf)
+{
+	int i;
+	unsigned int j;
+	char *base = mf->data;
+	struct bin_header *hdr = mf->data;
+	struct bin_submesh *sub;
+	struct submesh *sm;
+	unsigned int *idx = 0;
+
+	if(mf->size < (long)sizeof *hdr || memcmp(hdr->magic, BIN_MAGIC, sizeof hdr->magic) != 0) {
+		return 1;
+	}
+	if(hdr->version != BIN_VERSION) {
+		fprintf(stderr, "cmesh_map: unsupported binary mesh version\n");
+		return -1;
+	}
+
+	/* validate everything before touching the mesh */
+	if(!hdr->nverts || hdr->attr[CMESH_ATTR_VERTEX].nelem < 3) {
+		goto inval;
+	}
+	for(i=0; i<CMESH_NUM_ATTR; i++) {
+		struct bin_attr *attr = hdr->attr + i;
+		if(!attr->nelem) continue;
+		if(attr->nelem > 4 || attr->count % attr->nelem ||
+				attr->count / attr->nelem != hdr->nverts ||
+				!bin_array_valid(mf, attr->offs, attr->count, sizeof(float))) {
+			goto inval;
+		}
+	}
+	if(hdr->icount) {
+		if(hdr->icount % 3 || hdr->icount / 3 != hdr->nfaces ||
+				!bin_array_valid(mf, hdr->idx_offs, hdr->icount, sizeof *idx)) {
+			goto inval;
+		}
+		idx = (unsigned int*)(base + hdr->idx_offs);
+		for(j=0; j<hdr->icount; j++) {
+			if(idx[j] >= hdr->nverts) goto inval;
+		}
+	} else if(hdr->nfaces > hdr->nverts / 3) {
+		goto inval;
+	}
+	if(hdr->num_sub) {
+		if(!bin_array_valid(mf, hdr->sub_offs, hdr->num_sub, sizeof *sub)) {
+			goto inval;
+		}
+		sub = (struct bin_submesh*)(base + hdr->sub_offs);
+		for(j=0; j<hdr->num_sub; j++) {
+			if(sub[j].istart > hdr->icount || sub[j].icount > hdr->icount - sub[j].istart ||
+					sub[j].vstart > hdr->nverts || sub[j].vcount > hdr->nverts - sub[j].vstart ||
+					!bin_name_valid(mf, sub[j].name_offs)) {
+				goto inval;
+			}
+		}
+	}
+	if(hdr->name_offs && !bin_name_valid(mf, hdr->name_offs)) {
+		goto inval;
+	}
+
+	cmesh_clear(cm);
+
+	/* the submesh list is in reverse order of creation, and so is the table */
+	sub = (struct bin_submesh*)(base + hdr->sub_offs);
+	for(j=hdr->num_sub; j-- > 0;) {
+		const char *name = base + sub[j].name_offs;
+		if(!(sm = malloc(sizeof *sm)) || !(sm->name = malloc(strlen(name) + 1))) {
+			free(sm);
+			cmesh_clear_submeshes(cm);
+			return -1;
+		}
+		strcpy(sm->name, name);
+		sm->nfaces = sub[j].nfaces;
+		sm->istart = sub[j].istart;
+		sm->icount = sub[j].icount;
+		sm->vstart = sub[j].vstart;
+		sm->vcount = sub[j].vcount;
+		sm->next = cm->sublist;
+		cm->sublist = sm;
+		cm->subcount++;
+	}
+	if(hdr->name_offs && cmesh_set_name(cm, base + hdr->name_offs) == -1) {
+		cmesh_clear_submeshes(cm);
+		return -1;
+	}
+
+	for(i=0; i<CMESH_NUM_ATTR; i++) {
+		struct bin_attr *attr = hdr->attr + i;
+		if(!attr->nelem) continue;
+		cm->vattr[i].nelem = attr->nelem;
+		cm->vattr[i].data = (float*)(base + attr->offs);
+		cm->vattr[i].count = attr->count;
+		cm->vattr[i].data_valid = 1;
+	}
+	cm->nverts = hdr->nverts;
+	cm->nfaces = hdr->nfaces;
+	if(idx) {
+		cm->idata = idx;
+		cm->icount = hdr->icount;
+		cm->idata_valid = 1;
+	}
+
+	cgm_vcons(&cm->aabb_min, hdr->aabb_min[0], hdr->aabb_min[1], hdr->aabb_min[2]);
+	cgm_vcons(&cm->aabb_max, hdr->aabb_max[0], hdr->aabb_max[1], hdr->aabb_max[2]);
+	cm->aabb_valid = 1;
+	cgm_vcons(&cm->bsph_center, hdr->bsph_center[0], hdr->bsph_center[1], hdr->bsph_center[2]);
+	cm->bsph_radius = hdr->bsph_radius;
+	cm->bsph_valid = 1;
+
+	cm->map = *mf;
+	return 0;
+
+inval:
+	fprintf(stderr, "cmesh_map: invalid or truncated binary mesh\n");
+	return -1;
+}
+
+/* pad the file with zeros from offset cur to offset next */
+static int write_pad(FILE *fp, uint32_t cur, uint32_t next)
+{
+	while(cur++ < next) {
+		if(fputc(0, fp) == EOF) return -1;
+	}
+	return 0;
+}
+
+#define BIN_ALIGNED(x)	(((x) + BIN_ALIGN - 1) & ~(uint32_t)(BIN_ALIGN - 1))
+
+int cmesh_dump_bin(const struct cmesh *cm, const char *fname)
+{
+	FILE *fp = fopen(fname, "wb");
+	if(fp) {
+		int res = cmesh_dump_bin_file(cm, fp);
+		if(fclose(fp) == EOF) res = -1;
+		return res;
+	}
+	return -1;
+}
+
+int cmesh_dump_bin_file(const struct cmesh *cm, FILE *fp)
+{
+	int i;
+	uint32_t offs, name_offs;
+	struct bin_header hdr;
+	struct bin_submesh bsub;
+	struct submesh *sm;
+	const float *varr[CMESH_NUM_ATTR] = {0};
+	const unsigned int *idx = 0;
+	cgm_vec3 bmin, bmax, bcent;
+	float brad;
+
+	if(!(varr[CMESH_ATTR_VERTEX] = cmesh_attrib_ro(cm, CMESH_ATTR_VERTEX)) ||
+			cm->vattr[CMESH_ATTR_VERTEX].nelem < 3) {
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, BIN_MAGIC, sizeof hdr.magic);
+	hdr.version = BIN_VERSION;
+	hdr.nverts = cm->nverts;
+	hdr.nfaces = cm->nfaces;
+
+	cmesh_aabbox(cm, &bmin, &bmax);
+	cmesh_bsphere(cm, &bcent, &brad);
+	hdr.aabb_min[0] = bmin.x; hdr.aabb_min[1] = bmin.y; hdr.aabb_min[2] = bmin.z;
+	hdr.aabb_max[0] = bmax.x; hdr.aabb_max[1] = bmax.y; hdr.aabb_max[2] = bmax.z;
+	hdr.bsph_center[0] = bcent.x; hdr.bsph_center[1] = bcent.y; hdr.bsph_center[2] = bcent.z;
+	hdr.bsph_radius = brad;
+
+	/* lay out the arrays */
+	offs = BIN_ALIGNED(sizeof hdr);
+	for(i=0; i<CMESH_NUM_ATTR; i++) {
+		if(!cmesh_has_attrib(cm, i) || !(varr[i] = cmesh_attrib_ro(cm, i))) {
+			continue;
+		}
+		/* drop attributes which weren't specified for every vertex */
+		if(cm->vattr[i].count < cm->nverts * cm->vattr[i].nelem) {
+			if(i == CMESH_ATTR_VERTEX) return -1;
+			fprintf(stderr, "cmesh_dump_bin: skipping incomplete attribute %d\n", i);
+			continue;
+		}
+		hdr.attr[i].nelem = cm->vattr[i].nelem;
+		hdr.attr[i].count = cm->nverts * cm->vattr[i].nelem;
+		hdr.attr[i].offs = offs;
+		offs = BIN_ALIGNED(offs + hdr.attr[i].count * sizeof(float));
+	}
+	if(cmesh_indexed(cm) && (idx = cmesh_index_ro(cm))) {
+		hdr.icount = cm->nfaces * 3;
+		hdr.idx_offs = offs;
+		offs = BIN_ALIGNED(offs + hdr.icount * sizeof *idx);
+	}
+	hdr.num_sub = cm->subcount;
+	hdr.sub_offs = offs;
+	name_offs = offs + cm->subcount * sizeof bsub;
+	if(cm->name) {
+		hdr.name_offs = name_offs;
+		name_offs += strlen(cm->name) + 1;
+	}
+
+	if(fwrite(&hdr, sizeof hdr, 1, fp) < 1) {
+		return -1;
+	}
+	offs = sizeof hdr;
+	for(i=0; i<CMESH_NUM_ATTR; i++) {
+		if(!hdr.attr[i].nelem) continue;
+		if(write_pad(fp, offs, hdr.attr[i].offs) == -1 ||
+				fwrite(varr[i], sizeof(float), hdr.attr[i].count, fp) < hdr.attr[i].count) {
+			return -1;
+		}
+		offs = hdr.attr[i].offs + hdr.attr[i].count * sizeof(float);
+	}
+	if(idx) {
+		if(write_pad(fp, offs, hdr.idx_offs) == -1 ||
+				fwrite(idx, sizeof *idx, hdr.icount, fp) < hdr.icount) {
+			return -1;
+		}
+		offs = hdr.idx_offs + hdr.icount * sizeof *idx;
+	}
+	if(write_pad(fp, offs, hdr.sub_offs) == -1) {
+		return -1;
+	}
+
+	/* submesh names follow the mesh name */
+	sm = cm->sublist;
+	while(sm) {
+		bsub.istart = sm->istart;
+		bsub.icount = sm->icount;
+		bsub.vstart = sm->vstart;
+		bsub.vcount = sm->vcount;
+		bsub.nfaces = sm->nfaces;
+		bsub.name_offs = name_offs;
+		name_offs += strlen(sm->name) + 1;
+		if(fwrite(&bsub, sizeof bsub, 1, fp) < 1) {
+			return -1;
+		}
+		sm = sm->next;
+	}
+	if(cm->name && fwrite(cm->name, 1, strlen(cm->name) + 1, fp) < strlen(cm->name) + 1) {
+		return -1;
+	}
+	sm = cm->sublist;
+	while(sm) {
+		if(fwrite(sm->name, 1, strlen(sm->name) + 1, fp) < strlen(sm->name) + 1) {
+			return -1;
+		}
+		sm = sm->next;
+	}
+	return 0;
+}
+
 int cmesh_dump(const struct cmesh *cm, const char *fname)
 {
 	FILE *fp = fopen(fname, "wb");
@@ -128,6 +128,18 @@ void cmesh_texcoord_gen_cylinder(struct cmesh *cm);
 
 /* FILE I/O */
 int cmesh_load(struct cmesh *cm, const char *fname);
+/* thread pool used by cmesh_load to parse large files in parallel */
+struct thread_pool;
+void cmesh_load_threads(struct thread_pool *tp);
+
+/* binary meshes, written by cmesh_dump_bin, are loaded by cmesh_load without
+ * any parsing: cmesh_map makes the mesh use the arrays in the mapped file
+ * directly, and takes ownership of it. Returns 1 if it's not a binary mesh.
+ */
+struct mapfile;
+int cmesh_map(struct cmesh *cm, struct mapfile *mf);
+int cmesh_dump_bin(const struct cmesh *cm, const char *fname);
+int cmesh_dump_bin_file(const struct cmesh *cm, FILE *fp);
 
 int cmesh_dump(const struct cmesh *cm, const char *fname);
 int cmesh_dump_file(const struct cmesh *cm, FILE *fp);
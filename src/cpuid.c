@@ -8,6 +8,49 @@ static const char *cpuvendor(struct cpuid_info *cpu);
 
 struct cpuid_info cpuid;
 
+/* the watcom/DOS build gets read_cpuid from cpuid_s.asm */
+#ifndef __WATCOMC__
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+static void cpuid_op(uint32_t op, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+	__asm__ __volatile__ ("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+			: "a"(op), "c"(0));
+}
+
+int read_cpuid(struct cpuid_info *info)
+{
+	int i;
+	uint32_t maxext, unused[3], *bstr;
+
+	memset(info, 0, sizeof *info);
+
+	cpuid_op(0, &info->maxidx, (uint32_t*)info->vendor, (uint32_t*)(info->vendor + 8),
+			(uint32_t*)(info->vendor + 4));
+	if(info->maxidx >= 1) {
+		cpuid_op(1, &info->id, &info->rsvd0, &info->feat2, &info->feat);
+	}
+
+	/* brand string (P4 or newer) */
+	cpuid_op(0x80000000, &maxext, unused, unused + 1, unused + 2);
+	if(maxext >= 0x80000004) {
+		bstr = (uint32_t*)info->brandstr;
+		for(i=0; i<3; i++) {
+			cpuid_op(0x80000002 + i, bstr, bstr + 1, bstr + 2, bstr + 3);
+			bstr += 4;
+		}
+		info->brandstr[47] = 0;
+	}
+	return 0;
+}
+#else
+int read_cpuid(struct cpuid_info *info)
+{
+	memset(info, 0, sizeof *info);
+	return -1;
+}
+#endif
+#endif	/* !__WATCOMC__ */
+
 void print_cpuid(struct cpuid_info *cpu)
 {
 	int i, col, len;
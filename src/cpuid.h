@@ -18,6 +18,8 @@ extern struct cpuid_info cpuid;
 
 #define CPU_HAVE_MMX		(cpuid.feat & CPUID_FEAT_MMX)
 #define CPU_HAVE_MTRR		(cpuid.feat & CPUID_FEAT_MTRR)
+#define CPU_HAVE_SSE		(cpuid.feat & CPUID_FEAT_SSE)
+#define CPU_HAVE_SSE2		(cpuid.feat & CPUID_FEAT_SSE2)
 
 #define CPUID_STEPPING(id)	((id) & 0xf)
 #define CPUID_MODEL(id)		(((id) >> 4) & 0xf)
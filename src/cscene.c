@@ -0,0 +1,235 @@
+/*
+RetroRay - integrated standalone vintage modeller/renderer
+Copyright (C) 2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <float.h>
+#include "cscene.h"
+#include "scene.h"
+#include "geom.h"
+#include "bvh.h"
+#include "logger.h"
+#include "rstats.h"
+
+/* leaves are processed in chunks of this many primitives: first all the rays
+ * are transformed to the object space of each primitive, in straight loops
+ * over the arrays, and then each primitive is tested
+ */
+#define CHUNK	BVH_LEAF_PRIMS
+
+/* rays in the object space of a chunk of primitives */
+struct localrays {
+	float ox[CHUNK], oy[CHUNK], oz[CHUNK];
+	float dx[CHUNK], dy[CHUNK], dz[CHUNK];
+};
+
+struct nearest {
+	const struct cscene *csc;
+	int prim;
+	float t;
+};
+
+static void xform_rays(const struct cscene *csc, const cgm_ray *ray, int first, int count,
+		struct localrays *lr);
+static int isect_leaf(const cgm_ray *ray, const struct bvh *bvh, int first, int count,
+		float *tmax, void *cls);
+static int occl_leaf(const cgm_ray *ray, const struct bvh *bvh, int first, int count,
+		float *tmax, void *cls);
+
+
+void csc_init(struct cscene *csc)
+{
+	int i;
+
+	csc->num_prims = 0;
+	csc->type = 0;
+	for(i=0; i<12; i++) {
+		csc->inv[i] = 0;
+	}
+	csc->obj = 0;
+	csc->bvh = 0;
+	csc->accel_gen = 0;
+	csc->valid = 0;
+}
+
+void csc_destroy(struct cscene *csc)
+{
+	free(csc->type);
+	free(csc->inv[0]);
+	free(csc->obj);
+	csc_init(csc);
+}
+
+int csc_update(struct cscene *csc, const struct scene *scn)
+{
+	int i, j, n;
+	const float *mptr;
+	const struct object *obj;
+	const struct bvh *bvh = &scn->bvh;
+
+	if(csc->valid && csc->bvh == bvh && csc->accel_gen == scn->accel_gen) {
+		return 0;
+	}
+
+	n = bvh->num_prims;
+	if(n != csc->num_prims) {
+		csc_destroy(csc);
+		if(n > 0) {
+			if(!(csc->type = malloc(n)) || !(csc->inv[0] = malloc(n * 12 * sizeof(float))) ||
+					!(csc->obj = malloc(n * sizeof *csc->obj))) {
+				errormsg("failed to allocate compiled scene (%d primitives)\n", n);
+				csc_destroy(csc);
+				return -1;
+			}
+			for(i=1; i<12; i++) {
+				csc->inv[i] = csc->inv[i - 1] + n;
+			}
+		}
+		csc->num_prims = n;
+	}
+
+	for(i=0; i<n; i++) {
+		obj = scn->objects[bvh->prims[i]];
+		csc->obj[i] = (struct object*)obj;
+		csc->type[i] = obj->type;
+
+		/* cgmath matrices are column-major */
+		mptr = obj->inv_xform;
+		for(j=0; j<12; j++) {
+			csc->inv[j][i] = mptr[(j & 3) * 4 + (j >> 2)];
+		}
+	}
+
+	csc->bvh = bvh;
+	csc->accel_gen = scn->accel_gen;
+	csc->valid = 1;
+	return 0;
+}
+
+int csc_intersect(const struct cscene *csc, const cgm_ray *ray, struct rayhit *hit)
+{
+	int prim;
+	float t;
+
+	if((prim = csc_nearest(csc, ray, &t)) == -1) {
+		return 0;
+	}
+	if(hit) {
+		hit->t = t;
+		hit->obj = csc->obj[prim];
+		ray_hit_attr(ray, hit);
+	}
+	return 1;
+}
+
+int csc_nearest(const struct cscene *csc, const cgm_ray *ray, float *t)
+{
+	struct nearest res;
+
+	if(!csc->num_prims) return -1;
+
+	res.csc = csc;
+	res.prim = -1;
+	if(!bvh_intersect_leaves(csc->bvh, ray, FLT_MAX, isect_leaf, &res)) {
+		return -1;
+	}
+	*t = res.t;
+	return res.prim;
+}
+
+int csc_occluded(const struct cscene *csc, const cgm_ray *ray)
+{
+	if(!csc->num_prims) return 0;
+	return bvh_any_hit_leaves(csc->bvh, ray, 1.0f, occl_leaf, (void*)csc);
+}
+
+/* same arithmetic as cgm_rmul_mr, so that the results match ray_object_t */
+static void xform_rays(const struct cscene *csc, const cgm_ray *ray, int first, int count,
+		struct localrays *lr)
+{
+	int i;
+	float * const *m = csc->inv;
+
+	for(i=0; i<count; i++) {
+		int k = first + i;
+		lr->ox[i] = ray->origin.x * m[0][k] + ray->origin.y * m[1][k] + ray->origin.z * m[2][k] + m[3][k];
+		lr->oy[i] = ray->origin.x * m[4][k] + ray->origin.y * m[5][k] + ray->origin.z * m[6][k] + m[7][k];
+		lr->oz[i] = ray->origin.x * m[8][k] + ray->origin.y * m[9][k] + ray->origin.z * m[10][k] + m[11][k];
+		lr->dx[i] = ray->dir.x * m[0][k] + ray->dir.y * m[1][k] + ray->dir.z * m[2][k];
+		lr->dy[i] = ray->dir.x * m[4][k] + ray->dir.y * m[5][k] + ray->dir.z * m[6][k];
+		lr->dz[i] = ray->dir.x * m[8][k] + ray->dir.y * m[9][k] + ray->dir.z * m[10][k];
+	}
+}
+
+static int isect_leaf(const cgm_ray *ray, const struct bvh *bvh, int first, int count,
+		float *tmax, void *cls)
+{
+	int i, n, res = 0;
+	float t;
+	cgm_ray lray;
+	struct localrays lr;
+	struct nearest *hit = cls;
+	const struct cscene *csc = hit->csc;
+
+	while(count > 0) {
+		n = count > CHUNK ? CHUNK : count;
+		xform_rays(csc, ray, first, n, &lr);
+
+		for(i=0; i<n; i++) {
+			if(csc->type[first + i] == OBJ_LIGHT) continue;
+
+			RSTAT_ADD(obj_tests, 1);
+			cgm_vcons(&lray.origin, lr.ox[i], lr.oy[i], lr.oz[i]);
+			cgm_vcons(&lray.dir, lr.dx[i], lr.dy[i], lr.dz[i]);
+			if(ray_local_t(&lray, csc->obj[first + i], &t) && t < *tmax) {
+				hit->t = *tmax = t;
+				hit->prim = first + i;
+				res = 1;
+			}
+		}
+		first += n;
+		count -= n;
+	}
+	return res;
+}
+
+static int occl_leaf(const cgm_ray *ray, const struct bvh *bvh, int first, int count,
+		float *tmax, void *cls)
+{
+	int i, n;
+	cgm_ray lray;
+	struct localrays lr;
+	const struct cscene *csc = cls;
+
+	while(count > 0) {
+		n = count > CHUNK ? CHUNK : count;
+		xform_rays(csc, ray, first, n, &lr);
+
+		for(i=0; i<n; i++) {
+			if(csc->type[first + i] == OBJ_LIGHT) continue;
+
+			RSTAT_ADD(obj_tests, 1);
+			cgm_vcons(&lray.origin, lr.ox[i], lr.oy[i], lr.oz[i]);
+			cgm_vcons(&lray.dir, lr.dx[i], lr.dy[i], lr.dz[i]);
+			if(ray_local_occl(&lray, csc->obj[first + i])) {
+				return 1;
+			}
+		}
+		first += n;
+		count -= n;
+	}
+	return 0;
+}
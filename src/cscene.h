@@ -0,0 +1,63 @@
+/*
+RetroRay - integrated standalone vintage modeller/renderer
+Copyright (C) 2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CSCENE_H_
+#define CSCENE_H_
+
+#include "cgmath/cgmath.h"
+
+struct scene;
+struct object;
+struct bvh;
+struct rayhit;
+
+/* Compiled scene: a flat copy of what the intersection loops need from each
+ * object, stored as structure of arrays, in the order the primitives appear
+ * in the BVH leaves, so that each leaf is a contiguous range of every array.
+ * It's built by the renderer from the scene, and must be updated with
+ * csc_update whenever the scene acceleration structure changes.
+ */
+struct cscene {
+	int num_prims;
+	unsigned char *type;	/* object type (OBJ_SPHERE, OBJ_BOX, ...) */
+	/* inverse transforms, the upper 3x4 part, row-major: element (r, c) of
+	 * primitive i is inv[r * 4 + c][i]
+	 */
+	float *inv[12];
+	struct object **obj;	/* for materials and hit attributes */
+
+	const struct bvh *bvh;
+	unsigned int accel_gen;
+	int valid;
+};
+
+void csc_init(struct cscene *csc);
+void csc_destroy(struct cscene *csc);
+
+/* (re)builds the compiled scene, if the scene BVH changed since the last call.
+ * scn_update_accel must be called first.
+ */
+int csc_update(struct cscene *csc, const struct scene *scn);
+
+/* same as scn_intersect and scn_occluded */
+int csc_intersect(const struct cscene *csc, const cgm_ray *ray, struct rayhit *hit);
+int csc_occluded(const struct cscene *csc, const cgm_ray *ray);
+
+/* closest hit distance and object only, returns the primitive index or -1 */
+int csc_nearest(const struct cscene *csc, const cgm_ray *ray, float *t);
+
+#endif	/* CSCENE_H_ */
@@ -139,6 +139,11 @@ void gaw_color_array(int nelem, int stride, const void *ptr);
 void gaw_edge_flags_array(int stride, const void *ptr);
 void gaw_draw(int prim, int nverts);
 void gaw_draw_indexed(int prim, const unsigned int *idxarr, int nidx);
+/* object space bounding sphere of the following draw calls (rad < 0: none).
+ * Only used by the software pipeline, to skip draw calls outside the view
+ * frustum, and clipping for draw calls entirely inside it.
+ */
+void gaw_bsphere(float x, float y, float z, float rad);
 
 void gaw_begin(int prim);
 void gaw_end(void);
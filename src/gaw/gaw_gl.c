@@ -261,6 +261,10 @@ void gaw_zoffset(float offs)
 	glPolygonOffset(1, offs);
 }
 
+void gaw_bsphere(float x, float y, float z, float rad)
+{
+}
+
 void gaw_clear_color(float r, float g, float b, float a)
 {
 	glClearColor(r, g, b, a);
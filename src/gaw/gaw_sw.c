@@ -342,21 +342,7 @@ void gaw_swtnl_drawprim(int prim, struct vertex *v, int vnum)
 		pv[i].a = v[i].a;
 	}
 
-	/* backface culling */
-#if 0	/* TODO fix culling */
-	if(vnum > 2 && (ST->opt & (1 << GAW_CULL_FACE))) {
-		int32_t ax = pv[1].x - pv[0].x;
-		int32_t ay = pv[1].y - pv[0].y;
-		int32_t bx = pv[2].x - pv[0].x;
-		int32_t by = pv[2].y - pv[0].y;
-		int32_t cross_z = (ax >> 4) * (by >> 4) - (ay >> 4) * (bx >> 4);
-		int sign = (cross_z >> 31) & 1;
-
-		if(!(sign ^ ST->frontface)) {
-			continue;	/* back-facing */
-		}
-	}
-#endif
+	/* backface culling is done by gaw_draw_indexed, before clipping */
 
 	switch(prim) {
 	case GAW_POINTS:
@@ -41,6 +41,8 @@ static void imm_flush(void);
 static __inline void xform4_vec3(const float *mat, float *vec);
 static __inline void xform3_vec3(const float *mat, float *vec);
 static void shade(struct vertex *v);
+static int clip_bsphere(void);
+static int backface(const struct vertex *v);
 
 static struct gaw_state st;
 struct gaw_state *gaw_state;
@@ -78,6 +80,8 @@ void gaw_swtnl_reset(void)
 	st.cur_comp = -1;
 	st.cur_tex = -1;
 
+	st.bsph[3] = -1.0f;
+
 	gaw_color3f(1, 1, 1);
 
 	gaw_state = &st;
@@ -98,6 +102,14 @@ void gaw_viewport(int x, int y, int w, int h)
 	st.vport[1] = y;
 	st.vport[2] = w;
 	st.vport[3] = h;
+
+	/* polygons may extend past the viewport into the guard band, so the
+	 * rasterizer needs to clip them against it
+	 */
+	pfill_clip.x0 = x < 0 ? 0 : x;
+	pfill_clip.y0 = y < 0 ? 0 : y;
+	pfill_clip.x1 = x + w > pfill_fb.width ? pfill_fb.width : x + w;
+	pfill_clip.y1 = y + h > pfill_fb.height ? pfill_fb.height : y + h;
 }
 
 void gaw_get_viewport(int *vp)
@@ -405,6 +417,14 @@ void gaw_edge_flags_array(int stride, const void *ptr)
 	st.edgef_ptr = ptr;
 }
 
+void gaw_bsphere(float x, float y, float z, float rad)
+{
+	st.bsph[0] = x;
+	st.bsph[1] = y;
+	st.bsph[2] = z;
+	st.bsph[3] = rad;
+}
+
 void gaw_draw(int prim, int nverts)
 {
 	gaw_draw_indexed(prim, 0, nverts);
@@ -416,19 +436,127 @@ void gaw_draw(int prim, int nverts)
 
 static int prim_vcount[] = {1, 2, 3, 4, 0};
 
+static void fetch_vertex(struct vertex *v, int vidx)
+{
+	const float *vptr;
+
+	vptr = (const float*)((char*)st.vertex_ptr + vidx * st.vertex_stride);
+	v->x = vptr[0];
+	v->y = vptr[1];
+	v->z = st.vertex_nelem > 2 ? vptr[2] : 0.0f;
+	v->w = st.vertex_nelem > 3 ? vptr[3] : 1.0f;
+
+	if(st.normal_ptr) {
+		vptr = (const float*)((char*)st.normal_ptr + vidx * st.normal_stride);
+	} else {
+		vptr = &st.imm_curv.nx;
+	}
+	v->nx = vptr[0];
+	v->ny = vptr[1];
+	v->nz = vptr[2];
+
+	if(st.texcoord_ptr) {
+		vptr = (const float*)((char*)st.texcoord_ptr + vidx * st.texcoord_stride);
+	} else {
+		vptr = &st.imm_curv.u;
+	}
+	v->u = vptr[0];
+	v->v = vptr[1];
+
+	if(st.color_ptr) {
+		vptr = (const float*)((char*)st.color_ptr + vidx * st.color_stride);
+	} else {
+		vptr = st.imm_curcol;
+	}
+	v->r = (int)(vptr[0] * 255.0f);
+	v->g = (int)(vptr[1] * 255.0f);
+	v->b = (int)(vptr[2] * 255.0f);
+	v->a = st.color_nelem > 3 ? (int)(vptr[3] * 255.0f) : 255;
+}
+
+/* currently compiling geometry: don't transform, just append the vertices
+ * referenced by the draw call, and its indices, to the compiled arrays. Every
+ * vertex is stored once, so compiled geometry can use the vertex cache too.
+ */
+static void compile_draw(int prim, const unsigned int *idxarr, int nidx)
+{
+	int i, nverts;
+	unsigned int idx, base;
+	struct comp_geom *cg = st.comp + st.cur_comp;
+	struct vertex v;
+	float col[4];
+
+	cg->prim = prim;
+	base = darr_size(cg->varr) / 3;
+
+	if(idxarr) {
+		nverts = 0;
+		for(i=0; i<nidx; i++) {
+			if((int)idxarr[i] >= nverts) {
+				nverts = idxarr[i] + 1;
+			}
+			idx = base + idxarr[i];
+			darr_push(cg->iarr, &idx);
+		}
+	} else {
+		nverts = nidx;
+		for(i=0; i<nidx; i++) {
+			idx = base + i;
+			darr_push(cg->iarr, &idx);
+		}
+	}
+
+	for(i=0; i<nverts; i++) {
+		fetch_vertex(&v, i);
+
+		col[0] = v.r / 255.0f;
+		col[1] = v.g / 255.0f;
+		col[2] = v.b / 255.0f;
+		col[3] = v.a / 255.0f;
+
+		darr_push(cg->varr, &v.x);
+		darr_push(cg->varr, &v.y);
+		darr_push(cg->varr, &v.z);
+		darr_push(cg->narr, &v.nx);
+		darr_push(cg->narr, &v.ny);
+		darr_push(cg->narr, &v.nz);
+		darr_push(cg->uvarr, &v.u);
+		darr_push(cg->uvarr, &v.v);
+		darr_push(cg->carr, col);
+		darr_push(cg->carr, col + 1);
+		darr_push(cg->carr, col + 2);
+		darr_push(cg->carr, col + 3);
+	}
+}
+
+/* Indexed draw calls keep the transformed and lit vertices in a small
+ * direct-mapped cache, indexed by the low bits of the vertex index, so that
+ * vertices shared by neighbouring polygons are only processed once.
+ */
 void gaw_draw_indexed(int prim, const unsigned int *idxarr, int nidx)
 {
-	int i, j, vidx, vnum, nfaces;
+	int i, j, vidx, vnum, nfaces, clip, slot = 0;
+	unsigned int ocode[16], ocode_and, ocode_or, planes;
 	struct vertex v[16];
 	int mvtop = st.mtop[GAW_MODELVIEW];
 	int ptop = st.mtop[GAW_PROJECTION];
 	struct vertex *tmpv;
-	const float *vptr;
 
 	if(prim == GAW_QUAD_STRIP) return;	/* TODO */
 
+	nfaces = nidx / prim_vcount[prim];
+
 	if(st.cur_comp >= 0) {
-		st.comp[st.cur_comp].prim = prim;
+		compile_draw(prim, idxarr, nfaces * prim_vcount[prim]);
+		return;
+	}
+
+	/* skip the whole draw call if it's outside of the view volume, and the
+	 * clipping if it's entirely inside
+	 */
+	clip = 0;
+	if(st.bsph[3] >= 0.0f && (clip = clip_bsphere()) == -1) {
+		return;
 	}
 
 	tmpv = alloca(prim * 6 * sizeof *tmpv);
@@ -440,8 +568,11 @@ void gaw_draw_indexed(int prim, const unsigned int *idxarr, int nidx)
 		cgm_mtranspose(st.norm_mat);
 	}
 
+	if(idxarr) {
+		memset(st.vcache_idx, 0xff, sizeof st.vcache_idx);
+	}
+
 	vidx = 0;
-	nfaces = nidx / prim_vcount[prim];
 
 	for(j=0; j<nfaces; j++) {
 		vnum = prim_vcount[prim];	/* reset vnum for each iteration */
@@ -449,66 +580,14 @@ void gaw_draw_indexed(int prim, const unsigned int *idxarr, int nidx)
 		for(i=0; i<vnum; i++) {
 			if(idxarr) {
 				vidx = *idxarr++;
+				slot = vidx & (VCACHE_SIZE - 1);
+				if(st.vcache_idx[slot] == vidx) {
+					v[i] = st.vcache[slot];
+					ocode[i] = st.vcache_ocode[slot];
+					continue;
+				}
 			}
-			vptr = (const float*)((char*)st.vertex_ptr + vidx * st.vertex_stride);
-			v[i].x = vptr[0];
-			v[i].y = vptr[1];
-			v[i].z = st.vertex_nelem > 2 ? vptr[2] : 0.0f;
-			v[i].w = st.vertex_nelem > 3 ? vptr[3] : 1.0f;
-
-			if(st.normal_ptr) {
-				vptr = (const float*)((char*)st.normal_ptr + vidx * st.normal_stride);
-			} else {
-				vptr = &st.imm_curv.nx;
-			}
-			v[i].nx = vptr[0];
-			v[i].ny = vptr[1];
-			v[i].nz = vptr[2];
-
-			if(st.texcoord_ptr) {
-				vptr = (const float*)((char*)st.texcoord_ptr + vidx * st.texcoord_stride);
-			} else {
-				vptr = &st.imm_curv.u;
-			}
-			v[i].u = vptr[0];
-			v[i].v = vptr[1];
-
-			if(st.color_ptr) {
-				vptr = (const float*)((char*)st.color_ptr + vidx * st.color_stride);
-			} else {
-				vptr = st.imm_curcol;
-			}
-			v[i].r = (int)(vptr[0] * 255.0f);
-			v[i].g = (int)(vptr[1] * 255.0f);
-			v[i].b = (int)(vptr[2] * 255.0f);
-			v[i].a = st.color_nelem > 3 ? (int)(vptr[3] * 255.0f) : 255;
-
-			vidx++;
-
-			if(st.cur_comp >= 0) {
-				/* currently compiling geometry */
-				struct comp_geom *cg = st.comp + st.cur_comp;
-				float col[4];
-
-				col[0] = v[i].r / 255.0f;
-				col[1] = v[i].g / 255.0f;
-				col[2] = v[i].b / 255.0f;
-				col[3] = v[i].a / 255.0f;
-
-				darr_push(cg->varr, &v[i].x);
-				darr_push(cg->varr, &v[i].y);
-				darr_push(cg->varr, &v[i].z);
-				darr_push(cg->narr, &v[i].nx);
-				darr_push(cg->narr, &v[i].ny);
-				darr_push(cg->narr, &v[i].nz);
-				darr_push(cg->uvarr, &v[i].u);
-				darr_push(cg->uvarr, &v[i].v);
-				darr_push(cg->carr, col);
-				darr_push(cg->carr, col + 1);
-				darr_push(cg->carr, col + 2);
-				darr_push(cg->carr, col + 3);
-				continue;	/* don't transform, just skip to the next vertex */
-			}
+			fetch_vertex(v + i, vidx);
 
 			xform4_vec3(st.mat[GAW_MODELVIEW][mvtop], &v[i].x);
 
@@ -531,15 +610,45 @@ void gaw_draw_indexed(int prim, const unsigned int *idxarr, int nidx)
 				v[i].v = y / w;
 			}
 			xform4_vec3(st.mat[GAW_PROJECTION][ptop], &v[i].x);
+			ocode[i] = clip == 1 ? 0 : clip_outcode(v + i);
+
+			if(idxarr) {
+				st.vcache[slot] = v[i];
+				st.vcache_ocode[slot] = ocode[i];
+				st.vcache_idx[slot] = vidx;
+			} else {
+				vidx++;
+			}
 		}
 
-		if(st.cur_comp >= 0) {
-			/* compiling geometry, don't draw, skip to the next primitive */
+		ocode_and = ~0;
+		ocode_or = 0;
+		for(i=0; i<vnum; i++) {
+			ocode_and &= ocode[i];
+			ocode_or |= ocode[i];
+		}
+		if(ocode_and & CLIP_OUT_FRUSTUM) {
+			continue;	/* all vertices outside of the same plane */
+		}
+
+		if(vnum > 2 && (st.opt & (1 << GAW_CULL_FACE)) && backface(v)) {
 			continue;
 		}
 
-		/* clipping */
-		for(i=0; i<6; i++) {
+		/* Polygons only need clipping against the near and far planes, and the
+		 * sides of the guard band. The rasterizer takes care of anything
+		 * crossing the sides of the viewport within the guard band. Lines and
+		 * points are clipped to the viewport.
+		 */
+		if(vnum > 2) {
+			planes = ocode_or & (CLIP_OUT_DEPTH | CLIP_OUT_GUARD);
+		} else {
+			planes = ocode_or & CLIP_OUT_FRUSTUM;
+		}
+		for(i=0; planes; i++) {
+			if(!(planes & (1 << i))) continue;
+			planes &= ~(1 << i);
+
 			memcpy(tmpv, v, vnum * sizeof *v);
 
 			if(clip_frustum(v, &vnum, tmpv, vnum, i) < 0) {
@@ -716,6 +825,7 @@ int gaw_compile_begin(void)
 	st.comp[i].narr = darr_alloc(0, sizeof(float));
 	st.comp[i].uvarr = darr_alloc(0, sizeof(float));
 	st.comp[i].carr = darr_alloc(0, sizeof(float));
+	st.comp[i].iarr = darr_alloc(0, sizeof(unsigned int));
 
 	return st.cur_comp + 1;
 }
@@ -738,7 +848,7 @@ void gaw_draw_compiled(int id)
 	gaw_texcoord_array(2, 0, st.comp[idx].uvarr);
 	gaw_color_array(4, 0, st.comp[idx].carr);
 
-	gaw_draw(st.comp[idx].prim, darr_size(st.comp[idx].varr) / 3);
+	gaw_draw_indexed(st.comp[idx].prim, st.comp[idx].iarr, darr_size(st.comp[idx].iarr));
 
 	gaw_vertex_array(0, 0, 0);
 	gaw_normal_array(0, 0);
@@ -754,6 +864,7 @@ void gaw_free_compiled(int id)
 	darr_free(st.comp[idx].narr);
 	darr_free(st.comp[idx].uvarr);
 	darr_free(st.comp[idx].carr);
+	darr_free(st.comp[idx].iarr);
 	memset(st.comp + idx, 0, sizeof *st.comp);
 }
 
@@ -972,6 +1083,54 @@ static void shade(struct vertex *v)
 	v->b = b > 255 ? 255 : b;
 }
 
+/* classifies the bounding sphere against the view frustum, the same way as
+ * clip_frustum: 1 inside, 0 straddling, -1 outside
+ */
+static int clip_bsphere(void)
+{
+	int i, j, res = 1;
+	float m[16], plane[4], d, len;
+	float *mv = st.mat[GAW_MODELVIEW][st.mtop[GAW_MODELVIEW]];
+	float *proj = st.mat[GAW_PROJECTION][st.mtop[GAW_PROJECTION]];
+
+	for(i=0; i<4; i++) {
+		for(j=0; j<4; j++) {
+			m[M(i, j)] = proj[M(0, j)] * mv[M(i, 0)] + proj[M(1, j)] * mv[M(i, 1)] +
+				proj[M(2, j)] * mv[M(i, 2)] + proj[M(3, j)] * mv[M(i, 3)];
+		}
+	}
+
+	/* the frustum planes are the sums and differences of the w row of the
+	 * matrix, with each of the x, y, and z rows (left, right, bottom, ...)
+	 */
+	for(i=0; i<6; i++) {
+		float s = i & 1 ? -1.0f : 1.0f;
+		for(j=0; j<4; j++) {
+			plane[j] = m[M(j, 3)] + s * m[M(j, i >> 1)];
+		}
+		d = plane[0] * st.bsph[0] + plane[1] * st.bsph[1] + plane[2] * st.bsph[2] + plane[3];
+		len = sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+		if(d < -st.bsph[3] * len) {
+			return -1;
+		}
+		if(d < st.bsph[3] * len) {
+			res = 0;
+		}
+	}
+	return res;
+}
+
+/* the sign of the determinant of the clip space x, y, w of the first three
+ * vertices gives the winding on screen, even for vertices behind the viewer
+ */
+static int backface(const struct vertex *v)
+{
+	float det = v[0].x * (v[1].y * v[2].w - v[2].y * v[1].w) +
+		v[1].x * (v[2].y * v[0].w - v[0].y * v[2].w) +
+		v[2].x * (v[0].y * v[1].w - v[1].y * v[0].w);
+	return st.frontface ? det >= 0.0f : det <= 0.0f;
+}
+
 int gaw_xform_point(float *vec)
 {
 	int mvtop = st.mtop[GAW_MODELVIEW];
@@ -35,6 +35,9 @@ typedef float gaw_matrix[16];
 
 #define IMM_VBUF_SIZE	256
 
+/* post-transform vertex cache for indexed drawing (power of two) */
+#define VCACHE_SIZE		64
+
 enum {LT_POS, LT_DIR};
 struct light {
 	int type;
@@ -52,6 +55,7 @@ struct material {
 struct comp_geom {
 	int prim;
 	float *varr, *narr, *uvarr, *carr;	/* darr */
+	unsigned int *iarr;					/* darr */
 };
 
 
@@ -92,6 +96,8 @@ struct gaw_state {
 
 	float zoffs;
 
+	float bsph[4];	/* bounding sphere for draw calls, if bsph[3] >= 0 */
+
 	/* immediate mode */
 	int imm_prim;
 	int imm_numv, imm_pcount;
@@ -101,6 +107,11 @@ struct gaw_state {
 	struct vertex imm_vbuf[IMM_VBUF_SIZE];
 	float imm_cbuf[IMM_VBUF_SIZE * 4];
 
+	/* transformed vertices of the current indexed draw call, by index */
+	struct vertex vcache[VCACHE_SIZE];
+	unsigned int vcache_ocode[VCACHE_SIZE];
+	int vcache_idx[VCACHE_SIZE];
+
 	/* textures */
 	int cur_tex;
 	int textypes[MAX_TEXTURES];
@@ -78,6 +78,33 @@ int check_clip_poly(const struct vertex *v, int vnum, struct cplane *plane)
 	return edges_clipped ? 0 : res;
 }
 
+unsigned int clip_outcode(const struct vertex *v)
+{
+	unsigned int code = 0;
+	float gw = v->w * CLIP_GUARD_BAND;
+
+	if(v->x < -v->w) {
+		code |= 1 << CLIP_LEFT;
+		if(v->x < -gw) code |= 1 << CLIP_GUARD_LEFT;
+	} else if(v->x > v->w) {
+		code |= 1 << CLIP_RIGHT;
+		if(v->x > gw) code |= 1 << CLIP_GUARD_RIGHT;
+	}
+	if(v->y < -v->w) {
+		code |= 1 << CLIP_BOTTOM;
+		if(v->y < -gw) code |= 1 << CLIP_GUARD_BOTTOM;
+	} else if(v->y > v->w) {
+		code |= 1 << CLIP_TOP;
+		if(v->y > gw) code |= 1 << CLIP_GUARD_TOP;
+	}
+	if(v->z < -v->w) {
+		code |= 1 << CLIP_NEAR;
+	} else if(v->z > v->w) {
+		code |= 1 << CLIP_FAR;
+	}
+	return code;
+}
+
 int clip_frustum(struct vertex *vout, int *voutnum,
 		const struct vertex *vin, int vnum, int fplane)
 {
@@ -274,6 +301,14 @@ static int inside_frustum_plane(const struct vertex *v, int fplane)
 		return v->z >= -v->w;
 	case CLIP_FAR:
 		return v->z <= v->w;
+	case CLIP_GUARD_LEFT:
+		return v->x >= -v->w * CLIP_GUARD_BAND;
+	case CLIP_GUARD_RIGHT:
+		return v->x <= v->w * CLIP_GUARD_BAND;
+	case CLIP_GUARD_BOTTOM:
+		return v->y >= -v->w * CLIP_GUARD_BAND;
+	case CLIP_GUARD_TOP:
+		return v->y <= v->w * CLIP_GUARD_BAND;
 	}
 	assert(0);
 	return 0;
@@ -294,6 +329,18 @@ static float intersect_frustum(const struct vertex *a, const struct vertex *b, i
 		return (-a->w - a->z) / (b->z - a->z + b->w - a->w);
 	case CLIP_FAR:
 		return (a->w - a->z) / (b->z - a->z - b->w + a->w);
+	case CLIP_GUARD_LEFT:
+		return (-a->w * CLIP_GUARD_BAND - a->x) /
+			(b->x - a->x + (b->w - a->w) * CLIP_GUARD_BAND);
+	case CLIP_GUARD_RIGHT:
+		return (a->w * CLIP_GUARD_BAND - a->x) /
+			(b->x - a->x - (b->w - a->w) * CLIP_GUARD_BAND);
+	case CLIP_GUARD_BOTTOM:
+		return (-a->w * CLIP_GUARD_BAND - a->y) /
+			(b->y - a->y + (b->w - a->w) * CLIP_GUARD_BAND);
+	case CLIP_GUARD_TOP:
+		return (a->w * CLIP_GUARD_BAND - a->y) /
+			(b->y - a->y - (b->w - a->w) * CLIP_GUARD_BAND);
 	}
 
 	assert(0);
@@ -28,9 +28,23 @@ struct cplane {
 enum {
 	CLIP_LEFT, CLIP_RIGHT,
 	CLIP_BOTTOM, CLIP_TOP,
-	CLIP_NEAR, CLIP_FAR
+	CLIP_NEAR, CLIP_FAR,
+	/* sides of the guard band, which extends the view volume to
+	 * CLIP_GUARD_BAND times its size in x and y
+	 */
+	CLIP_GUARD_LEFT, CLIP_GUARD_RIGHT,
+	CLIP_GUARD_BOTTOM, CLIP_GUARD_TOP
 };
 
+#define CLIP_GUARD_BAND		2.0f
+
+/* Outcodes have bit (1 << plane) set for each plane the vertex is outside of */
+#define CLIP_OUT_DEPTH		0x030
+#define CLIP_OUT_FRUSTUM	0x03f
+#define CLIP_OUT_GUARD		0x3c0
+
+unsigned int clip_outcode(const struct vertex *v);
+
 /* Generic polygon clipper
  * returns:
  *  1 -> fully inside, not clipped
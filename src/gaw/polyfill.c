@@ -83,6 +83,7 @@ void (*fillfunc[])(struct pvertex*, int) = {
 };
 
 struct pimage pfill_fb, pfill_tex;
+struct prect pfill_clip;
 uint32_t *pfill_zbuf;
 
 #define EDGEPAD	8
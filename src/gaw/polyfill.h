@@ -112,7 +112,12 @@ struct pimage {
 	unsigned int xmask, ymask;
 };
 
+struct prect {
+	int x0, y0, x1, y1;	/* x1/y1 exclusive */
+};
+
 extern struct pimage pfill_fb;
+extern struct prect pfill_clip;	/* clip rectangle, within pfill_fb */
 extern struct pimage pfill_tex;
 extern uint32_t *pfill_zbuf;
 
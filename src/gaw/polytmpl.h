@@ -52,7 +52,7 @@ void POLYFILL(struct pvertex *varr, int vnum)
 #endif
 
 	vlast = varr + vnum - 1;
-	top = pfill_fb.height;
+	top = pfill_clip.y1;
 	bot = 0;
 
 	for(i=0; i<vnum; i++) {
@@ -134,12 +134,12 @@ void POLYFILL(struct pvertex *varr, int vnum)
 		if(line < top) top = line;
 		if((y1 >> 8) > bot) bot = y1 >> 8;
 
-		if(line > 0) tab += line;
+		tab += line > pfill_clip.y0 ? line : pfill_clip.y0;
 
-		while(line <= (y1 >> 8) && line < pfill_fb.height) {
-			if(line >= 0) {
-				int val = x < 0 ? 0 : x >> 8;
-				tab->x = val < pfill_fb.width ? val : pfill_fb.width - 1;
+		while(line <= (y1 >> 8) && line < pfill_clip.y1) {
+			if(line >= pfill_clip.y0) {
+				/* not clamped, spans are clipped horizontally below */
+				tab->x = x >> 8;
 #ifdef GOURAUD
 				tab->r = r;
 				tab->g = g;
@@ -177,8 +177,8 @@ void POLYFILL(struct pvertex *varr, int vnum)
 		}
 	}
 
-	if(top < 0) top = 0;
-	if(bot >= pfill_fb.height) bot = pfill_fb.height - 1;
+	if(top < pfill_clip.y0) top = pfill_clip.y0;
+	if(bot >= pfill_clip.y1) bot = pfill_clip.y1 - 1;
 
 	fbptr = pfill_fb.pixels + top * pfill_fb.width;
 	for(i=top; i<=bot; i++) {
@@ -218,9 +218,38 @@ void POLYFILL(struct pvertex *varr, int vnum)
 		z = left[i].z;
 		dz = right[i].z - z;
 		zslope = (dz << 8) / dx;
-		zptr = pfill_zbuf + i * pfill_fb.width + start;
 #endif	/* ZBUF */
 
+		/* polygons within the guard band are not clipped to the sides of the
+		 * viewport, so clip the span, and skip the attributes ahead to match
+		 */
+		if(start < pfill_clip.x0) {
+			start -= pfill_clip.x0;
+			len += start;
+#ifdef GOURAUD
+			r -= rslope * start;
+			g -= gslope * start;
+			b -= bslope * start;
+#ifdef BLEND_ALPHA
+			a -= aslope * start;
+#endif	/* BLEND_ALPHA */
+#endif	/* GOURAUD */
+#ifdef TEXMAP
+			tu -= uslope * start;
+			tv -= vslope * start;
+#endif	/* TEXMAP */
+#ifdef ZBUF
+			z -= zslope * start;
+#endif	/* ZBUF */
+			start = pfill_clip.x0;
+		}
+		if(start + len > pfill_clip.x1) {
+			len = pfill_clip.x1 - start;
+		}
+
+#ifdef ZBUF
+		zptr = pfill_zbuf + i * pfill_fb.width + start;
+#endif
 		pptr = fbptr + start;
 		while(len-- > 0) {
 #if defined(GOURAUD) || defined(TEXMAP) || defined(BLEND_ALPHA) || defined(BLEND_ADD)
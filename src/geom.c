@@ -15,35 +15,119 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
+#include <string.h>
+#include <float.h>
 #include "geom.h"
+#include "trimesh.h"
+#include "darray.h"
+#include "util.h"
+
+#define EPSILON	1e-5
+/* hits closer than this to the ray origin are ignored to avoid self-intersection */
+#define TMIN	1e-4
+
+/* A CSG intersection is a list of spans along the ray, where the ray is inside
+ * the solid, sorted by distance. Only the distances of the boundaries are kept,
+ * along with the primitive each one belongs to (see ray_csg), and the hit
+ * attributes are calculated just for the one which ends up being the closest
+ * hit, by csg_attr.
+ */
+struct csgspan {
+	float t0, t1;
+	int prim0, prim1;
+};
+
+/* Span lists are built in a per-thread scratch stack. Each csg node leaves its
+ * result at the position where it started, so the stack never holds more than
+ * the lists of the nodes on the current path down the tree, and their siblings
+ * to the left.
+ */
+#define CSG_STACK_SIZE	1024
+static THREAD_LOCAL struct csgspan csg_stack[CSG_STACK_SIZE];
+static THREAD_LOCAL int csg_top;
+
+static int csg_spans(const cgm_ray *ray, const struct object *obj, int *primidx);
+static int csg_node_spans(const cgm_ray *ray, const struct csgnode *csg, int *primidx);
+static void csg_attr(const cgm_ray *ray, const struct csgnode *csg, struct rayhit *hit);
+
+static int sphere_roots(const cgm_ray *ray, float *t1, float *t2);
+static int sphere_span(const cgm_ray *ray, float *tenter, float *texit);
+static void sphere_attr(const cgm_ray *ray, struct rayhit *rh);
+static int box_span(const cgm_ray *ray, float *tenter, float *texit);
+static void box_attr(const cgm_ray *ray, struct rayhit *rh);
+
 
 int ray_object(const cgm_ray *ray, const struct object *obj, struct rayhit *hit)
 {
-	int i;
-	struct csghit csghit;
+	float t;
 
-	if(!ray_object_csg(ray, obj, &csghit)) {
+	if(!ray_object_t(ray, obj, &t)) {
 		return 0;
 	}
+	if(hit) {
+		hit->t = t;
+		hit->obj = (struct object*)obj;
+		ray_hit_attr(ray, hit);
+	}
+	return 1;
+}
 
-	/* find first hit in the positive half-space of the ray origin */
-	for(i=0; i<csghit.ivcount; i++) {
-		if(csghit.ivlist[i].a.t >= 1e-4) {
-			if(hit) *hit = csghit.ivlist[i].a;
-			return 1;
+int ray_object_t(const cgm_ray *ray, const struct object *obj, float *tres)
+{
+	cgm_ray localray = *ray;
+
+	cgm_rmul_mr(&localray, obj->inv_xform);
+	return ray_local_t(&localray, obj, tres);
+}
+
+int ray_local_t(const cgm_ray *ray, const struct object *obj, float *tres)
+{
+	int prim;
+	float t0, t1;
+	const struct trimesh *mesh;
+
+	switch(obj->type) {
+	case OBJ_SPHERE:
+	case OBJ_LIGHT:
+		if(!sphere_span(ray, &t0, &t1)) {
+			return 0;
 		}
-		if(csghit.ivlist[i].b.t >= 1e-4) {
-			if(hit) *hit = csghit.ivlist[i].b;
-			return 1;
+		break;
+
+	case OBJ_BOX:
+		if(!box_span(ray, &t0, &t1)) {
+			return 0;
 		}
+		break;
+
+	case OBJ_CSG:
+		return ray_csg(ray, (const struct csgnode*)obj, TMIN, 1.0f, tres, &prim);
+
+	case OBJ_MESH:
+		if(!(mesh = ((const struct meshobj*)obj)->mesh)) {
+			return 0;
+		}
+		return tmesh_ray_t(mesh, ray, TMIN, 1.0f, tres);
+
+	default:
+		return 0;
 	}
 
+	/* find first hit in the positive half-space of the ray origin */
+	if(t0 >= TMIN) {
+		*tres = t0;
+		return 1;
+	}
+	if(t1 >= TMIN) {
+		*tres = t1;
+		return 1;
+	}
 	return 0;
 }
 
-int ray_object_csg(const cgm_ray *ray, const struct object *obj, struct csghit *hit)
+void ray_hit_attr(const cgm_ray *ray, struct rayhit *hit)
 {
-	int i, res;
+	const struct object *obj = hit->obj;
 	cgm_ray localray = *ray;
 
 	cgm_rmul_mr(&localray, obj->inv_xform);
@@ -51,35 +135,36 @@ int ray_object_csg(const cgm_ray *ray, const struct object *obj, struct csghit *
 	switch(obj->type) {
 	case OBJ_SPHERE:
 	case OBJ_LIGHT:
-		res = ray_sphere(&localray, obj, hit);
+		sphere_attr(&localray, hit);
 		break;
 
 	case OBJ_BOX:
-		res = ray_box(&localray, obj, hit);
+		box_attr(&localray, hit);
 		break;
 
-	default:
-		res = 0;
-	}
+	case OBJ_CSG:
+		csg_attr(&localray, (const struct csgnode*)obj, hit);
+		break;
 
-	if(res && hit) {
-		for(i=0; i<hit->ivcount; i++) {
-			cgm_vmul_m4v3(&hit->ivlist[i].a.pos, obj->xform);
-			cgm_vmul_m3v3(&hit->ivlist[i].a.norm, obj->dir_xform);
-			cgm_vmul_m4v3(&hit->ivlist[i].b.pos, obj->xform);
-			cgm_vmul_m3v3(&hit->ivlist[i].b.norm, obj->dir_xform);
+	case OBJ_MESH:
+		if(!((const struct meshobj*)obj)->mesh) {
+			return;
 		}
+		tmesh_hit_attr(((const struct meshobj*)obj)->mesh, &localray, TMIN, hit);
+		break;
+
+	default:
+		return;
 	}
-	return res;
-}
 
-#define EPSILON	1e-5
+	cgm_vmul_m4v3(&hit->pos, obj->xform);
+	cgm_vmul_m3v3(&hit->norm, obj->dir_xform);
+}
 
-int ray_sphere(const cgm_ray *ray, const struct object *sph, struct csghit *hit)
+/* unit sphere roots, unordered and unclipped */
+static int sphere_roots(const cgm_ray *ray, float *t1, float *t2)
 {
-	int i;
-	float a, b, c, d, sqrt_d, t1, t2;/*, invrad;*/
-	struct rayhit *rhptr;
+	float a, b, c, d, sqrt_d;
 
 	a = cgm_vdot(&ray->dir, &ray->dir);
 	b = 2.0f * ray->dir.x * ray->origin.x +
@@ -90,55 +175,54 @@ int ray_sphere(const cgm_ray *ray, const struct object *sph, struct csghit *hit)
 	if((d = b * b - 4.0 * a * c) < 0.0) return 0;
 
 	sqrt_d = sqrt(d);
-	t1 = (-b + sqrt_d) / (2.0 * a);
-	t2 = (-b - sqrt_d) / (2.0 * a);
+	*t1 = (-b + sqrt_d) / (2.0 * a);
+	*t2 = (-b - sqrt_d) / (2.0 * a);
+	return 1;
+}
+
+/* ordered sphere interval, clipped to the ray segment */
+static int sphere_span(const cgm_ray *ray, float *tenter, float *texit)
+{
+	float t1, t2;
+
+	if(!sphere_roots(ray, &t1, &t2)) return 0;
 
 	if((t1 < EPSILON && t2 < EPSILON) || (t1 > 1.0f && t2 > 1.0f)) {
 		return 0;
 	}
 
-	if(hit) {
-		if(t1 < EPSILON || t1 > 1.0f) {
-			t1 = t2;
-		} else if(t2 < EPSILON || t2 > 1.0f) {
-			t2 = t1;
-		}
-		if(t2 < t1) {
-			float tmp = t1;
-			t1 = t2;
-			t2 = tmp;
-		}
-
-		hit->ivcount = 1;
-		hit->ivlist[0].a.t = t1;
-		hit->ivlist[0].b.t = t2;
-		/*invrad = 1.0f / sph->rad;*/
-
-		rhptr = &hit->ivlist[0].a;
-		for(i=0; i<2; i++) {
-			cgm_raypos(&rhptr->pos, ray, rhptr->t);
-			rhptr->norm = rhptr->pos;
-			cgm_vnormalize(&rhptr->norm);
-			/*rhptr->norm.x = rhptr->pos.x * invrad;
-			rhptr->norm.y = rhptr->pos.y * invrad;
-			rhptr->norm.z = rhptr->pos.z * invrad;*/
-			rhptr->uv.x = (atan2(rhptr->norm.z, rhptr->norm.x) + CGM_PI) / (2.0 * CGM_PI);
-			rhptr->uv.y = acos(rhptr->norm.y) / CGM_PI;
-			rhptr->obj = (struct object*)sph;
-			rhptr = &hit->ivlist[0].b;
-		}
+	if(t1 < EPSILON || t1 > 1.0f) {
+		t1 = t2;
+	} else if(t2 < EPSILON || t2 > 1.0f) {
+		t2 = t1;
+	}
+	if(t2 < t1) {
+		float tmp = t1;
+		t1 = t2;
+		t2 = tmp;
 	}
+	*tenter = t1;
+	*texit = t2;
 	return 1;
 }
 
-int ray_box(const cgm_ray *ray, const struct object *box, struct csghit *hit)
+/* calculates position, normal and uv in object space, at distance rh->t */
+static void sphere_attr(const cgm_ray *ray, struct rayhit *rh)
+{
+	cgm_raypos(&rh->pos, ray, rh->t);
+	rh->norm = rh->pos;
+	cgm_vnormalize(&rh->norm);
+	rh->uv.x = (atan2(rh->norm.z, rh->norm.x) + CGM_PI) / (2.0 * CGM_PI);
+	rh->uv.y = acos(rh->norm.y) / CGM_PI;
+}
+
+/* box slab test: entry and exit distances along the whole ray line */
+static int box_span(const cgm_ray *ray, float *tenter, float *texit)
 {
 	int i, sign[3];
 	float param[2][3];
 	float inv_dir[3];
 	float tmin, tmax, tymin, tymax, tzmin, tzmax;
-	float s;
-	struct rayhit *rhptr;
 
 	for(i=0; i<3; i++) {
 		param[0][i] = -0.5;
@@ -176,44 +260,330 @@ int ray_box(const cgm_ray *ray, const struct object *box, struct csghit *hit)
 		tmax = tzmax;
 	}
 
-	if(hit) {
-		hit->ivcount = 1;
-		hit->ivlist[0].a.t = tmin;
-		hit->ivlist[0].b.t = tmax;
-
-		rhptr = &hit->ivlist[0].a;
-		for(i=0; i<2; i++) {
-			cgm_raypos(&rhptr->pos, ray, rhptr->t);
-
-			rhptr->norm.x = rhptr->norm.y = rhptr->norm.z = 0.0f;
-			if(fabs(rhptr->pos.x) > fabs(rhptr->pos.y) && fabs(rhptr->pos.x) > fabs(rhptr->pos.z)) {
-				s = rhptr->pos.x > 0.0f ? 1.0f : -1.0f;
-				rhptr->norm.x = s;
-				rhptr->uv.x = rhptr->pos.z * s * 0.5f + 0.5f;
-				rhptr->uv.y = rhptr->pos.y * s * 0.5f + 0.5f;
-			} else if(fabs(rhptr->pos.y) > fabs(rhptr->pos.z)) {
-				s = rhptr->pos.y > 0.0f ? 1.0f : -1.0f;
-				rhptr->norm.y = s;
-				rhptr->uv.x = rhptr->pos.x * s * 0.5f + 0.5f;
-				rhptr->uv.y = rhptr->pos.z * s * 0.5f + 0.5f;
-			} else {
-				s = rhptr->pos.z > 0.0f ? 1.0f : -1.0f;
-				rhptr->norm.z = s;
-				rhptr->uv.x = rhptr->pos.x * s * 0.5f + 0.5f;
-				rhptr->uv.y = rhptr->pos.y * s * 0.5f + 0.5f;
-			}
-			rhptr->obj = (struct object*)box;
-			rhptr = &hit->ivlist[0].b;
+	*tenter = tmin;
+	*texit = tmax;
+	return 1;
+}
+
+static void box_attr(const cgm_ray *ray, struct rayhit *rh)
+{
+	float s;
+
+	cgm_raypos(&rh->pos, ray, rh->t);
+
+	rh->norm.x = rh->norm.y = rh->norm.z = 0.0f;
+	if(fabs(rh->pos.x) > fabs(rh->pos.y) && fabs(rh->pos.x) > fabs(rh->pos.z)) {
+		s = rh->pos.x > 0.0f ? 1.0f : -1.0f;
+		rh->norm.x = s;
+		rh->uv.x = rh->pos.z * s * 0.5f + 0.5f;
+		rh->uv.y = rh->pos.y * s * 0.5f + 0.5f;
+	} else if(fabs(rh->pos.y) > fabs(rh->pos.z)) {
+		s = rh->pos.y > 0.0f ? 1.0f : -1.0f;
+		rh->norm.y = s;
+		rh->uv.x = rh->pos.x * s * 0.5f + 0.5f;
+		rh->uv.y = rh->pos.z * s * 0.5f + 0.5f;
+	} else {
+		s = rh->pos.z > 0.0f ? 1.0f : -1.0f;
+		rh->norm.z = s;
+		rh->uv.x = rh->pos.x * s * 0.5f + 0.5f;
+		rh->uv.y = rh->pos.y * s * 0.5f + 0.5f;
+	}
+}
+
+/* Occlusion test for shadow rays: is any part of the object surface within the
+ * ray segment (t in (0, 1])? Only the intersection distances are calculated,
+ * none of the hit attributes needed for shading.
+ */
+int ray_object_occl(const cgm_ray *ray, const struct object *obj)
+{
+	cgm_ray localray = *ray;
+
+	cgm_rmul_mr(&localray, obj->inv_xform);
+	return ray_local_occl(&localray, obj);
+}
+
+int ray_local_occl(const cgm_ray *ray, const struct object *obj)
+{
+	int prim;
+	float t1, t2;
+	const struct trimesh *mesh;
+
+	switch(obj->type) {
+	case OBJ_SPHERE:
+	case OBJ_LIGHT:
+		if(!sphere_roots(ray, &t1, &t2)) {
+			return 0;
+		}
+		return (t1 >= TMIN && t1 <= 1.0f) || (t2 >= TMIN && t2 <= 1.0f);
+
+	case OBJ_BOX:
+		if(!box_span(ray, &t1, &t2)) {
+			return 0;
+		}
+		/* either boundary crossing is inside the segment */
+		return (t1 >= TMIN && t1 <= 1.0f) || (t2 >= TMIN && t2 <= 1.0f);
+
+	case OBJ_CSG:
+		return ray_csg(ray, (const struct csgnode*)obj, TMIN, 1.0f, &t1, &prim);
+
+	case OBJ_MESH:
+		if(!(mesh = ((const struct meshobj*)obj)->mesh)) {
+			return 0;
 		}
+		return tmesh_ray_occl(mesh, ray, TMIN, 1.0f);
+
+	default:
+		break;
+	}
+	return 0;
+}
+
+/* merges the span lists a and b on the top of the csg stack into one, which
+ * replaces them, and returns its length
+ */
+static int csg_merge(int op, int a, int na, int nb)
+{
+	int i, j, ina, inb, in, inres, fromb, prim, count;
+	float t, ta, tb;
+	struct csgspan *sa = csg_stack + a;
+	struct csgspan *sb = sa + na;
+	struct csgspan *out = sb + nb;
+
+	/* the result can't have more spans than both lists together */
+	if(a + 2 * (na + nb) > CSG_STACK_SIZE) {
+		return -1;
+	}
+
+	i = j = ina = inb = in = count = 0;
+	na *= 2;	/* count boundaries from now on */
+	nb *= 2;
+	while(i < na || j < nb) {
+		ta = i < na ? (i & 1 ? sa[i >> 1].t1 : sa[i >> 1].t0) : FLT_MAX;
+		tb = j < nb ? (j & 1 ? sb[j >> 1].t1 : sb[j >> 1].t0) : FLT_MAX;
+		if(ta <= tb) {
+			t = ta;
+			prim = i & 1 ? sa[i >> 1].prim1 : sa[i >> 1].prim0;
+			ina = !ina;
+			fromb = 0;
+			i++;
+		} else {
+			t = tb;
+			prim = j & 1 ? sb[j >> 1].prim1 : sb[j >> 1].prim0;
+			inb = !inb;
+			fromb = 1;
+			j++;
+		}
+
+		switch(op) {
+		case CSG_UNION:
+			inres = ina || inb;
+			break;
+		case CSG_INTERSECTION:
+			inres = ina && inb;
+			break;
+		default:
+			inres = ina && !inb;
+		}
+		if(inres == in) continue;
+
+		if(fromb && op == CSG_DIFFERENCE) {
+			prim ^= 1;	/* the inside of subtracted objects faces out */
+		}
+		if(inres) {
+			out[count].t0 = t;
+			out[count].prim0 = prim;
+		} else {
+			out[count].t1 = t;
+			out[count].prim1 = prim;
+			count++;
+		}
+		in = inres;
+	}
+
+	memmove(sa, out, count * sizeof *out);
+	csg_top = a + count;
+	return count;
+}
+
+/* pushes the spans of obj on the csg stack, for a ray in the space of its
+ * parent. Returns the number of spans, or -1 if the stack ran out.
+ */
+static int csg_spans(const cgm_ray *ray, const struct object *obj, int *primidx)
+{
+	int prim;
+	float t0, t1;
+	cgm_ray lray = *ray;
+
+	cgm_rmul_mr(&lray, obj->inv_xform);
+
+	switch(obj->type) {
+	case OBJ_SPHERE:
+		prim = (*primidx)++ << 1;
+		if(!sphere_roots(&lray, &t0, &t1)) {
+			return 0;
+		}
+		if(t1 < t0) {
+			float tmp = t0;
+			t0 = t1;
+			t1 = tmp;
+		}
+		break;
+
+	case OBJ_BOX:
+		prim = (*primidx)++ << 1;
+		if(!box_span(&lray, &t0, &t1)) {
+			return 0;
+		}
+		break;
+
+	case OBJ_CSG:
+		return csg_node_spans(&lray, (const struct csgnode*)obj, primidx);
+
+	default:
+		(*primidx)++;
+		return 0;
+	}
+
+	if(csg_top >= CSG_STACK_SIZE) {
+		return -1;
 	}
+	csg_stack[csg_top].t0 = t0;
+	csg_stack[csg_top].t1 = t1;
+	csg_stack[csg_top].prim0 = csg_stack[csg_top].prim1 = prim;
+	csg_top++;
 	return 1;
 }
 
-int ray_csg(const cgm_ray *ray, const struct csgnode *csg, struct csghit *hit)
+/* same as csg_spans, for a ray in the space of the csg node itself */
+static int csg_node_spans(const cgm_ray *ray, const struct csgnode *csg, int *primidx)
 {
+	int i, first, count, num, nsub;
+	const struct object *sub;
+
+	if(!(num = darr_size(csg->subobj))) {
+		return 0;
+	}
+	first = csg_top;
+	if((count = csg_spans(ray, csg->subobj[0], primidx)) == -1) {
+		return -1;
+	}
+
+	for(i=1; i<num; i++) {
+		sub = csg->subobj[i];
+		if(!count && csg->op != CSG_UNION) {
+			/* nothing left to intersect with or subtract from, just skip the
+			 * primitive indices of the rest
+			 */
+			*primidx += sub->type == OBJ_CSG ? ((const struct csgnode*)sub)->num_prims : 1;
+			continue;
+		}
+		if((nsub = csg_spans(ray, sub, primidx)) == -1 ||
+				(count = csg_merge(csg->op, first, count, nsub)) == -1) {
+			return -1;
+		}
+	}
+	return count;
+}
+
+int ray_csg(const cgm_ray *ray, const struct csgnode *csg, float tmin, float tmax,
+		float *tres, int *prim)
+{
+	int i, first, count, primidx = 0;
+	struct csgspan *sp;
+
+	first = csg_top;
+	count = csg_node_spans(ray, csg, &primidx);
+	csg_top = first;	/* the spans stay there until the next call */
+
+	sp = csg_stack + first;
+	for(i=0; i<count; i++) {
+		if(sp[i].t0 > tmax) break;
+
+		if(sp[i].t0 >= tmin) {
+			*tres = sp[i].t0;
+			*prim = sp[i].prim0;
+			return 1;
+		}
+		/* starting inside the solid */
+		if(sp[i].t1 >= tmin && sp[i].t1 <= tmax) {
+			*tres = sp[i].t1;
+			*prim = sp[i].prim1;
+			return 1;
+		}
+	}
 	return 0;
 }
 
+/* finds primitive idx of the subtree of obj, and calculates the hit attributes
+ * on it, transformed to the space of the parent of obj
+ */
+static int csg_prim_attr(const cgm_ray *ray, const struct object *obj, int *idx,
+		struct rayhit *hit)
+{
+	int i, num;
+	cgm_ray lray = *ray;
+	const struct csgnode *csg;
+
+	cgm_rmul_mr(&lray, obj->inv_xform);
+
+	switch(obj->type) {
+	case OBJ_CSG:
+		csg = (const struct csgnode*)obj;
+		if(*idx >= csg->num_prims) {
+			*idx -= csg->num_prims;
+			return 0;
+		}
+		num = darr_size(csg->subobj);
+		for(i=0; i<num; i++) {
+			if(csg_prim_attr(&lray, csg->subobj[i], idx, hit)) {
+				break;
+			}
+		}
+		if(i >= num) return 0;
+		break;
+
+	default:
+		if((*idx)-- > 0) {
+			return 0;
+		}
+		if(obj->type == OBJ_SPHERE) {
+			sphere_attr(&lray, hit);
+		} else if(obj->type == OBJ_BOX) {
+			box_attr(&lray, hit);
+		} else {
+			return 0;
+		}
+	}
+
+	cgm_vmul_m4v3(&hit->pos, obj->xform);
+	cgm_vmul_m3v3(&hit->norm, obj->dir_xform);
+	return 1;
+}
+
+/* the closest hit only keeps the distance, so the csg tree is traced again to
+ * find the primitive it belongs to, and the attributes are calculated on that
+ */
+static void csg_attr(const cgm_ray *ray, const struct csgnode *csg, struct rayhit *hit)
+{
+	int i, num, prim, idx;
+	float t;
+
+	if(!ray_csg(ray, csg, TMIN, 1.0f, &t, &prim)) {
+		return;
+	}
+	idx = prim >> 1;
+
+	num = darr_size(csg->subobj);
+	for(i=0; i<num; i++) {
+		if(csg_prim_attr(ray, csg->subobj[i], &idx, hit)) {
+			break;
+		}
+	}
+	if(prim & 1) {
+		cgm_vneg(&hit->norm);
+	}
+}
+
 float ray_object_dist(const cgm_ray *ray, const struct object *obj)
 {
 	/*struct rayhit hit;*/
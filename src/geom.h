@@ -29,22 +29,26 @@ struct rayhit {
 	struct object *obj;
 };
 
-struct interval {
-	struct rayhit a, b;
-};
-
-#define MAX_INTERV	32
-struct csghit {
-	struct interval ivlist[MAX_INTERV];
-	int ivcount;
-};
-
 int ray_object(const cgm_ray *ray, const struct object *obj, struct rayhit *hit);
-int ray_object_csg(const cgm_ray *ray, const struct object *obj, struct csghit *hit);
-
-int ray_sphere(const cgm_ray *ray, const struct object *sph, struct csghit *hit);
-int ray_box(const cgm_ray *ray, const struct object *box, struct csghit *hit);
-int ray_csg(const cgm_ray *ray, const struct csgnode *csg, struct csghit *hit);
+/* Intersection distance only, without calculating any hit attributes. Use
+ * ray_hit_attr afterwards on the closest hit, to fill in the rest of the
+ * rayhit structure, once hit->t and hit->obj are set.
+ */
+int ray_object_t(const cgm_ray *ray, const struct object *obj, float *t);
+void ray_hit_attr(const cgm_ray *ray, struct rayhit *hit);
+int ray_object_occl(const cgm_ray *ray, const struct object *obj);
+/* same as ray_object_t and ray_object_occl, for a ray already transformed to
+ * the object space of obj
+ */
+int ray_local_t(const cgm_ray *ray, const struct object *obj, float *t);
+int ray_local_occl(const cgm_ray *ray, const struct object *obj);
+
+/* closest CSG boundary within [tmin, tmax], for a ray in the object space of
+ * the csg node. prim is the depth-first index of the primitive it belongs to,
+ * shifted left by one, with the low bit set if its normal must be flipped.
+ */
+int ray_csg(const cgm_ray *ray, const struct csgnode *csg, float tmin, float tmax,
+		float *t, int *prim);
 
 float ray_object_dist(const cgm_ray *ray, const struct object *obj);
 
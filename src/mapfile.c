@@ -0,0 +1,118 @@
+/*
+RetroRay - integrated standalone vintage modeller/renderer
+Copyright (C) 2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "mapfile.h"
+#include "logger.h"
+
+#if defined(__unix__) || defined(unix) || defined(__APPLE__)
+#define USE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef USE_MMAP
+int map_file(struct mapfile *mf, const char *fname)
+{
+	int fd;
+	struct stat st;
+
+	mf->data = 0;
+	mf->size = 0;
+	mf->mapped = 0;
+
+	if((fd = open(fname, O_RDONLY)) == -1) {
+		return -1;
+	}
+	if(fstat(fd, &st) == -1) {
+		errormsg("map_file: failed to stat %s: %s\n", fname, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	mf->size = st.st_size;
+
+	/* can't map empty files, but there's nothing to read anyway */
+	if(mf->size > 0) {
+		if((mf->data = mmap(0, mf->size, PROT_READ, MAP_PRIVATE, fd, 0)) == (void*)-1) {
+			errormsg("map_file: failed to map %s: %s\n", fname, strerror(errno));
+			mf->data = 0;
+			close(fd);
+			return -1;
+		}
+		mf->mapped = 1;
+	}
+	close(fd);
+	return 0;
+}
+
+void unmap_file(struct mapfile *mf)
+{
+	if(mf->mapped) {
+		munmap(mf->data, mf->size);
+	}
+	mf->data = 0;
+	mf->size = 0;
+	mf->mapped = 0;
+}
+
+#else	/* !USE_MMAP */
+
+int map_file(struct mapfile *mf, const char *fname)
+{
+	FILE *fp;
+
+	mf->data = 0;
+	mf->size = 0;
+	mf->mapped = 0;
+
+	if(!(fp = fopen(fname, "rb"))) {
+		return -1;
+	}
+	fseek(fp, 0, SEEK_END);
+	mf->size = ftell(fp);
+	rewind(fp);
+
+	if(mf->size > 0) {
+		if(!(mf->data = malloc(mf->size))) {
+			errormsg("map_file: failed to allocate %ld bytes for %s\n", mf->size, fname);
+			fclose(fp);
+			return -1;
+		}
+		if(fread(mf->data, 1, mf->size, fp) != mf->size) {
+			errormsg("map_file: failed to read %s\n", fname);
+			free(mf->data);
+			mf->data = 0;
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+void unmap_file(struct mapfile *mf)
+{
+	free(mf->data);
+	mf->data = 0;
+	mf->size = 0;
+}
+#endif	/* !USE_MMAP */
@@ -0,0 +1,33 @@
+/*
+RetroRay - integrated standalone vintage modeller/renderer
+Copyright (C) 2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef MAPFILE_H_
+#define MAPFILE_H_
+
+/* Read-only view of a whole file, memory-mapped where possible. On systems
+ * without mmap (DOS), the file is just read into memory.
+ */
+struct mapfile {
+	void *data;
+	long size;
+	int mapped;
+};
+
+int map_file(struct mapfile *mf, const char *fname);
+void unmap_file(struct mapfile *mf);
+
+#endif	/* MAPFILE_H_ */
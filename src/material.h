@@ -26,6 +26,7 @@ struct material {
 	cgm_vec3 kd, ks, ke;
 	float shin;
 	float refl, trans, ior;
+	int max_depth;		/* no secondary rays from hits deeper than this, 0: no limit */
 
 	struct texture *texmap;
 };
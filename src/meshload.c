@@ -1,8 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
+#include <float.h>
+#include <math.h>
 #include <assert.h>
 #include "cmesh.h"
+#include "mapfile.h"
 #include "sizeint.h"
 
 #ifdef USE_ASSIMP
@@ -13,14 +17,20 @@
 #include <assimp/types.h>
 #else
 #include "darray.h"
-#include "rbtree.h"
+#include "tpool.h"
 #endif
 
 
+static int load_binary(struct cmesh *mesh, struct mapfile *mf, const char *fname);
+
 #ifdef USE_ASSIMP
 
 static int add_mesh(struct cmesh *mesh, struct aiMesh *aimesh);
 
+void cmesh_load_threads(struct thread_pool *tp)
+{
+}
+
 #define AIPPFLAGS \
 	(aiProcess_JoinIdenticalVertices | aiProcess_PreTransformVertices | \
 	 aiProcess_Triangulate | aiProcess_SortByPType | aiProcess_FlipUVs)
@@ -29,6 +39,14 @@ int cmesh_load(struct cmesh *mesh, const char *fname)
 {
 	int i;
 	const struct aiScene *aiscn;
+	struct mapfile mf;
+
+	if(map_file(&mf, fname) == 0) {
+		if((i = load_binary(mesh, &mf, fname)) != 1) {
+			return i;
+		}
+		unmap_file(&mf);
+	}
 
 	if(!(aiscn = aiImportFile(fname, AIPPFLAGS))) {
 		fprintf(stderr, "failed to open mesh file: %s\n", fname);
@@ -90,6 +108,18 @@ static int add_mesh(struct cmesh *mesh, struct aiMesh *aim)
 
 #else
 
+/* Lines are read in pieces of at most this many characters, like fgets with a
+ * 256 byte buffer, which is how earlier versions of the loader read them, so
+ * overlong lines are still split the same way.
+ */
+#define MAX_LINE	255
+
+/* files are split in chunks of at least this size, to parse in parallel */
+#define MIN_CHUNK			(256 * 1024)
+#define CHUNKS_PER_THREAD	4
+
+enum { LINE_OTHER, LINE_V, LINE_VT, LINE_VN, LINE_F, LINE_O };
+
 struct vertex_pos {
 	float x, y, z;
 };
@@ -98,193 +128,507 @@ struct facevertex {
 	int vidx, tidx, nidx;
 };
 
+struct objname {
+	int face;		/* number of faces before it */
+	char *name;
+};
+
+struct chunk {
+	const char *start, *end;
+	int line;					/* number of lines before the chunk */
+	int nlines;
+	int nv, nt, nn, nf, no;		/* vertices, texcoords, normals, faces, and objects */
+	int v0, t0, n0, f0, o0;		/* ... before the chunk */
+
+	/* first error in the chunk, and the number of faces before it */
+	const char *err;
+	int err_line, err_face;
+	char err_text[MAX_LINE + 1];
+};
+
+struct objfile {
+	const char *fname;
+	struct chunk *chunks;
+	int num_chunks;
+
+	struct vertex_pos *varr;
+	cgm_vec2 *tarr;
+	cgm_vec3 *narr;
+	struct facevertex *fvarr;	/* 4 per face */
+	unsigned char *fvcount;		/* face-vertices of each face: 3 or 4 */
+	struct objname *names;
+	int num_names;
+};
+
+/* open addressing hash table, mapping face-vertices to mesh vertex indices */
+struct fvhash {
+	int *slot;					/* mesh vertex index, or -1 for empty slots */
+	unsigned int size, count;	/* size is a power of two */
+	struct facevertex *keys;	/* darr, the face-vertex of each mesh vertex */
+};
+
+static struct thread_pool *load_tpool;
+
+static void split_chunks(struct objfile *obj, const char *data, long size);
+static void run_chunks(struct objfile *obj, tpool_func func);
+static void count_chunk(int task, int tid, void *cls);
+static void parse_chunk(int task, int tid, void *cls);
+static int build_mesh(struct cmesh *mesh, struct objfile *obj, int num_faces,
+		int *found_quad, int *quad_err);
+static const char *read_line(const char *ptr, const char *end, char *buf);
+static int line_type(char *buf, char **line);
 static char *clean_line(char *s);
+static const char *parse_float(const char *ptr, float *res);
 static char *parse_face_vert(char *ptr, struct facevertex *fv, int numv, int numt, int numn);
-static int cmp_facevert(const void *ap, const void *bp);
-static void free_rbnode_key(struct rbnode *n, void *cls);
+static int fvhash_init(struct fvhash *ht, int size);
+static void fvhash_destroy(struct fvhash *ht);
+static int fvhash_insert(struct fvhash *ht, const struct facevertex *fv, int *found);
 
-/* merge of different indices per attribute happens during face processing.
- *
- * A triplet of (vertex index/texcoord index/normal index) is used as the key
- * to search in a balanced binary search tree for vertex buffer index assigned
- * to the same triplet if it has been encountered before. That index is
- * appended to the index buffer.
+void cmesh_load_threads(struct thread_pool *tp)
+{
+	load_tpool = tp;
+}
+
+/* OBJ files are memory-mapped, and parsed in parallel, in chunks of whole
+ * lines. A first pass over each chunk just counts the vertex, texcoord, normal
+ * and face lines, so that the second pass can parse every element straight
+ * into its place in the arrays for the whole file.
  *
- * If a particular triplet has not been encountered before, a new vertex is
- * appended to the vertex buffer. The index of this new vertex is appended to
- * the index buffer, and also inserted into the tree for future searches.
+ * Merging the different indices per attribute then happens serially, in file
+ * order: each triplet of (vertex index/texcoord index/normal index) is looked
+ * up in a hash table, for the mesh vertex index assigned to the same triplet,
+ * if it has been encountered before, or else a new mesh vertex is appended and
+ * added to the hash table. Either way that index is appended to the index
+ * buffer. Mesh vertices end up in order of first use, the same as reading the
+ * file line by line.
  */
 int cmesh_load(struct cmesh *mesh, const char *fname)
 {
-	int i, line_num = 0, result = -1;
-	int found_quad = 0;
-	FILE *fp = 0;
-	char buf[256];
-	struct vertex_pos *varr = 0;
-	cgm_vec3 *narr = 0;
-	cgm_vec2 *tarr = 0;
-	struct rbtree *rbtree = 0;
-	char *subname = 0;
-	int substart = 0, subcount = 0;
-
-	if(!(fp = fopen(fname, "rb"))) {
+	int i, num_faces, found_quad = 0, quad_err = -1, result = -1;
+	struct mapfile mf;
+	struct objfile obj;
+	struct chunk *ck, *errck = 0;
+	int nv = 0, nt = 0, nn = 0, nf = 0, no = 0, nlines = 0;
+	char buf[MAX_LINE + 1];
+	const char *ptr;
+	char *line;
+
+	if(map_file(&mf, fname) == -1) {
 		fprintf(stderr, "load_mesh: failed to open file: %s\n", fname);
+		return -1;
+	}
+	if((i = load_binary(mesh, &mf, fname)) != 1) {
+		return i;
+	}
+
+	memset(&obj, 0, sizeof obj);
+	obj.fname = fname;
+	split_chunks(&obj, mf.data, mf.size);
+	if(!obj.chunks) {
 		goto err;
 	}
 
-	if(!(rbtree = rb_create(cmp_facevert))) {
-		fprintf(stderr, "load_mesh: failed to create facevertex binary search tree\n");
+	run_chunks(&obj, count_chunk);
+
+	for(i=0; i<obj.num_chunks; i++) {
+		ck = obj.chunks + i;
+		ck->line = nlines;
+		ck->v0 = nv;
+		ck->t0 = nt;
+		ck->n0 = nn;
+		ck->f0 = nf;
+		ck->o0 = no;
+		nlines += ck->nlines;
+		nv += ck->nv;
+		nt += ck->nt;
+		nn += ck->nn;
+		nf += ck->nf;
+		no += ck->no;
+	}
+
+	if(!(obj.varr = malloc((nv + 1) * sizeof *obj.varr)) ||
+			!(obj.tarr = malloc((nt + 1) * sizeof *obj.tarr)) ||
+			!(obj.narr = malloc((nn + 1) * sizeof *obj.narr)) ||
+			!(obj.fvarr = malloc((nf * 4 + 1) * sizeof *obj.fvarr)) ||
+			!(obj.fvcount = malloc(nf + 1)) ||
+			!(obj.names = calloc(no + 1, sizeof *obj.names))) {
+		fprintf(stderr, "load_mesh: failed to allocate arrays for %d vertices and %d faces\n", nv, nf);
 		goto err;
 	}
-	rb_set_delete_func(rbtree, free_rbnode_key, 0);
+	obj.num_names = no;
 
-	if(!(varr = darr_alloc(0, sizeof *varr)) ||
-			!(narr = darr_alloc(0, sizeof *narr)) ||
-			!(tarr = darr_alloc(0, sizeof *tarr))) {
-		fprintf(stderr, "load_mesh: failed to allocate resizable vertex array\n");
+	run_chunks(&obj, parse_chunk);
+
+	/* stop at the first error */
+	num_faces = nf;
+	for(i=0; i<obj.num_chunks; i++) {
+		if(obj.chunks[i].err) {
+			errck = obj.chunks + i;
+			num_faces = errck->f0 + errck->err_face;
+			break;
+		}
+	}
+
+	if(build_mesh(mesh, &obj, num_faces, &found_quad, &quad_err) == -1) {
+		if(quad_err >= 0) {
+			/* find the line with the offending face, to report it */
+			for(i=obj.num_chunks-1; i>0; i--) {
+				if(obj.chunks[i].f0 <= quad_err) break;
+			}
+			ck = obj.chunks + i;
+			nlines = ck->line;
+			nf = ck->f0;
+			ptr = ck->start;
+			while(ptr < ck->end) {
+				ptr = read_line(ptr, ck->end, buf);
+				nlines++;
+				if(line_type(buf, &line) == LINE_F && nf++ == quad_err) {
+					fprintf(stderr, "%s:%d: invalid face definition: \"%s\"\n", fname, nlines, line);
+					break;
+				}
+			}
+		}
+		goto err;
+	}
+	if(errck) {
+		fprintf(stderr, "%s:%d: %s: \"%s\"\n", fname, errck->line + errck->err_line,
+				errck->err, errck->err_text);
 		goto err;
 	}
 
-	while(fgets(buf, sizeof buf, fp)) {
-		char *line = clean_line(buf);
-		++line_num;
+	result = 0;	/* success */
 
-		if(!*line) continue;
+	printf("loaded %s mesh: %s (%d submeshes): %d vertices, %d faces\n",
+			found_quad ? "quad" : "triangle", fname,
+			cmesh_submesh_count(mesh), cmesh_attrib_count(mesh, CMESH_ATTR_VERTEX),
+			cmesh_poly_count(mesh));
 
-		switch(line[0]) {
-		case 'v':
-			if(isspace(line[1])) {
-				/* vertex */
-				struct vertex_pos v;
-				int num;
+err:
+	if(obj.names) {
+		for(i=0; i<obj.num_names; i++) {
+			free(obj.names[i].name);
+		}
+	}
+	free(obj.names);
+	free(obj.fvcount);
+	free(obj.fvarr);
+	free(obj.narr);
+	free(obj.tarr);
+	free(obj.varr);
+	free(obj.chunks);
+	unmap_file(&mf);
+	return result;
+}
 
-				num = sscanf(line + 2, "%f %f %f", &v.x, &v.y, &v.z);
-				if(num < 3) {
-					fprintf(stderr, "%s:%d: invalid vertex definition: \"%s\"\n", fname, line_num, line);
-					goto err;
-				}
-				if(!(varr = darr_push_impl(varr, &v))) {
-					fprintf(stderr, "load_mesh: failed to resize vertex buffer\n");
-					goto err;
-				}
+static void split_chunks(struct objfile *obj, const char *data, long size)
+{
+	int i, num;
+	const char *ptr, *end = data + size;
 
-			} else if(line[1] == 't' && isspace(line[2])) {
-				/* texcoord */
-				cgm_vec2 tc;
-				if(sscanf(line + 3, "%f %f", &tc.x, &tc.y) != 2) {
-					fprintf(stderr, "%s:%d: invalid texcoord definition: \"%s\"\n", fname, line_num, line);
-					goto err;
-				}
-				tc.y = 1.0f - tc.y;
-				if(!(tarr = darr_push_impl(tarr, &tc))) {
-					fprintf(stderr, "load_mesh: failed to resize texcoord buffer\n");
-					goto err;
-				}
+	num = load_tpool ? tpool_num_threads(load_tpool) * CHUNKS_PER_THREAD : 1;
+	if(size / num < MIN_CHUNK) {
+		num = size / MIN_CHUNK;
+	}
+	if(num < 1) num = 1;
+
+	if(!(obj->chunks = calloc(num, sizeof *obj->chunks))) {
+		fprintf(stderr, "load_mesh: failed to allocate file chunks\n");
+		return;
+	}
+
+	/* chunks have to start at the beginning of a line */
+	ptr = data;
+	for(i=0; i<num; i++) {
+		obj->chunks[i].start = ptr;
+		if(i < num - 1) {
+			ptr = data + (size / num) * (i + 1);
+			if(ptr < obj->chunks[i].start) ptr = obj->chunks[i].start;
+			while(ptr < end && *ptr++ != '\n');
+		} else {
+			ptr = end;
+		}
+		obj->chunks[i].end = ptr;
+	}
+	obj->num_chunks = num;
+}
+
+static void run_chunks(struct objfile *obj, tpool_func func)
+{
+	int i;
+
+	if(load_tpool && obj->num_chunks > 1) {
+		tpool_run(load_tpool, obj->num_chunks, func, obj);
+	} else {
+		for(i=0; i<obj->num_chunks; i++) {
+			func(i, 0, obj);
+		}
+	}
+}
 
-			} else if(line[1] == 'n' && isspace(line[2])) {
-				/* normal */
-				cgm_vec3 norm;
-				if(sscanf(line + 3, "%f %f %f", &norm.x, &norm.y, &norm.z) != 3) {
-					fprintf(stderr, "%s:%d: invalid normal definition: \"%s\"\n", fname, line_num, line);
-					goto err;
+static void count_chunk(int task, int tid, void *cls)
+{
+	struct objfile *obj = cls;
+	struct chunk *ck = obj->chunks + task;
+	const char *ptr = ck->start;
+	char buf[MAX_LINE + 1];
+	char *line;
+
+	while(ptr < ck->end) {
+		ptr = read_line(ptr, ck->end, buf);
+		ck->nlines++;
+
+		switch(line_type(buf, &line)) {
+		case LINE_V:
+			ck->nv++;
+			break;
+		case LINE_VT:
+			ck->nt++;
+			break;
+		case LINE_VN:
+			ck->nn++;
+			break;
+		case LINE_F:
+			ck->nf++;
+			break;
+		case LINE_O:
+			ck->no++;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+#define CHUNK_ERROR(msg) \
+	do { \
+		ck->err = msg; \
+		ck->err_line = lnum; \
+		ck->err_face = nf; \
+		strcpy(ck->err_text, line); \
+		return; \
+	} while(0)
+
+static void parse_chunk(int task, int tid, void *cls)
+{
+	int i, lnum = 0, nv = 0, nt = 0, nn = 0, nf = 0, no = 0;
+	struct objfile *obj = cls;
+	struct chunk *ck = obj->chunks + task;
+	const char *ptr = ck->start;
+	char buf[MAX_LINE + 1];
+	char *line, *fptr;
+	const char *vptr;
+	struct vertex_pos *v;
+	cgm_vec2 *tc;
+	cgm_vec3 *norm;
+	struct facevertex *fv;
+	struct objname *oname;
+
+	while(ptr < ck->end) {
+		ptr = read_line(ptr, ck->end, buf);
+		lnum++;
+
+		switch(line_type(buf, &line)) {
+		case LINE_V:
+			v = obj->varr + ck->v0 + nv;
+			if(!(vptr = parse_float(line + 2, &v->x)) || !(vptr = parse_float(vptr, &v->y)) ||
+					!parse_float(vptr, &v->z)) {
+				CHUNK_ERROR("invalid vertex definition");
+			}
+			nv++;
+			break;
+
+		case LINE_VT:
+			tc = obj->tarr + ck->t0 + nt;
+			if(!(vptr = parse_float(line + 3, &tc->x)) || !parse_float(vptr, &tc->y)) {
+				CHUNK_ERROR("invalid texcoord definition");
+			}
+			tc->y = 1.0f - tc->y;
+			nt++;
+			break;
+
+		case LINE_VN:
+			norm = obj->narr + ck->n0 + nn;
+			if(!(vptr = parse_float(line + 3, &norm->x)) || !(vptr = parse_float(vptr, &norm->y)) ||
+					!parse_float(vptr, &norm->z)) {
+				CHUNK_ERROR("invalid normal definition");
+			}
+			nn++;
+			break;
+
+		case LINE_F:
+			/* at most 4 face-vertices, anything after them is ignored */
+			fv = obj->fvarr + (ck->f0 + nf) * 4;
+			fptr = line + 2;
+			for(i=0; i<4; i++) {
+				if(!(fptr = parse_face_vert(fptr, fv + i, ck->v0 + nv, ck->t0 + nt, ck->n0 + nn))) {
+					break;
 				}
-				if(!(narr = darr_push_impl(narr, &norm))) {
-					fprintf(stderr, "load_mesh: failed to resize normal buffer\n");
-					goto err;
+				if(fv[i].vidx < 0 || fv[i].vidx >= ck->v0 + nv ||
+						fv[i].tidx < -1 || fv[i].tidx >= ck->t0 + nt ||
+						fv[i].nidx < -1 || fv[i].nidx >= ck->n0 + nn) {
+					CHUNK_ERROR("face refers to undefined vertex");
 				}
 			}
+			if(i < 3) {
+				CHUNK_ERROR("invalid face definition");
+			}
+			obj->fvcount[ck->f0 + nf++] = i;
 			break;
 
-		case 'f':
-			if(isspace(line[1])) {
-				/* face */
-				char *ptr = line + 2;
-				struct facevertex fv;
-				struct rbnode *node;
-				int vsz = darr_size(varr);
-				int tsz = darr_size(tarr);
-				int nsz = darr_size(narr);
-
-				for(i=0; i<4; i++) {
-					if(!(ptr = parse_face_vert(ptr, &fv, vsz, tsz, nsz))) {
-						if(i < 3 || found_quad) {
-							fprintf(stderr, "%s:%d: invalid face definition: \"%s\"\n", fname, line_num, line);
-							goto err;
-						} else {
-							break;
-						}
-					}
-
-					if((node = rb_find(rbtree, &fv))) {
-						unsigned int idx = (unsigned int)(intptr_t)node->data;
-						assert(idx < cmesh_attrib_count(mesh, CMESH_ATTR_VERTEX));
-						if(cmesh_push_index(mesh, idx) == -1) {
-							fprintf(stderr, "load_mesh: failed to resize index array\n");
-							goto err;
-						}
-						subcount++;	/* inc number of submesh indices, in case we have submeshes */
-					} else {
-						unsigned int newidx = cmesh_attrib_count(mesh, CMESH_ATTR_VERTEX);
-						struct facevertex *newfv;
-						struct vertex_pos *vptr = varr + fv.vidx;
-
-						if(cmesh_push_attrib3f(mesh, CMESH_ATTR_VERTEX, vptr->x, vptr->y, vptr->z) == -1) {
-							fprintf(stderr, "load_mesh: failed to resize vertex array\n");
-							goto err;
-						}
-						if(fv.nidx >= 0) {
-							float nx = narr[fv.nidx].x;
-							float ny = narr[fv.nidx].y;
-							float nz = narr[fv.nidx].z;
-							if(cmesh_push_attrib3f(mesh, CMESH_ATTR_NORMAL, nx, ny, nz) == -1) {
-								fprintf(stderr, "load_mesh: failed to resize normal array\n");
-								goto err;
-							}
-						}
-						if(fv.tidx >= 0) {
-							float tu = tarr[fv.tidx].x;
-							float tv = tarr[fv.tidx].y;
-							if(cmesh_push_attrib2f(mesh, CMESH_ATTR_TEXCOORD, tu, tv) == -1) {
-								fprintf(stderr, "load_mesh: failed to resize texcoord array\n");
-								goto err;
-							}
-						}
-
-						if(cmesh_push_index(mesh, newidx) == -1) {
-							fprintf(stderr, "load_mesh: failed to resize index array\n");
-							goto err;
-						}
-						subcount++;	/* inc number of submesh indices, in case we have submeshes */
-
-						if((newfv = malloc(sizeof *newfv))) {
-							*newfv = fv;
-						}
-						if(!newfv || rb_insert(rbtree, newfv, (void*)(intptr_t)newidx) == -1) {
-							fprintf(stderr, "load_mesh: failed to insert facevertex to the binary search tree\n");
-							goto err;
-						}
-					}
-				}
-				if(i > 3) found_quad = 1;
+		case LINE_O:
+			oname = obj->names + ck->o0 + no++;
+			oname->face = ck->f0 + nf;
+			line = strlen(line) > 2 ? clean_line(line + 2) : 0;
+			if(!(oname->name = malloc(line ? strlen(line) + 1 : 1))) {
+				CHUNK_ERROR("failed to allocate object name");
 			}
+			strcpy(oname->name, line ? line : "");
 			break;
 
-		case 'o':
+		default:
+			break;
+		}
+	}
+}
+
+struct submesh_range {
+	char *name;
+	int start, count;
+};
+
+/* Merges the face-vertices of the first num_faces faces into mesh vertices.
+ * Once a quad is found, every other face must be a quad too; *quad_err is set
+ * to the first face which isn't.
+ */
+static int build_mesh(struct cmesh *mesh, struct objfile *obj, int num_faces,
+		int *found_quad, int *quad_err)
+{
+	int i, f, num_fv, found, idx, oidx = 0, res = -1;
+	int substart = 0, subcount = 0;
+	const char *subname = 0;
+	struct fvhash ht;
+	const struct facevertex *fv;
+	unsigned int *iarr = 0, *iptr;
+	struct vertex_pos *varr = 0;
+	cgm_vec3 *narr = 0;
+	cgm_vec2 *tarr = 0;
+	struct submesh_range *subarr = 0, sub;
+	int nverts, fresh;
+
+	num_fv = 0;
+	for(f=0; f<num_faces; f++) {
+		num_fv += obj->fvcount[f];
+	}
+
+	if(fvhash_init(&ht, num_fv / 4) == -1 ||
+			!(iarr = malloc((num_fv + 1) * sizeof *iarr)) ||
+			!(varr = darr_alloc(0, sizeof *varr)) ||
+			!(narr = darr_alloc(0, sizeof *narr)) ||
+			!(tarr = darr_alloc(0, sizeof *tarr)) ||
+			!(subarr = darr_alloc(0, sizeof *subarr))) {
+		fprintf(stderr, "load_mesh: failed to allocate vertex arrays\n");
+		goto end;
+	}
+
+	iptr = iarr;
+	for(f=0; f<=num_faces; f++) {
+		while(oidx < obj->num_names && obj->names[oidx].face == f) {
 			if(subcount > 0) {
-				printf("adding submesh: %s\n", subname);
-				cmesh_submesh(mesh, subname, substart / 3, subcount / 3);
-			}
-			free(subname);
-			if((subname = malloc(strlen(line)))) {
-				strcpy(subname, clean_line(line + 2));
+				sub.name = (char*)(subname ? subname : "");
+				sub.start = substart / 3;
+				sub.count = subcount / 3;
+				if(!(subarr = darr_push_impl(subarr, &sub))) {
+					goto nomem;
+				}
 			}
+			subname = obj->names[oidx++].name;
 			substart += subcount;
 			subcount = 0;
-			break;
+		}
+		if(f >= num_faces) break;
 
-		default:
-			break;
+		if(obj->fvcount[f] <= 3 && *found_quad) {
+			*quad_err = f;
+			goto end;
+		}
+
+		fv = obj->fvarr + f * 4;
+		for(i=0; i<obj->fvcount[f]; i++) {
+			if((idx = fvhash_insert(&ht, fv, &found)) == -1) {
+				goto nomem;
+			}
+			if(!found) {
+				if(!(varr = darr_push_impl(varr, obj->varr + fv->vidx))) {
+					goto nomem;
+				}
+				if(fv->nidx >= 0 && !(narr = darr_push_impl(narr, obj->narr + fv->nidx))) {
+					goto nomem;
+				}
+				if(fv->tidx >= 0 && !(tarr = darr_push_impl(tarr, obj->tarr + fv->tidx))) {
+					goto nomem;
+				}
+			}
+			*iptr++ = idx;
+			subcount++;	/* inc number of submesh indices, in case we have submeshes */
+			fv++;
 		}
+		if(i > 3) *found_quad = 1;
+	}
+
+	/* add everything to the mesh. Whole arrays can be set at once in a new
+	 * mesh, if every vertex has the same attributes, otherwise they're pushed
+	 * one by one, to end up with the same result in any case.
+	 */
+	nverts = darr_size(varr);
+	fresh = !cmesh_attrib_count(mesh, CMESH_ATTR_VERTEX) && !cmesh_index_count(mesh);
+	if(fresh && nverts > 0) {
+		if(!cmesh_set_attrib(mesh, CMESH_ATTR_VERTEX, 3, nverts, (float*)varr)) {
+			goto nomem;
+		}
+		if(darr_size(narr) == nverts &&
+				!cmesh_set_attrib(mesh, CMESH_ATTR_NORMAL, 3, nverts, (float*)narr)) {
+			goto nomem;
+		}
+		if(darr_size(tarr) == nverts &&
+				!cmesh_set_attrib(mesh, CMESH_ATTR_TEXCOORD, 2, nverts, (float*)tarr)) {
+			goto nomem;
+		}
+	} else {
+		for(i=0; i<nverts; i++) {
+			if(cmesh_push_attrib3f(mesh, CMESH_ATTR_VERTEX, varr[i].x, varr[i].y, varr[i].z) == -1) {
+				goto nomem;
+			}
+		}
+	}
+	if(!fresh || nverts <= 0 || darr_size(narr) != nverts) {
+		for(i=0; i<darr_size(narr); i++) {
+			if(cmesh_push_attrib3f(mesh, CMESH_ATTR_NORMAL, narr[i].x, narr[i].y, narr[i].z) == -1) {
+				goto nomem;
+			}
+		}
+	}
+	if(!fresh || nverts <= 0 || darr_size(tarr) != nverts) {
+		for(i=0; i<darr_size(tarr); i++) {
+			if(cmesh_push_attrib2f(mesh, CMESH_ATTR_TEXCOORD, tarr[i].x, tarr[i].y) == -1) {
+				goto nomem;
+			}
+		}
+	}
+	if(fresh && num_fv > 0) {
+		if(!cmesh_set_index(mesh, num_fv, iarr)) {
+			goto nomem;
+		}
+	} else {
+		for(i=0; i<num_fv; i++) {
+			if(cmesh_push_index(mesh, iarr[i]) == -1) {
+				goto nomem;
+			}
+		}
+	}
+
+	for(i=0; i<darr_size(subarr); i++) {
+		printf("adding submesh: %s\n", subarr[i].name);
+		cmesh_submesh(mesh, subarr[i].name, subarr[i].start, subarr[i].count);
 	}
 
 	if(subcount > 0) {
@@ -292,8 +636,8 @@ int cmesh_load(struct cmesh *mesh, const char *fname)
 		 * single 'o' for the whole list of faces, is a single mesh without submeshes
 		 */
 		if(cmesh_submesh_count(mesh) > 0) {
-			printf("adding submesh: %s\n", subname);
-			cmesh_submesh(mesh, subname, substart / 3, subcount / 3);
+			printf("adding submesh: %s\n", subname ? subname : "");
+			cmesh_submesh(mesh, subname ? subname : "", substart / 3, subcount / 3);
 		} else {
 			/* ... but use the 'o' name as the name of the mesh instead of the filename */
 			if(subname && *subname) {
@@ -302,22 +646,65 @@ int cmesh_load(struct cmesh *mesh, const char *fname)
 		}
 	}
 
-	result = 0;	/* success */
+	res = 0;
+	goto end;
 
-	printf("loaded %s mesh: %s (%d submeshes): %d vertices, %d faces\n",
-			found_quad ? "quad" : "triangle", fname, cmesh_submesh_count(mesh),
-			cmesh_attrib_count(mesh, CMESH_ATTR_VERTEX), cmesh_poly_count(mesh));
-
-err:
-	if(fp) fclose(fp);
+nomem:
+	fprintf(stderr, "load_mesh: failed to resize vertex arrays\n");
+end:
+	fvhash_destroy(&ht);
+	free(iarr);
 	darr_free(varr);
 	darr_free(narr);
 	darr_free(tarr);
-	rb_free(rbtree);
-	free(subname);
-	return result;
+	darr_free(subarr);
+	return res;
 }
 
+/* copies the next line, or piece of a line, to buf, and returns the start of
+ * the one after it
+ */
+static const char *read_line(const char *ptr, const char *end, char *buf)
+{
+	long len;
+	const char *nl;
+
+	len = end - ptr < MAX_LINE ? end - ptr : MAX_LINE;
+	if((nl = memchr(ptr, '\n', len))) {
+		len = nl - ptr + 1;
+	}
+	memcpy(buf, ptr, len);
+	buf[len] = 0;
+	return ptr + len;
+}
+
+static int line_type(char *buf, char **line)
+{
+	char *s;
+
+	if(!(*line = s = clean_line(buf)) || !*s) {
+		return LINE_OTHER;
+	}
+
+	switch(s[0]) {
+	case 'v':
+		if(isspace(s[1])) return LINE_V;
+		if(s[1] == 't' && isspace(s[2])) return LINE_VT;
+		if(s[1] == 'n' && isspace(s[2])) return LINE_VN;
+		break;
+
+	case 'f':
+		if(isspace(s[1])) return LINE_F;
+		break;
+
+	case 'o':
+		return LINE_O;
+
+	default:
+		break;
+	}
+	return LINE_OTHER;
+}
 
 static char *clean_line(char *s)
 {
@@ -337,6 +724,95 @@ static char *clean_line(char *s)
 	return s;
 }
 
+/* Parses a float, the same way scanf("%f") would. Plain decimal numbers with
+ * up to 15 significant digits and small exponents are converted exactly with
+ * double arithmetic (Clinger's fast path), and then rounded to float, unless
+ * that's ambiguous. Anything else is left to strtod.
+ */
+static const char *parse_float(const char *ptr, float *res)
+{
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+	static const double pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	const char *s;
+	int neg = 0, ndig = 0, sigdig = 0, exp = 0, eneg = 0, eval = 0;
+	double val = 0.0, halfway;
+	float f, next;
+#endif
+	char *endp;
+
+	while(*ptr && isspace(*ptr)) ptr++;
+
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+	s = ptr;
+	if(*s == '-' || *s == '+') {
+		neg = *s++ == '-';
+	}
+	while(*s >= '0' && *s <= '9') {
+		if(sigdig || *s != '0') {
+			val = val * 10.0 + (*s - '0');
+			sigdig++;
+		}
+		ndig++;
+		s++;
+	}
+	if(*s == '.') {
+		s++;
+		while(*s >= '0' && *s <= '9') {
+			if(sigdig || *s != '0') {
+				val = val * 10.0 + (*s - '0');
+				sigdig++;
+			}
+			exp--;
+			ndig++;
+			s++;
+		}
+	}
+	if(!ndig || sigdig > 15) goto slow;
+
+	if(*s == 'e' || *s == 'E') {
+		s++;
+		if(*s == '-' || *s == '+') {
+			eneg = *s++ == '-';
+		}
+		if(*s < '0' || *s > '9') goto slow;
+		while(*s >= '0' && *s <= '9') {
+			if(eval < 1000) eval = eval * 10 + (*s - '0');
+			s++;
+		}
+		exp += eneg ? -eval : eval;
+	}
+	/* hex floats, inf, nan, and anything else out of the ordinary */
+	if(isalnum(*s) || *s == '.' || *s == '_') goto slow;
+
+	if(exp < 0) {
+		if(exp < -22) goto slow;
+		val /= pow10[-exp];
+	} else if(exp > 0) {
+		if(exp > 22) goto slow;
+		val *= pow10[exp];
+	}
+
+	/* val is the correctly rounded double. Rounding it again to float only
+	 * goes wrong if it lies exactly halfway between two floats.
+	 */
+	f = (float)val;
+	if((double)f != val) {
+		next = nextafterf(f, val > f ? FLT_MAX : -FLT_MAX);
+		halfway = ((double)f + (double)next) * 0.5;
+		if(halfway == val) goto slow;
+	}
+	*res = neg ? -f : f;
+	return s;
+
+slow:
+#endif
+	*res = strtof(ptr, &endp);
+	return endp == ptr ? 0 : endp;
+}
+
 static char *parse_idx(char *ptr, int *idx, int arrsz)
 {
 	char *endp;
@@ -359,6 +835,8 @@ static char *parse_idx(char *ptr, int *idx, int arrsz)
  */
 static char *parse_face_vert(char *ptr, struct facevertex *fv, int numv, int numt, int numn)
 {
+	fv->tidx = fv->nidx = -1;
+
 	if(!(ptr = parse_idx(ptr, &fv->vidx, numv)))
 		return 0;
 	if(*ptr != '/') return (!*ptr || isspace(*ptr)) ? ptr : 0;
@@ -378,22 +856,120 @@ static char *parse_face_vert(char *ptr, struct facevertex *fv, int numv, int num
 	return (!*ptr || isspace(*ptr)) ? ptr : 0;
 }
 
-static int cmp_facevert(const void *ap, const void *bp)
+static int fvhash_init(struct fvhash *ht, int size)
 {
-	const struct facevertex *a = ap;
-	const struct facevertex *b = bp;
+	ht->size = 64;
+	while(ht->size < size * 2) {
+		ht->size <<= 1;
+	}
+	ht->count = 0;
+	ht->keys = 0;
+	if(!(ht->slot = malloc(ht->size * sizeof *ht->slot)) ||
+			!(ht->keys = darr_alloc(0, sizeof *ht->keys))) {
+		free(ht->slot);
+		ht->slot = 0;
+		return -1;
+	}
+	memset(ht->slot, 0xff, ht->size * sizeof *ht->slot);
+	return 0;
+}
+
+static void fvhash_destroy(struct fvhash *ht)
+{
+	free(ht->slot);
+	if(ht->keys) darr_free(ht->keys);
+	ht->slot = 0;
+	ht->keys = 0;
+}
 
-	if(a->vidx == b->vidx) {
-		if(a->tidx == b->tidx) {
-			return a->nidx - b->nidx;
+static unsigned int fvhash_func(const struct facevertex *fv)
+{
+	unsigned int h;
+
+	h = (unsigned int)fv->vidx * 0x9e3779b1u;
+	h ^= (unsigned int)fv->tidx * 0x85ebca77u;
+	h ^= (unsigned int)fv->nidx * 0xc2b2ae3du;
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+	return h;
+}
+
+static int fvhash_grow(struct fvhash *ht)
+{
+	unsigned int i, j, mask, newsz = ht->size * 2;
+	int *newslot;
+
+	if(!(newslot = malloc(newsz * sizeof *newslot))) {
+		return -1;
+	}
+	memset(newslot, 0xff, newsz * sizeof *newslot);
+
+	mask = newsz - 1;
+	for(i=0; i<ht->count; i++) {
+		j = fvhash_func(ht->keys + i) & mask;
+		while(newslot[j] != -1) {
+			j = (j + 1) & mask;
 		}
-		return a->tidx - b->tidx;
+		newslot[j] = i;
 	}
-	return a->vidx - b->vidx;
+	free(ht->slot);
+	ht->slot = newslot;
+	ht->size = newsz;
+	return 0;
 }
 
-static void free_rbnode_key(struct rbnode *n, void *cls)
+/* returns the mesh vertex index for the face-vertex, and sets *found if it
+ * was already in the table, or -1 on failure
+ */
+static int fvhash_insert(struct fvhash *ht, const struct facevertex *fv, int *found)
 {
-	free(n->key);
+	unsigned int i, mask;
+	const struct facevertex *key;
+
+	/* keep the load factor under 1/2 */
+	if(ht->count * 2 >= ht->size && fvhash_grow(ht) == -1) {
+		return -1;
+	}
+
+	mask = ht->size - 1;
+	i = fvhash_func(fv) & mask;
+	while(ht->slot[i] != -1) {
+		key = ht->keys + ht->slot[i];
+		if(key->vidx == fv->vidx && key->tidx == fv->tidx && key->nidx == fv->nidx) {
+			*found = 1;
+			return ht->slot[i];
+		}
+		i = (i + 1) & mask;
+	}
+
+	if(!(ht->keys = darr_push_impl(ht->keys, (void*)fv))) {
+		return -1;
+	}
+	ht->slot[i] = ht->count;
+	*found = 0;
+	return ht->count++;
 }
 #endif
+
+/* binary meshes are used straight from the mapped file, which then belongs to
+ * the mesh. Returns 1 if it's not a binary mesh, and the file is still mapped.
+ */
+static int load_binary(struct cmesh *mesh, struct mapfile *mf, const char *fname)
+{
+	int res;
+
+	if((res = cmesh_map(mesh, mf)) == 1) {
+		return 1;
+	}
+	if(res == -1) {
+		fprintf(stderr, "load_mesh: failed to load binary mesh: %s\n", fname);
+		unmap_file(mf);
+		return -1;
+	}
+
+	printf("loaded binary mesh: %s (%d submeshes): %d vertices, %d faces\n", fname,
+			cmesh_submesh_count(mesh), cmesh_attrib_count(mesh, CMESH_ATTR_VERTEX),
+			cmesh_poly_count(mesh));
+	return 0;
+}
@@ -52,12 +52,14 @@ rtk_iconsheet *icons;
 
 rtk_screen *modui;
 rtk_widget *toolbar, *objmenu, *xyzmenu, *mtlwin, *colordlg;
+rtk_widget *statuswin, *statuslbl;
 rtk_widget *tools[NUM_TOOLS];
 
 int selobj;
 unsigned int axismask;
 
 static int create_toolbar(void);
+static int create_statusbar(void);
 static void objadd_handler(rtk_widget *w, void *cls);
 static void addlight_handler(rtk_widget *w, void *cls);
 static void xyz_handler(rtk_widget *w, void *cls);
@@ -77,6 +79,9 @@ int modui_init(void)
 	if(create_toolbar() == -1) {
 		return -1;
 	}
+	if(create_statusbar() == -1) {
+		return -1;
+	}
 	if(create_mtlwin() == -1) {
 		return -1;
 	}
@@ -178,12 +183,32 @@ static int create_toolbar(void)
 	return 0;
 }
 
+static int create_statusbar(void)
+{
+	if(!(statuswin = rtk_create_window(0, "status", 0, win_height - STATUS_HEIGHT,
+					win_width, STATUS_HEIGHT, 0))) {
+		return -1;
+	}
+	rtk_add_window(modui, statuswin);
+	rtk_win_layout(statuswin, RTK_HBOX);
+
+	if(!(statuslbl = rtk_create_label(statuswin, ""))) {
+		return -1;
+	}
+	return 0;
+}
+
 void modui_cleanup(void)
 {
 	rtk_free_iconsheet(icons);
 	rtk_free_screen(modui);
 }
 
+void set_status(const char *text)
+{
+	rtk_set_text(statuslbl, text);
+}
+
 void set_axismask(unsigned int mask)
 {
 	int i, bnidx;
@@ -5,6 +5,7 @@
 #include "rtk.h"
 
 #define TOOLBAR_HEIGHT	26
+#define STATUS_HEIGHT	20
 
 /* tools */
 enum {
@@ -28,6 +29,7 @@ enum {
 
 extern rtk_screen *modui;
 extern rtk_widget *toolbar, *objmenu, *xyzmenu, *mtlwin, *colordlg;
+extern rtk_widget *statuswin, *statuslbl;
 extern rtk_widget *tools[];
 
 extern int selobj;
@@ -42,6 +44,8 @@ void tbn_callback(rtk_widget *w, void *cls);
 
 void set_axismask(unsigned int mask);
 
+void set_status(const char *text);
+
 /* scr_mod.c */
 void inval_vport(void);
 cgm_vec3 get_view_pos(void);
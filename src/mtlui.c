@@ -273,7 +273,7 @@ static void mtlpreview_draw(rtk_widget *w, void *cls)
 
 				cgm_vcons(&ray.dir, 0, 0, -1);
 
-				dcol = shade(&ray, &hit, 1);
+				dcol = shade(&ray, &hit, 1, 1.0f);
 
 				if(curmtl->refl) {
 					reflval = mtlsph_refl[j][i];
@@ -21,6 +21,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "options.h"
 #include "treestor.h"
 #include "logger.h"
+#include "bvh.h"
 
 #define DEF_XRES		640
 #define DEF_YRES		480
@@ -29,6 +30,16 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define DEF_FULLSCR		0
 #define DEF_MOUSE_SPEED	50
 #define DEF_SBALL_SPEED	50
+#define DEF_REND_THREADS	0
+#define DEF_REND_PACKETS	1
+#define DEF_REND_AA			1
+#define DEF_REND_AA_ADAPT	1
+#define DEF_REND_AA_THRES	16
+#define DEF_REND_BUDGET		40
+#define DEF_REND_MIN_CONTRIB	0.002f
+#define DEF_REND_ROULETTE	0
+#define DEF_REND_BVH		BVH_SAH
+#define DEF_REND_ACCEL_CACHE	1
 
 #define DEF_SCALE		1
 
@@ -40,11 +51,17 @@ struct options opt = {
 	DEF_VSYNC,
 	DEF_FULLSCR,
 	DEF_MOUSE_SPEED, DEF_SBALL_SPEED,
+	DEF_REND_THREADS, DEF_REND_PACKETS,
+	DEF_REND_AA, DEF_REND_AA_ADAPT, DEF_REND_AA_THRES,
+	DEF_REND_BUDGET,
+	DEF_REND_MIN_CONTRIB, DEF_REND_ROULETTE,
+	DEF_REND_BVH, DEF_REND_ACCEL_CACHE
 };
 
 int load_options(const char *fname)
 {
 	struct ts_node *cfg;
+	const char *str;
 
 	if(!(cfg = ts_load(fname))) {
 		return -1;
@@ -63,6 +80,21 @@ int load_options(const char *fname)
 	opt.mouse_speed = ts_lookup_int(cfg, "options.input.mousespeed", DEF_MOUSE_SPEED);
 	opt.sball_speed = ts_lookup_int(cfg, "options.input.sballspeed", DEF_SBALL_SPEED);
 
+	opt.rend_threads = ts_lookup_int(cfg, "options.render.threads", DEF_REND_THREADS);
+	opt.rend_packets = ts_lookup_int(cfg, "options.render.packets", DEF_REND_PACKETS);
+	opt.rend_aa = ts_lookup_int(cfg, "options.render.aa", DEF_REND_AA);
+	opt.rend_aa_adaptive = ts_lookup_int(cfg, "options.render.aa_adaptive", DEF_REND_AA_ADAPT);
+	opt.rend_aa_thres = ts_lookup_int(cfg, "options.render.aa_threshold", DEF_REND_AA_THRES);
+	opt.rend_budget = ts_lookup_int(cfg, "options.render.budget", DEF_REND_BUDGET);
+	opt.rend_min_contrib = ts_lookup_num(cfg, "options.render.min_contrib", DEF_REND_MIN_CONTRIB);
+	opt.rend_roulette = ts_lookup_int(cfg, "options.render.roulette", DEF_REND_ROULETTE);
+	str = ts_lookup_str(cfg, "options.render.bvh", bvh_method_name(DEF_REND_BVH));
+	if((opt.rend_bvh = bvh_method(str)) == -1) {
+		warnmsg("invalid BVH build method: %s, using: %s\n", str, bvh_method_name(DEF_REND_BVH));
+		opt.rend_bvh = DEF_REND_BVH;
+	}
+	opt.rend_accel_cache = ts_lookup_int(cfg, "options.render.accel_cache", DEF_REND_ACCEL_CACHE);
+
 	ts_free_tree(cfg);
 	return 0;
 }
@@ -101,6 +133,19 @@ int save_options(const char *fname)
 	WROPT(2, "sballspeed = %d", opt.sball_speed, DEF_SBALL_SPEED);
 	fprintf(fp, "\t}\n");
 
+	fprintf(fp, "\trender {\n");
+	WROPT(2, "threads = %d", opt.rend_threads, DEF_REND_THREADS);
+	WROPT(2, "packets = %d", opt.rend_packets, DEF_REND_PACKETS);
+	WROPT(2, "aa = %d", opt.rend_aa, DEF_REND_AA);
+	WROPT(2, "aa_adaptive = %d", opt.rend_aa_adaptive, DEF_REND_AA_ADAPT);
+	WROPT(2, "aa_threshold = %d", opt.rend_aa_thres, DEF_REND_AA_THRES);
+	WROPT(2, "budget = %d", opt.rend_budget, DEF_REND_BUDGET);
+	WROPT(2, "min_contrib = %g", opt.rend_min_contrib, DEF_REND_MIN_CONTRIB);
+	WROPT(2, "roulette = %d", opt.rend_roulette, DEF_REND_ROULETTE);
+	WROPT(2, "bvh = \"%s\"", bvh_method_name(opt.rend_bvh), bvh_method_name(DEF_REND_BVH));
+	WROPT(2, "accel_cache = %d", opt.rend_accel_cache, DEF_REND_ACCEL_CACHE);
+	fprintf(fp, "\t}\n");
+
 	fprintf(fp, "}\n");
 	fprintf(fp, "# v" "i:ts=4 sts=4 sw=4 noexpandtab:\n");
 
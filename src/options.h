@@ -27,6 +27,17 @@ struct options {
 	int fullscreen;
 
 	int mouse_speed, sball_speed;
+
+	int rend_threads;	/* 0: one per processor */
+	int rend_packets;	/* trace primary rays in packets (SIMD if available) */
+	int rend_aa;		/* NxN supersampling, 1: no antialiasing */
+	int rend_aa_adaptive;	/* only supersample pixels which differ from neighbours */
+	int rend_aa_thres;		/* adaptive antialiasing threshold (0-255) */
+	int rend_budget;		/* modeller render time slice per frame (ms), 0: whole passes */
+	float rend_min_contrib;	/* secondary rays contributing less than this are cut short */
+	int rend_roulette;		/* russian roulette instead of cutting them short */
+	int rend_bvh;			/* BVH build method, see bvh.h */
+	int rend_accel_cache;	/* keep mesh BVHs in a cache file next to the scene */
 };
 
 extern struct options opt;
@@ -0,0 +1,407 @@
+/*
+RetroRay - integrated standalone vintage modeller/renderer
+Copyright (C) 2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <float.h>
+#include "packet.h"
+#include "scene.h"
+#include "cscene.h"
+#include "geom.h"
+#include "bvh.h"
+#include "cpuid.h"
+#include "logger.h"
+#include "rstats.h"
+
+/* the SSE kernel is only built when the compiler targets SSE anyway (always
+ * true on x86-64). Otherwise we're stuck with the scalar kernel.
+ */
+#ifdef __SSE__
+#define BUILD_SSE
+#include <xmmintrin.h>
+#endif
+
+/* must match the thresholds in geom.c */
+#define TMIN	1e-4f
+
+static int isect_packet_scalar(const struct cscene *csc, struct raypacket *pk);
+#ifdef BUILD_SSE
+static int isect_packet_sse(const struct cscene *csc, struct raypacket *pk);
+#endif
+
+static int (*isect_packet)(const struct cscene*, struct raypacket*) = isect_packet_scalar;
+static const char *kernel_name = "scalar";
+
+
+void packet_init(int allow_simd)
+{
+	isect_packet = isect_packet_scalar;
+	kernel_name = "scalar";
+
+#ifdef BUILD_SSE
+	if(allow_simd && read_cpuid(&cpuid) == 0 && CPU_HAVE_SSE) {
+		isect_packet = isect_packet_sse;
+		kernel_name = "SSE";
+	}
+#endif
+	infomsg("ray packet kernel: %s\n", kernel_name);
+}
+
+const char *packet_kernel_name(void)
+{
+	return kernel_name;
+}
+
+void packet_setray(struct raypacket *pk, int idx, const cgm_ray *ray)
+{
+	pk->ox[idx] = ray->origin.x;
+	pk->oy[idx] = ray->origin.y;
+	pk->oz[idx] = ray->origin.z;
+	pk->dx[idx] = ray->dir.x;
+	pk->dy[idx] = ray->dir.y;
+	pk->dz[idx] = ray->dir.z;
+}
+
+void packet_getray(const struct raypacket *pk, int idx, cgm_ray *ray)
+{
+	ray->origin.x = pk->ox[idx];
+	ray->origin.y = pk->oy[idx];
+	ray->origin.z = pk->oz[idx];
+	ray->dir.x = pk->dx[idx];
+	ray->dir.y = pk->dy[idx];
+	ray->dir.z = pk->dz[idx];
+}
+
+int csc_intersect_packet(const struct cscene *csc, struct raypacket *pk)
+{
+	return isect_packet(csc, pk);
+}
+
+
+/* ---- scalar kernel: one ray at a time, through csc_nearest ---- */
+
+static int isect_packet_scalar(const struct cscene *csc, struct raypacket *pk)
+{
+	int i, prim, nhits = 0;
+	cgm_ray ray;
+
+	for(i=0; i<pk->count; i++) {
+		packet_getray(pk, i, &ray);
+		if((prim = csc_nearest(csc, &ray, pk->t + i)) >= 0) {
+			pk->obj[i] = csc->obj[prim];
+			nhits++;
+		} else {
+			pk->obj[i] = 0;
+			pk->t[i] = FLT_MAX;
+		}
+	}
+	return nhits;
+}
+
+
+#ifdef BUILD_SSE
+/* ---- SSE kernel: 4 rays at a time, through the BVH and each object ---- */
+
+struct sse_packet {
+	__m128 ox, oy, oz;
+	__m128 dx, dy, dz;
+	__m128 idx, idy, idz;	/* inverse direction, for the BVH slab tests */
+	__m128 tmax;
+	struct object **obj;
+};
+
+#define SPLAT(x)	_mm_set1_ps(x)
+
+/* returns the mask of rays intersecting the box before their current tmax, and
+ * their entry distances in tnear
+ */
+static int sse_slabs(const struct sse_packet *sp, const struct aabox *box, __m128 *tnear)
+{
+	__m128 t0, t1, tmin, tmax;
+
+	/* min/max would turn an empty box inside out, into the whole space */
+	if(aabox_empty(box)) return 0;
+
+	t0 = _mm_mul_ps(_mm_sub_ps(SPLAT(box->vmin.x), sp->ox), sp->idx);
+	t1 = _mm_mul_ps(_mm_sub_ps(SPLAT(box->vmax.x), sp->ox), sp->idx);
+	tmin = _mm_max_ps(_mm_setzero_ps(), _mm_min_ps(t0, t1));
+	tmax = _mm_min_ps(sp->tmax, _mm_max_ps(t0, t1));
+
+	t0 = _mm_mul_ps(_mm_sub_ps(SPLAT(box->vmin.y), sp->oy), sp->idy);
+	t1 = _mm_mul_ps(_mm_sub_ps(SPLAT(box->vmax.y), sp->oy), sp->idy);
+	tmin = _mm_max_ps(tmin, _mm_min_ps(t0, t1));
+	tmax = _mm_min_ps(tmax, _mm_max_ps(t0, t1));
+
+	t0 = _mm_mul_ps(_mm_sub_ps(SPLAT(box->vmin.z), sp->oz), sp->idz);
+	t1 = _mm_mul_ps(_mm_sub_ps(SPLAT(box->vmax.z), sp->oz), sp->idz);
+	tmin = _mm_max_ps(tmin, _mm_min_ps(t0, t1));
+	tmax = _mm_min_ps(tmax, _mm_max_ps(t0, t1));
+
+	*tnear = tmin;
+	return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+}
+
+/* smallest tnear of the rays in mask */
+static float min_tnear(__m128 tnear, int mask)
+{
+	int i;
+	float t[4], res = FLT_MAX;
+
+	_mm_storeu_ps(t, tnear);
+	for(i=0; i<4; i++) {
+		if((mask & (1 << i)) && t[i] < res) {
+			res = t[i];
+		}
+	}
+	return res;
+}
+
+/* updates the closest hit of the rays which hit obj at distance t, for the
+ * rays in the hit mask, if it's closer than their current tmax
+ */
+static void sse_update_hits(struct sse_packet *sp, const struct object *obj, __m128 t, __m128 hitmask)
+{
+	int i, mask;
+
+	hitmask = _mm_and_ps(hitmask, _mm_cmplt_ps(t, sp->tmax));
+	if(!(mask = _mm_movemask_ps(hitmask))) {
+		return;
+	}
+	sp->tmax = _mm_or_ps(_mm_and_ps(hitmask, t), _mm_andnot_ps(hitmask, sp->tmax));
+
+	for(i=0; i<4; i++) {
+		if(mask & (1 << i)) {
+			sp->obj[i] = (struct object*)obj;
+		}
+	}
+}
+
+/* transform the packet to the object space of primitive k */
+static void sse_localrays(const struct sse_packet *sp, const struct cscene *csc, int k,
+		__m128 *o, __m128 *d)
+{
+	float * const *m = csc->inv;
+	__m128 m0 = SPLAT(m[0][k]), m1 = SPLAT(m[1][k]), m2 = SPLAT(m[2][k]);
+	__m128 m4 = SPLAT(m[4][k]), m5 = SPLAT(m[5][k]), m6 = SPLAT(m[6][k]);
+	__m128 m8 = SPLAT(m[8][k]), m9 = SPLAT(m[9][k]), m10 = SPLAT(m[10][k]);
+
+	o[0] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(sp->ox, m0), _mm_mul_ps(sp->oy, m1)),
+			_mm_add_ps(_mm_mul_ps(sp->oz, m2), SPLAT(m[3][k])));
+	o[1] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(sp->ox, m4), _mm_mul_ps(sp->oy, m5)),
+			_mm_add_ps(_mm_mul_ps(sp->oz, m6), SPLAT(m[7][k])));
+	o[2] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(sp->ox, m8), _mm_mul_ps(sp->oy, m9)),
+			_mm_add_ps(_mm_mul_ps(sp->oz, m10), SPLAT(m[11][k])));
+
+	d[0] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(sp->dx, m0), _mm_mul_ps(sp->dy, m1)),
+			_mm_mul_ps(sp->dz, m2));
+	d[1] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(sp->dx, m4), _mm_mul_ps(sp->dy, m5)),
+			_mm_mul_ps(sp->dz, m6));
+	d[2] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(sp->dx, m8), _mm_mul_ps(sp->dy, m9)),
+			_mm_mul_ps(sp->dz, m10));
+}
+
+/* unit sphere: the hit is the nearest root within [TMIN, 1], like ray_object_t */
+static void sse_sphere(struct sse_packet *sp, const struct cscene *csc, int k)
+{
+	__m128 o[3], d[3], a, b, c, disc, sqrt_d, inv_2a, t0, t1, in0, in1, t;
+
+	sse_localrays(sp, csc, k, o, d);
+
+	a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], d[0]), _mm_mul_ps(d[1], d[1])),
+			_mm_mul_ps(d[2], d[2]));
+	b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], o[0]), _mm_mul_ps(d[1], o[1])),
+			_mm_mul_ps(d[2], o[2]));
+	b = _mm_add_ps(b, b);
+	c = _mm_add_ps(_mm_add_ps(_mm_mul_ps(o[0], o[0]), _mm_mul_ps(o[1], o[1])),
+			_mm_mul_ps(o[2], o[2]));
+	c = _mm_sub_ps(c, SPLAT(1.0f));
+
+	disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(SPLAT(4.0f), _mm_mul_ps(a, c)));
+	if(!_mm_movemask_ps(_mm_cmpge_ps(disc, _mm_setzero_ps()))) {
+		return;
+	}
+	sqrt_d = _mm_sqrt_ps(_mm_max_ps(disc, _mm_setzero_ps()));
+	inv_2a = _mm_div_ps(SPLAT(0.5f), a);
+
+	t0 = _mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(_mm_add_ps(b, sqrt_d), inv_2a));
+	t1 = _mm_mul_ps(_mm_sub_ps(sqrt_d, b), inv_2a);
+
+	/* near root if it's within the segment, otherwise the far root */
+	in0 = _mm_and_ps(_mm_cmpge_ps(t0, SPLAT(TMIN)), _mm_cmple_ps(t0, SPLAT(1.0f)));
+	in1 = _mm_and_ps(_mm_cmpge_ps(t1, SPLAT(TMIN)), _mm_cmple_ps(t1, SPLAT(1.0f)));
+	t = _mm_or_ps(_mm_and_ps(in0, t0), _mm_andnot_ps(in0, t1));
+
+	sse_update_hits(sp, csc->obj[k], t, _mm_and_ps(_mm_or_ps(in0, in1), _mm_cmpge_ps(disc, _mm_setzero_ps())));
+}
+
+/* unit box centered at the origin: the hit is the entry point, or the exit point
+ * if the entry is behind the origin, like ray_object_t
+ */
+static void sse_box(struct sse_packet *sp, const struct cscene *csc, int k)
+{
+	__m128 o[3], d[3], inv, t0, t1, tmin, tmax, tent, hitmask, t;
+	int i;
+
+	sse_localrays(sp, csc, k, o, d);
+
+	tmin = SPLAT(-FLT_MAX);
+	tmax = SPLAT(FLT_MAX);
+	for(i=0; i<3; i++) {
+		inv = _mm_div_ps(SPLAT(1.0f), d[i]);
+		t0 = _mm_mul_ps(_mm_sub_ps(SPLAT(-0.5f), o[i]), inv);
+		t1 = _mm_mul_ps(_mm_sub_ps(SPLAT(0.5f), o[i]), inv);
+		tmin = _mm_max_ps(tmin, _mm_min_ps(t0, t1));
+		tmax = _mm_min_ps(tmax, _mm_max_ps(t0, t1));
+	}
+
+	hitmask = _mm_cmple_ps(tmin, tmax);
+	tent = _mm_cmpge_ps(tmin, SPLAT(TMIN));
+	t = _mm_or_ps(_mm_and_ps(tent, tmin), _mm_andnot_ps(tent, tmax));
+	hitmask = _mm_and_ps(hitmask, _mm_cmpge_ps(t, SPLAT(TMIN)));
+
+	sse_update_hits(sp, csc->obj[k], t, hitmask);
+}
+
+/* objects without a SIMD kernel, are intersected one ray at a time */
+static void sse_generic(struct sse_packet *sp, const struct object *obj, int mask)
+{
+	int i;
+	float tmax[4], t;
+	cgm_ray ray;
+	float ox[4], oy[4], oz[4], dx[4], dy[4], dz[4];
+
+	_mm_storeu_ps(ox, sp->ox);
+	_mm_storeu_ps(oy, sp->oy);
+	_mm_storeu_ps(oz, sp->oz);
+	_mm_storeu_ps(dx, sp->dx);
+	_mm_storeu_ps(dy, sp->dy);
+	_mm_storeu_ps(dz, sp->dz);
+	_mm_storeu_ps(tmax, sp->tmax);
+
+	for(i=0; i<4; i++) {
+		if(!(mask & (1 << i))) continue;
+		cgm_vcons(&ray.origin, ox[i], oy[i], oz[i]);
+		cgm_vcons(&ray.dir, dx[i], dy[i], dz[i]);
+		if(ray_object_t(&ray, obj, &t) && t < tmax[i]) {
+			tmax[i] = t;
+			sp->obj[i] = (struct object*)obj;
+		}
+	}
+	sp->tmax = _mm_loadu_ps(tmax);
+}
+
+static int isect_packet_sse(const struct cscene *csc, struct raypacket *pk)
+{
+	int i, k, top, mask, lmask, rmask, nhits;
+	float tinit[4];
+	__m128 ltnear, rtnear;
+	const struct bvh *bvh = csc->bvh;
+	const struct bvhnode *node, *left, *right;
+	const struct bvhnode *stack[BVH_MAX_DEPTH];
+	struct sse_packet sp;
+
+	/* unused lanes start with a negative tmax, so they never hit anything */
+	for(i=0; i<4; i++) {
+		if(i < pk->count) {
+			tinit[i] = FLT_MAX;
+		} else {
+			tinit[i] = -1.0f;
+			pk->ox[i] = pk->oy[i] = pk->oz[i] = 0.0f;
+			pk->dx[i] = pk->dy[i] = pk->dz[i] = 1.0f;
+		}
+		pk->obj[i] = 0;
+	}
+
+	sp.ox = _mm_loadu_ps(pk->ox);
+	sp.oy = _mm_loadu_ps(pk->oy);
+	sp.oz = _mm_loadu_ps(pk->oz);
+	sp.dx = _mm_loadu_ps(pk->dx);
+	sp.dy = _mm_loadu_ps(pk->dy);
+	sp.dz = _mm_loadu_ps(pk->dz);
+	sp.tmax = _mm_loadu_ps(tinit);
+	sp.obj = pk->obj;
+
+	/* avoid 0 * inf = NaN in the slab tests, same as bvh.c */
+	sp.idx = _mm_div_ps(SPLAT(1.0f), sp.dx);
+	sp.idy = _mm_div_ps(SPLAT(1.0f), sp.dy);
+	sp.idz = _mm_div_ps(SPLAT(1.0f), sp.dz);
+	sp.idx = _mm_or_ps(_mm_and_ps(_mm_cmpeq_ps(sp.dx, _mm_setzero_ps()), SPLAT(1e30f)),
+			_mm_andnot_ps(_mm_cmpeq_ps(sp.dx, _mm_setzero_ps()), sp.idx));
+	sp.idy = _mm_or_ps(_mm_and_ps(_mm_cmpeq_ps(sp.dy, _mm_setzero_ps()), SPLAT(1e30f)),
+			_mm_andnot_ps(_mm_cmpeq_ps(sp.dy, _mm_setzero_ps()), sp.idy));
+	sp.idz = _mm_or_ps(_mm_and_ps(_mm_cmpeq_ps(sp.dz, _mm_setzero_ps()), SPLAT(1e30f)),
+			_mm_andnot_ps(_mm_cmpeq_ps(sp.dz, _mm_setzero_ps()), sp.idz));
+
+	if(csc->num_prims && bvh->num_nodes) {
+		stack[0] = bvh->nodes;
+		top = 1;
+		while(top > 0) {
+			node = stack[--top];
+			/* retest on the way down: tmax might have moved since it was pushed */
+			if(!(mask = sse_slabs(&sp, &node->box, &ltnear))) {
+				continue;
+			}
+
+			if(node->count) {
+				RSTAT_ADD(pkt_tests, node->count);
+				/* leaf primitives are contiguous in the compiled scene */
+				for(i=0; i<node->count; i++) {
+					k = node->idx + i;
+					switch(csc->type[k]) {
+					case OBJ_SPHERE:
+						sse_sphere(&sp, csc, k);
+						break;
+					case OBJ_BOX:
+						sse_box(&sp, csc, k);
+						break;
+					case OBJ_LIGHT:
+						break;
+					default:
+						sse_generic(&sp, csc->obj[k], mask);
+					}
+				}
+				continue;
+			}
+
+			left = bvh->nodes + node->idx;
+			right = left + 1;
+			lmask = sse_slabs(&sp, &left->box, &ltnear);
+			rmask = sse_slabs(&sp, &right->box, &rtnear);
+
+			/* push the furthest child first, so that the nearest is visited first */
+			if(lmask && rmask) {
+				if(min_tnear(ltnear, lmask) <= min_tnear(rtnear, rmask)) {
+					stack[top++] = right;
+					stack[top++] = left;
+				} else {
+					stack[top++] = left;
+					stack[top++] = right;
+				}
+			} else if(lmask) {
+				stack[top++] = left;
+			} else if(rmask) {
+				stack[top++] = right;
+			}
+		}
+	}
+
+	_mm_storeu_ps(pk->t, sp.tmax);
+	nhits = 0;
+	for(i=0; i<pk->count; i++) {
+		if(pk->obj[i]) nhits++;
+	}
+	return nhits;
+}
+#endif	/* BUILD_SSE */
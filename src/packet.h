@@ -0,0 +1,56 @@
+/*
+RetroRay - integrated standalone vintage modeller/renderer
+Copyright (C) 2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef PACKET_H_
+#define PACKET_H_
+
+#include "cgmath/cgmath.h"
+
+#define PACKET_SIZE		4
+
+struct cscene;
+struct object;
+
+/* a packet of coherent rays, stored as a structure of arrays, so that the SSE
+ * kernel can process the whole packet at once
+ */
+struct raypacket {
+	float ox[PACKET_SIZE], oy[PACKET_SIZE], oz[PACKET_SIZE];
+	float dx[PACKET_SIZE], dy[PACKET_SIZE], dz[PACKET_SIZE];
+	int count;	/* number of valid rays, the rest are ignored */
+
+	/* results of scn_intersect_packet */
+	float t[PACKET_SIZE];
+	struct object *obj[PACKET_SIZE];	/* 0 if the ray didn't hit anything */
+};
+
+/* selects the fastest packet intersection kernel supported by the CPU. If
+ * allow_simd is 0, the scalar kernel is always used.
+ */
+void packet_init(int allow_simd);
+const char *packet_kernel_name(void);
+
+void packet_setray(struct raypacket *pk, int idx, const cgm_ray *ray);
+void packet_getray(const struct raypacket *pk, int idx, cgm_ray *ray);
+
+/* closest hit for every ray in the packet, just like csc_intersect, but only
+ * the distance and object are calculated. Use ray_hit_attr for the rest.
+ * Returns the number of rays which hit something.
+ */
+int csc_intersect_packet(const struct cscene *csc, struct raypacket *pk);
+
+#endif	/* PACKET_H_ */
@@ -15,13 +15,47 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
 #include "rend.h"
 #include "app.h"
 #include "cgmath/cgmath.h"
 #include "geom.h"
 #include "util.h"
+#include "darray.h"
 #include "gfxutil.h"
 #include "scene.h"
+#include "options.h"
+#include "tpool.h"
+#include "cmesh.h"
+#include "packet.h"
+#include "cscene.h"
+#include "rstats.h"
+#include "timer.h"
+#include "logger.h"
+
+/* render passes are split into tiles of roughly this size, distributed to the
+ * worker threads of the thread pool
+ */
+#define TILE_SIZE	32
+
+/* tiles per thread handed to the thread pool at once, by render_timed */
+#define SLICE_TILES	4
+
+/* supersampling grid size limit (per axis) */
+#define MAX_AA		8
+
+struct rpass {
+	uint32_t *fb;
+	tpool_func tilefunc;
+	int first_tile;		/* tasks are numbered from here, see render_timed */
+	int xstep, ystep;
+	int prev_xstep, prev_ystep;	/* sample spacing of the previous pass, 0 for none */
+	int tile_width, tile_height;
+	int num_xtiles;
+};
 
 struct img_pixmap renderbuf;
 
@@ -30,11 +64,100 @@ cgm_vec3 ambient;
 
 static int rx, ry, rwidth, rheight;
 static int roffs;
-static int xstep, ystep;
+static int xstep, ystep, prev_xstep, prev_ystep;
+
+/* pass in progress, pass_tiles is 0 if there's none */
+static struct rpass pass;
+static int pass_tiles;
 static int pan_x, pan_y;
 
+static struct thread_pool *tpool;
+
+/* compiled copy of the scene, used for all intersection queries while rendering */
+static struct cscene csc;
+
+struct rstats rstat_pass, rstat_frame;
+
+#ifndef NO_RSTATS
+/* per-thread counters, padded to keep them in separate cache lines */
+union tstats {
+	struct rstats st;
+	char pad[128];
+};
+static union tstats *tstats;
+static int num_tstats;
+
+/* anything traced outside of render (picking etc) is counted here */
+static struct rstats rstat_dummy;
+RSTAT_TLS struct rstats *rstat_cur = &rstat_dummy;
+#endif
+
+/* antialiasing pass state: aa_pending is set after the last progressive pass,
+ * and aa_mask marks which pixels of the render region need supersampling
+ */
+static int aa_pending;
+static unsigned char *aa_mask;
+static int aa_mask_size;
+
+/* Primary hit of every pixel of the last complete render. Edits which don't
+ * change what the primary rays see (materials, light colors and energies)
+ * only need to shade these again, without tracing anything but secondary rays.
+ * The hit attributes are recalculated with ray_hit_attr from t, which gives
+ * the exact same values, at a fraction of the memory.
+ */
+struct gbuf_pixel {
+	struct object *obj;	/* 0 if the primary ray didn't hit anything */
+	float t;
+};
+static struct gbuf_pixel *gbuf;
+static int gbuf_size;
+static int gbuf_valid;
+
+/* camera and render region the cached hits were recorded with */
+struct gbuf_key {
+	const struct scene *scn;
+	int x, y, width, height, fbwidth, fbheight;
+	int pan_x, pan_y;
+	cgm_ray corner[3];	/* primary rays through 3 corners, to detect camera changes */
+};
+static struct gbuf_key gbuf_key;
+
+/* scene state of the last complete render, to find out what changed since */
+struct objsnap {
+	struct object *obj;
+	unsigned int geom_gen;	/* tells apart different objects at the same address */
+	struct material *mtl;
+	float xform[16];
+	struct aabox box;
+};
+struct rparams {
+	int max_depth, aa, aa_adaptive, aa_thres;
+	float min_contrib;
+	int roulette;
+	cgm_vec3 ambient;
+};
+static struct objsnap *snap_obj;	/* darr */
+static struct material *snap_mtl;	/* darr */
+static struct light *snap_lt;		/* darr */
+static struct rparams snap_params;
+
+/* what rend_begin decided this render has to do, see begin_gbuf */
+enum {
+	RMODE_FULL,		/* progressive passes tracing every pixel */
+	RMODE_RESHADE,	/* shade the cached primary hits of every pixel again */
+	RMODE_DAMAGE,	/* find the pixels which might see the objects which moved ... */
+	RMODE_RETRACE	/* ... and trace only those again, keeping the rest */
+};
+static int rmode;
+static unsigned int rend_accel_gen;
+
+/* old and new bounds of the objects which moved, and the pixels they affect */
+static struct aabox *dmg_box;		/* darr */
+static unsigned char *dmg_mask;
+static int dmg_mask_size;
+
 static struct light def_light = {OBJ_LIGHT, "light_default", {0, 0, 0}, {1, 1, 1},
-	{0, 0, 0}, {0, 0, 0, 1}, {0}, {0}, {0}, 0, 0, {1, 1, 1}, {1, 1, 1}, 1, 1};
+	{0, 0, 0}, {0, 0, 0, 1}, {0}, {0}, {0}, 0, 0, 0, {1, 1, 1}, {1, 1, 1}, 1, 1};
 
 
 int rend_init(void)
@@ -47,11 +170,65 @@ int rend_init(void)
 	pan_x = pan_y = 0;
 
 	max_ray_depth = 6;
+
+	packet_init(1);
+	csc_init(&csc);
+
+	snap_obj = darr_alloc(0, sizeof *snap_obj);
+	snap_mtl = darr_alloc(0, sizeof *snap_mtl);
+	snap_lt = darr_alloc(0, sizeof *snap_lt);
+	dmg_box = darr_alloc(0, sizeof *dmg_box);
+	gbuf_valid = 0;
+
+	if(!(tpool = tpool_create(opt.rend_threads))) {
+		return -1;
+	}
+	bvh_set_threads(tpool);
+	cmesh_load_threads(tpool);
+#ifndef NO_RSTATS
+	num_tstats = tpool_num_threads(tpool);
+	if(!(tstats = calloc(num_tstats, sizeof *tstats))) {
+		errormsg("failed to allocate ray statistics for %d threads\n", num_tstats);
+		bvh_set_threads(0);
+		cmesh_load_threads(0);
+		tpool_destroy(tpool);
+		tpool = 0;
+		return -1;
+	}
+#endif
 	return 0;
 }
 
 void rend_destroy(void)
 {
+	bvh_set_threads(0);
+	cmesh_load_threads(0);
+	tpool_destroy(tpool);
+	tpool = 0;
+	csc_destroy(&csc);
+#ifndef NO_RSTATS
+	free(tstats);
+	tstats = 0;
+	num_tstats = 0;
+#endif
+	free(aa_mask);
+	aa_mask = 0;
+	aa_mask_size = 0;
+	free(gbuf);
+	gbuf = 0;
+	gbuf_size = 0;
+	gbuf_valid = 0;
+	darr_free(snap_obj);
+	darr_free(snap_mtl);
+	darr_free(snap_lt);
+	darr_free(dmg_box);
+	snap_obj = 0;
+	snap_mtl = 0;
+	snap_lt = 0;
+	dmg_box = 0;
+	free(dmg_mask);
+	dmg_mask = 0;
+	dmg_mask_size = 0;
 	img_destroy(&renderbuf);
 }
 
@@ -68,6 +245,214 @@ void rend_pan(int xoffs, int yoffs)
 	pan_y = yoffs;
 }
 
+static int next_pow2(int x)
+{
+	int res = 1;
+	while(res < x) res <<= 1;
+	return res;
+}
+
+static void calc_gbuf_key(struct gbuf_key *key)
+{
+	memset(key, 0, sizeof *key);
+	key->scn = scn;
+	key->x = rx;
+	key->y = ry;
+	key->width = rwidth;
+	key->height = rheight;
+	key->fbwidth = renderbuf.width;
+	key->fbheight = renderbuf.height;
+	key->pan_x = pan_x;
+	key->pan_y = pan_y;
+	primray(key->corner, 0, 0);
+	primray(key->corner + 1, renderbuf.width, 0);
+	primray(key->corner + 2, 0, renderbuf.height);
+}
+
+static void calc_rparams(struct rparams *rp)
+{
+	memset(rp, 0, sizeof *rp);
+	rp->max_depth = max_ray_depth;
+	rp->aa = opt.rend_aa;
+	rp->aa_adaptive = opt.rend_aa_adaptive;
+	rp->aa_thres = opt.rend_aa_thres;
+	rp->min_contrib = opt.rend_min_contrib;
+	rp->roulette = opt.rend_roulette;
+	rp->ambient = ambient;
+}
+
+/* grows the box a bit, so that rays grazing it are not missed due to rounding */
+static void pad_box(struct aabox *box)
+{
+	float pad = 1e-3f * (box->vmax.x - box->vmin.x + box->vmax.y - box->vmin.y +
+			box->vmax.z - box->vmin.z) + 1e-4f;
+	box->vmin.x -= pad;
+	box->vmin.y -= pad;
+	box->vmin.z -= pad;
+	box->vmax.x += pad;
+	box->vmax.y += pad;
+	box->vmax.z += pad;
+}
+
+/* Compares the scene against the snapshot of the last complete render, and
+ * collects the old and new bounds of every object which moved (or had its
+ * material reassigned) in dmg_box. Returns the number of such objects, or -1
+ * if objects were added, removed or replaced, or their geometry changed, which
+ * makes the cached hits unusable.
+ */
+static int find_moved(void)
+{
+	int i, num, count = 0;
+	struct object *obj;
+	struct objsnap *os;
+	struct aabox box;
+
+	num = scn_num_objects(scn);
+	if(num != darr_size(snap_obj)) {
+		return -1;
+	}
+
+	darr_clear(dmg_box);
+	for(i=0; i<num; i++) {
+		obj = scn->objects[i];
+		os = snap_obj + i;
+		if(os->obj != obj || os->geom_gen != obj->geom_gen) {
+			return -1;
+		}
+		if(os->mtl == obj->mtl && memcmp(os->xform, obj->xform, sizeof os->xform) == 0) {
+			continue;
+		}
+		box = os->box;
+		pad_box(&box);
+		darr_push(dmg_box, &box);
+		box = scn->objbox[i];
+		pad_box(&box);
+		darr_push(dmg_box, &box);
+		count++;
+	}
+	return count;
+}
+
+/* the damage pass can only keep pixels if their shading didn't change */
+static int same_shading(void)
+{
+	int i, num;
+	struct rparams rp;
+
+	calc_rparams(&rp);
+	if(memcmp(&rp, &snap_params, sizeof rp) != 0) {
+		return 0;
+	}
+
+	num = scn_num_materials(scn);
+	if(num != darr_size(snap_mtl)) {
+		return 0;
+	}
+	for(i=0; i<num; i++) {
+		if(memcmp(snap_mtl + i, scn->mtl[i], sizeof *snap_mtl) != 0) {
+			return 0;
+		}
+	}
+
+	num = scn_num_lights(scn);
+	if(num != darr_size(snap_lt)) {
+		return 0;
+	}
+	for(i=0; i<num; i++) {
+		if(memcmp(snap_lt + i, scn->lights[i], sizeof *snap_lt) != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void take_snapshot(void)
+{
+	int i, num;
+	struct objsnap *os;
+
+	num = scn_num_objects(scn);
+	darr_resize(snap_obj, num);
+	for(i=0; i<num; i++) {
+		os = snap_obj + i;
+		os->obj = scn->objects[i];
+		os->geom_gen = os->obj->geom_gen;
+		os->mtl = os->obj->mtl;
+		memcpy(os->xform, os->obj->xform, sizeof os->xform);
+		os->box = scn->objbox[i];
+	}
+
+	num = scn_num_materials(scn);
+	darr_resize(snap_mtl, num);
+	for(i=0; i<num; i++) {
+		memcpy(snap_mtl + i, scn->mtl[i], sizeof *snap_mtl);
+	}
+
+	num = scn_num_lights(scn);
+	darr_resize(snap_lt, num);
+	for(i=0; i<num; i++) {
+		memcpy(snap_lt + i, scn->lights[i], sizeof *snap_lt);
+	}
+
+	calc_rparams(&snap_params);
+}
+
+void rend_invalidate(void)
+{
+	gbuf_valid = 0;
+}
+
+/* Decides how much of the last render can be reused:
+ *  - if no object moved since, and the camera and render region are the same,
+ *    the cached primary hits only need to be shaded again.
+ *  - if some objects moved, but nothing else changed, only the pixels which
+ *    might see them (directly, through a reflection, or in their shadows) are
+ *    traced again, and the rest of the render buffer is kept.
+ *  - otherwise everything is traced from scratch, filling the cache.
+ * The cache is invalid until the new render completes.
+ */
+static void begin_gbuf(void)
+{
+	struct gbuf_key key;
+	int npix, nmoved;
+
+	calc_gbuf_key(&key);
+	rmode = RMODE_FULL;
+	if(gbuf_valid && memcmp(&key, &gbuf_key, sizeof key) == 0) {
+		if((nmoved = find_moved()) == 0) {
+			rmode = RMODE_RESHADE;
+		} else if(nmoved > 0 && same_shading()) {
+			rmode = RMODE_DAMAGE;
+		}
+	}
+	gbuf_key = key;
+	gbuf_valid = 0;
+	take_snapshot();
+
+	if(rmode == RMODE_DAMAGE && rwidth * rheight > dmg_mask_size) {
+		free(dmg_mask);
+		if(!(dmg_mask = malloc(rwidth * rheight))) {
+			warnmsg("failed to allocate damage mask, rendering everything\n");
+			dmg_mask_size = 0;
+			rmode = RMODE_FULL;
+		} else {
+			dmg_mask_size = rwidth * rheight;
+		}
+	}
+	if(rmode != RMODE_FULL) return;
+
+	npix = renderbuf.width * renderbuf.height;
+	if(npix > gbuf_size) {
+		free(gbuf);
+		if(!(gbuf = malloc(npix * sizeof *gbuf))) {
+			warnmsg("failed to allocate primary hit cache, re-shading disabled\n");
+			gbuf_size = 0;
+			return;
+		}
+		gbuf_size = npix;
+	}
+}
+
 void rend_begin(int x, int y, int w, int h)
 {
 	int i;
@@ -85,8 +470,41 @@ void rend_begin(int x, int y, int w, int h)
 	}
 	roffs = ry * renderbuf.width + rx;
 
-	xstep = rwidth;
-	ystep = rheight;
+	/* power of two steps, so that the sample grid of each pass includes all
+	 * the samples of the previous passes, which don't have to be traced again
+	 */
+	xstep = next_pow2(rwidth);
+	ystep = next_pow2(rheight);
+	prev_xstep = prev_ystep = 0;
+	pass_tiles = 0;
+	aa_pending = 0;
+
+	rstat_clear(&rstat_pass);
+	rstat_clear(&rstat_frame);
+
+	scn_update_accel(scn);
+	csc_update(&csc, scn);
+
+	begin_gbuf();
+	rend_accel_gen = scn->accel_gen;
+	switch(rmode) {
+	case RMODE_RESHADE:
+		/* a single pass shading the cached hits of all pixels */
+		xstep = ystep = 1;
+		dbgmsg("re-shading cached primary hits\n");
+		break;
+
+	case RMODE_DAMAGE:
+		/* the previous render stays in the render buffer, and is only
+		 * patched where it might have changed
+		 */
+		xstep = ystep = 1;
+		dbgmsg("re-tracing pixels affected by %d moved objects\n", darr_size(dmg_box) / 2);
+		return;
+
+	default:
+		break;
+	}
 
 	ptr = (uint32_t*)renderbuf.pixels + roffs;
 	for(i=0; i<rheight; i++) {
@@ -108,84 +526,747 @@ static void fillrect(uint32_t *fb, int x, int y, int w, int h, uint32_t c)
 	}
 }
 
+static void render_tile(int task, int tid, void *cls);
+static void render_aa_tile(int task, int tid, void *cls);
+static void reshade_tile(int task, int tid, void *cls);
+static void damage_tile(int task, int tid, void *cls);
+static void retrace_tile(int task, int tid, void *cls);
+static int calc_aa_mask(void);
+static void mask_damage(unsigned char *mask);
+static void put_sample(struct rpass *pass, int x, int y, cgm_vec3 *color);
+static void trace_packet(const cgm_ray *rays, int count, cgm_vec3 *res,
+		struct gbuf_pixel **gpix);
+static int begin_pass(uint32_t *fb);
+static void run_tiles(int count);
+static int end_pass(void);
+static void end_frame(void);
+
 int render(uint32_t *fb)
 {
-	int i, j, w, h, offs, r, g, b;
-	uint32_t *dest, pcol;
-	cgm_vec3 color;
+	return render_timed(fb, 0);
+}
+
+int render_timed(uint32_t *fb, int msec)
+{
+	int count;
+	unsigned long t0;
 	cgm_ray ray;
 
-	dest = (uint32_t*)renderbuf.pixels + roffs;
-	if(fb) {
-		fb += roffs;
+	/* the scene might have changed since the last call */
+	scn_update_accel(scn);
+	if(csc_update(&csc, scn) == -1) {
+		pass_tiles = 0;
+		return 0;
 	}
 
-	if(xstep < 1) xstep = 1;
-	if(ystep < 1) ystep = 1;
-
 	if(scn_num_lights(scn) == 0) {
 		primray(&ray, renderbuf.width / 2, renderbuf.height / 2);
 		def_light.pos = ray.origin;
 	}
 
-	for(i=0; i<rheight; i+=ystep) {
-		h = ystep;
-		if(i + h > rheight) h = rheight - i;
+	if(!pass_tiles && begin_pass(fb) == -1) {
+		return 0;
+	}
+	pass.fb = fb;
 
-		for(j=0; j<rwidth; j+=xstep) {
-			primray(&ray, rx + j + pan_x, ry + i + pan_y);
-			ray_trace(&ray, max_ray_depth, &color);
+	/* a few tiles per thread at a time, checking the clock in between */
+	count = tpool_num_threads(tpool) * SLICE_TILES;
+	t0 = get_msec();
+	do {
+		if(count > pass_tiles - pass.first_tile) {
+			count = pass_tiles - pass.first_tile;
+		}
+		run_tiles(count);
+	} while(pass.first_tile < pass_tiles && (msec <= 0 || (long)(get_msec() - t0) < msec));
+
+	if(pass.first_tile < pass_tiles) {
+		return 1;	/* pass not done yet, continue from there on the next call */
+	}
+	pass_tiles = 0;
+	return end_pass();
+}
+
+/* sets up the next pass: either the next progressive refinement step, or the
+ * antialiasing pass after the last one
+ */
+static int begin_pass(uint32_t *fb)
+{
+	int num_ytiles;
+
+	pass.fb = fb;
+	pass.first_tile = 0;
+	rstat_clear(&rstat_pass);
+
+	if(aa_pending) {
+		/* final antialiasing pass, over whole pixels */
+		if(calc_aa_mask() == -1) {
+			aa_pending = 0;
+			return -1;
+		}
+		if(rmode == RMODE_RETRACE) {
+			mask_damage(aa_mask);
+		}
+		pass.xstep = pass.ystep = 1;
+		pass.prev_xstep = pass.prev_ystep = 0;
+		pass.tile_width = pass.tile_height = TILE_SIZE;
+		pass.num_xtiles = (rwidth + TILE_SIZE - 1) / TILE_SIZE;
+		num_ytiles = (rheight + TILE_SIZE - 1) / TILE_SIZE;
+		pass.tilefunc = render_aa_tile;
+		pass_tiles = pass.num_xtiles * num_ytiles;
+		return 0;
+	}
+
+	if(rmode != RMODE_FULL) {
+		pass.xstep = pass.ystep = 1;
+		pass.prev_xstep = pass.prev_ystep = 0;
+		pass.tile_width = pass.tile_height = TILE_SIZE;
+		pass.num_xtiles = (rwidth + TILE_SIZE - 1) / TILE_SIZE;
+		num_ytiles = (rheight + TILE_SIZE - 1) / TILE_SIZE;
+		switch(rmode) {
+		case RMODE_RESHADE:
+			pass.tilefunc = reshade_tile;
+			break;
+		case RMODE_DAMAGE:
+			pass.tilefunc = damage_tile;
+			break;
+		default:
+			pass.tilefunc = retrace_tile;
+		}
+		pass_tiles = pass.num_xtiles * num_ytiles;
+		return 0;
+	}
+
+	pass.xstep = xstep;
+	pass.ystep = ystep;
+	pass.prev_xstep = prev_xstep;
+	pass.prev_ystep = prev_ystep;
+
+	/* make tiles a multiple of the sample spacing, so that each sample and its
+	 * preview block always fall in the same tile
+	 */
+	pass.tile_width = (TILE_SIZE + xstep - 1) / xstep * xstep;
+	pass.tile_height = (TILE_SIZE + ystep - 1) / ystep * ystep;
+	pass.num_xtiles = (rwidth + pass.tile_width - 1) / pass.tile_width;
+	num_ytiles = (rheight + pass.tile_height - 1) / pass.tile_height;
+	pass.tilefunc = render_tile;
+	pass_tiles = pass.num_xtiles * num_ytiles;
+	return 0;
+}
+
+/* runs the next count tiles of the current pass on the thread pool, and
+ * collects their statistics
+ */
+static void run_tiles(int count)
+{
+	unsigned long t0;
+#ifndef NO_RSTATS
+	int i;
+
+	for(i=0; i<num_tstats; i++) {
+		rstat_clear(&tstats[i].st);
+	}
+#endif
+
+	t0 = get_msec();
+	tpool_run(tpool, count, pass.tilefunc, &pass);
+	pass.first_tile += count;
+
+#ifndef NO_RSTATS
+	for(i=0; i<num_tstats; i++) {
+		rstat_merge(&rstat_pass, &tstats[i].st);
+	}
+#endif
+	rstat_pass.msec += get_msec() - t0;
+}
+
+/* returns 1 if there are more passes to go, 0 if the render is done */
+static int end_pass(void)
+{
+	char buf[RSTAT_FMT_SIZE];
+
+	rstat_pass.passes = 1;
+	rstat_merge(&rstat_frame, &rstat_pass);
+	rstat_format(&rstat_pass, buf);
+	dbgmsg("render pass %lu: %s\n", rstat_frame.passes, buf);
+
+	if(aa_pending) {
+		aa_pending = 0;
+		end_frame();
+		return 0;
+	}
+
+	if(rmode == RMODE_DAMAGE) {
+		rmode = RMODE_RETRACE;
+		return 1;
+	}
+	if(rmode == RMODE_FULL && (xstep > 1 || ystep > 1)) {
+		prev_xstep = xstep;
+		prev_ystep = ystep;
+		if(xstep > 1) xstep >>= 1;
+		if(ystep > 1) ystep >>= 1;
+		return 1;
+	}
+
+	if(opt.rend_aa > 1) {
+		aa_pending = 1;
+		return 1;
+	}
+	end_frame();
+	return 0;
+}
+
+static void end_frame(void)
+{
+	char buf[RSTAT_FMT_SIZE];
+
+	rstat_format(&rstat_frame, buf);
+	infomsg("render done, %lu passes: %s\n", rstat_frame.passes, buf);
+
+	/* every pixel is done, and the cached hits complete, unless the geometry
+	 * changed while rendering
+	 */
+	gbuf_valid = gbuf && scn->accel_gen == rend_accel_gen;
+}
+
+/* Each pixel only depends on its own coordinates, so the result is the same
+ * regardless of how tiles end up distributed to threads.
+ * Only samples which are not on the grid of the previous pass are traced, the
+ * rest are already done. Over all passes, this traces exactly one primary ray
+ * per pixel.
+ */
+static void render_tile(int task, int tid, void *cls)
+{
+	int i, j, k, x0, y0, x1, y1, xinc, xoffs;
+	int sx[PACKET_SIZE];
+	cgm_vec3 color[PACKET_SIZE];
+	cgm_ray ray[PACKET_SIZE];
+	struct gbuf_pixel *gpix[PACKET_SIZE];
+	struct rpass *pass = cls;
+
+#ifndef NO_RSTATS
+	rstat_cur = &tstats[tid].st;
+#endif
+
+	task += pass->first_tile;
+	x0 = (task % pass->num_xtiles) * pass->tile_width;
+	y0 = (task / pass->num_xtiles) * pass->tile_height;
+	if((x1 = x0 + pass->tile_width) > rwidth) x1 = rwidth;
+	if((y1 = y0 + pass->tile_height) > rheight) y1 = rheight;
 
-			if(color.x > 1.0f) color.x = 1.0f;
-			if(color.y > 1.0f) color.y = 1.0f;
-			if(color.z > 1.0f) color.z = 1.0f;
-			r = cround64(color.x * 255.0f);
-			g = cround64(color.y * 255.0f);
-			b = cround64(color.z * 255.0f);
-			pcol = PACK_RGB32(r, g, b);
+	for(i=y0; i<y1; i+=pass->ystep) {
+		xinc = pass->xstep;
+		xoffs = 0;
+		if(pass->prev_ystep && i % pass->prev_ystep == 0) {
+			/* row of the previous grid: only the samples between the old ones */
+			if(pass->prev_xstep == pass->xstep) continue;
+			xinc = pass->prev_xstep;
+			xoffs = x0 % xinc ? 0 : pass->xstep;
+		}
+
+		/* trace horizontal runs of samples together */
+		j = x0 + xoffs;
+		while(j < x1) {
+			for(k=0; k<PACKET_SIZE && j < x1; k++) {
+				sx[k] = j;
+				primray(ray + k, rx + j + pan_x, ry + i + pan_y);
+				if(gbuf) {
+					gpix[k] = gbuf + (ry + i) * renderbuf.width + rx + j;
+				}
+				j += xinc;
+			}
+			trace_packet(ray, k, color, gbuf ? gpix : 0);
+
+			while(--k >= 0) {
+				put_sample(pass, sx[k], i, color + k);
+			}
+		}
+	}
+}
+
+/* Decides which pixels to supersample. In adaptive mode, only pixels which
+ * differ from any of their neighbours by more than the threshold (in any color
+ * channel) are marked. The mask is computed before the antialiasing pass
+ * starts writing to the render buffer, so that the result doesn't depend on
+ * the order tiles are processed.
+ */
+static int calc_aa_mask(void)
+{
+	int i, j, k, thres, d;
+	uint32_t *pptr, c0, c1;
+	unsigned char *mptr;
+	static const int nbx[] = {1, -1, 1, 0}, nby[] = {0, 1, 1, 1};
+
+	if(rwidth * rheight > aa_mask_size) {
+		free(aa_mask);
+		if(!(aa_mask = malloc(rwidth * rheight))) {
+			errormsg("failed to allocate antialiasing mask\n");
+			aa_mask_size = 0;
+			return -1;
+		}
+		aa_mask_size = rwidth * rheight;
+	}
+
+	if(!opt.rend_aa_adaptive) {
+		memset(aa_mask, 1, rwidth * rheight);
+		return 0;
+	}
+	memset(aa_mask, 0, rwidth * rheight);
+
+	thres = opt.rend_aa_thres;
+	for(i=0; i<rheight; i++) {
+		pptr = (uint32_t*)renderbuf.pixels + roffs + i * renderbuf.width;
+		mptr = aa_mask + i * rwidth;
+		for(j=0; j<rwidth; j++) {
+			c0 = pptr[j];
+			/* compare against the neighbours right and below, marking both */
+			for(k=0; k<4; k++) {
+				int x = j + nbx[k];
+				int y = i + nby[k];
+				if(x < 0 || x >= rwidth || y >= rheight) continue;
+
+				c1 = pptr[nby[k] * renderbuf.width + x];
+				if((d = (int)UNP_RED(c0) - (int)UNP_RED(c1)) < 0) d = -d;
+				if(d <= thres) {
+					if((d = (int)UNP_GREEN(c0) - (int)UNP_GREEN(c1)) < 0) d = -d;
+					if(d <= thres) {
+						if((d = (int)UNP_BLUE(c0) - (int)UNP_BLUE(c1)) < 0) d = -d;
+					}
+				}
+				if(d > thres) {
+					mptr[j] = 1;
+					mptr[nby[k] * rwidth + x] = 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+/* traces an NxN grid of samples in every masked pixel of the tile, and
+ * replaces the single sample of the progressive passes with their average
+ */
+static void render_aa_tile(int task, int tid, void *cls)
+{
+	int i, j, k, n, sx, sy, nsamples, x0, y0, x1, y1;
+	float offs, scale;
+	cgm_vec3 color[PACKET_SIZE], sum;
+	cgm_ray ray[PACKET_SIZE];
+	struct rpass *pass = cls;
+
+	n = opt.rend_aa > MAX_AA ? MAX_AA : opt.rend_aa;
+	nsamples = n * n;
+	scale = 1.0f / nsamples;
+	/* subsamples are centered on the original sample position */
+	offs = 0.5f / n - 0.5f;
+
+#ifndef NO_RSTATS
+	rstat_cur = &tstats[tid].st;
+#endif
+
+	task += pass->first_tile;
+	x0 = (task % pass->num_xtiles) * pass->tile_width;
+	y0 = (task / pass->num_xtiles) * pass->tile_height;
+	if((x1 = x0 + pass->tile_width) > rwidth) x1 = rwidth;
+	if((y1 = y0 + pass->tile_height) > rheight) y1 = rheight;
+
+	for(i=y0; i<y1; i++) {
+		for(j=x0; j<x1; j++) {
+			if(!aa_mask[i * rwidth + j]) continue;
+
+			cgm_vcons(&sum, 0, 0, 0);
+			sx = sy = 0;
+			while(sy < n) {
+				for(k=0; k<PACKET_SIZE && sy < n; k++) {
+					primray(ray + k, rx + j + pan_x + offs + (float)sx / n,
+							ry + i + pan_y + offs + (float)sy / n);
+					if(++sx >= n) {
+						sx = 0;
+						sy++;
+					}
+				}
+				trace_packet(ray, k, color, 0);
+
+				while(--k >= 0) {
+					if(color[k].x > 1.0f) color[k].x = 1.0f;
+					if(color[k].y > 1.0f) color[k].y = 1.0f;
+					if(color[k].z > 1.0f) color[k].z = 1.0f;
+					cgm_vadd(&sum, color + k);
+				}
+			}
+			cgm_vscale(&sum, scale);
+			put_sample(pass, j, i, &sum);
+		}
+	}
+}
+
+/* shades the cached primary hits of the tile, see begin_gbuf */
+static void reshade_tile(int task, int tid, void *cls)
+{
+	int i, j, x0, y0, x1, y1;
+	cgm_vec3 color;
+	cgm_ray ray;
+	struct rayhit hit;
+	struct gbuf_pixel *gpix;
+	struct rpass *pass = cls;
 
-			offs = i * renderbuf.width + j;
-			dest[offs] = pcol;
+#ifndef NO_RSTATS
+	rstat_cur = &tstats[tid].st;
+#endif
 
-			if(fb) {
-				w = xstep;
-				if(j + w > rwidth) w = rwidth - j;
+	task += pass->first_tile;
+	x0 = (task % pass->num_xtiles) * pass->tile_width;
+	y0 = (task / pass->num_xtiles) * pass->tile_height;
+	if((x1 = x0 + pass->tile_width) > rwidth) x1 = rwidth;
+	if((y1 = y0 + pass->tile_height) > rheight) y1 = rheight;
 
-				fillrect(fb, j, i, w, h, pcol);
+	for(i=y0; i<y1; i++) {
+		gpix = gbuf + (ry + i) * renderbuf.width + rx;
+		for(j=x0; j<x1; j++) {
+			primray(&ray, rx + j + pan_x, ry + i + pan_y);
+			if(gpix[j].obj) {
+				hit.t = gpix[j].t;
+				hit.obj = gpix[j].obj;
+				ray_hit_attr(&ray, &hit);
+				color = shade(&ray, &hit, max_ray_depth, 1.0f);
+			} else {
+				color = bgcolor(&ray);
 			}
+			put_sample(pass, j, i, &color);
 		}
 	}
+}
+
+static int pixel_damaged(int x, int y, const struct gbuf_pixel *gpix)
+{
+	int i, j, nbox, num_lights;
+	cgm_ray ray;
+	struct rayhit hit;
+	struct light *lt;
 
-	xstep >>= 1;
-	ystep >>= 1;
+	nbox = darr_size(dmg_box);
+	primray(&ray, x + pan_x, y + pan_y);
+	for(i=0; i<nbox; i++) {
+		if(aabox_ray(dmg_box + i, &ray, FLT_MAX)) {
+			return 1;
+		}
+	}
+	if(!gpix->obj) return 0;
 
-	if((xstep | ystep) >= 1) {
+	/* reflection rays could end up anywhere */
+	if(gpix->obj->mtl->refl != 0.0f) {
 		return 1;
 	}
+
+	hit.t = gpix->t;
+	hit.obj = gpix->obj;
+	ray_hit_attr(&ray, &hit);
+
+	if(!(num_lights = scn_num_lights(scn))) {
+		num_lights = 1;
+	}
+	for(i=0; i<num_lights; i++) {
+		lt = scn_num_lights(scn) ? scn->lights[i] : &def_light;
+		if(!lt->shadows) continue;
+
+		/* same segment as the shadow ray of calc_light */
+		ray.origin = hit.pos;
+		ray.dir = lt->pos;
+		cgm_vsub(&ray.dir, &hit.pos);
+		for(j=0; j<nbox; j++) {
+			if(aabox_ray(dmg_box + j, &ray, 1.0f)) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Marks the pixels of the tile which might have changed because of the objects
+ * which moved: pixels which see them, or the space they used to occupy, either
+ * directly or in a reflection, and pixels they cast or used to cast shadows
+ * on. Meanwhile the previous render is copied to the framebuffer, for the
+ * rest of the pixels, which are kept.
+ */
+static void damage_tile(int task, int tid, void *cls)
+{
+	int i, j, x0, y0, x1, y1;
+	uint32_t *src;
+	unsigned char *mptr;
+	struct gbuf_pixel *gpix;
+	struct rpass *pass = cls;
+
+#ifndef NO_RSTATS
+	rstat_cur = &tstats[tid].st;
+#endif
+
+	task += pass->first_tile;
+	x0 = (task % pass->num_xtiles) * pass->tile_width;
+	y0 = (task / pass->num_xtiles) * pass->tile_height;
+	if((x1 = x0 + pass->tile_width) > rwidth) x1 = rwidth;
+	if((y1 = y0 + pass->tile_height) > rheight) y1 = rheight;
+
+	for(i=y0; i<y1; i++) {
+		gpix = gbuf + (ry + i) * renderbuf.width + rx;
+		mptr = dmg_mask + i * rwidth;
+		for(j=x0; j<x1; j++) {
+			mptr[j] = pixel_damaged(rx + j, ry + i, gpix + j);
+		}
+
+		if(pass->fb) {
+			src = (uint32_t*)renderbuf.pixels + roffs + i * renderbuf.width;
+			memcpy(pass->fb + roffs + i * renderbuf.width + x0, src + x0,
+					(x1 - x0) * sizeof *src);
+		}
+	}
+}
+
+/* pixels next to damaged ones are also traced again, to catch changes smaller
+ * than a pixel, or only visible to some of its antialiasing subsamples
+ */
+static int near_damage(int x, int y)
+{
+	int i, j;
+
+	for(i=y-1; i<=y+1; i++) {
+		if(i < 0 || i >= rheight) continue;
+		for(j=x-1; j<=x+1; j++) {
+			if(j < 0 || j >= rwidth) continue;
+			if(dmg_mask[i * rwidth + j]) {
+				return 1;
+			}
+		}
+	}
 	return 0;
 }
 
-int ray_trace(const cgm_ray *ray, int maxiter, cgm_vec3 *res)
+static void mask_damage(unsigned char *mask)
 {
+	int i, j;
+
+	for(i=0; i<rheight; i++) {
+		for(j=0; j<rwidth; j++) {
+			if(*mask && !near_damage(j, i)) {
+				*mask = 0;
+			}
+			mask++;
+		}
+	}
+}
+
+/* traces the damaged pixels of the tile again, see damage_tile */
+static void retrace_tile(int task, int tid, void *cls)
+{
+	int i, j, k, x0, y0, x1, y1;
+	int sx[PACKET_SIZE];
+	cgm_vec3 color[PACKET_SIZE];
+	cgm_ray ray[PACKET_SIZE];
+	struct gbuf_pixel *gpix[PACKET_SIZE];
+	struct rpass *pass = cls;
+
+#ifndef NO_RSTATS
+	rstat_cur = &tstats[tid].st;
+#endif
+
+	task += pass->first_tile;
+	x0 = (task % pass->num_xtiles) * pass->tile_width;
+	y0 = (task / pass->num_xtiles) * pass->tile_height;
+	if((x1 = x0 + pass->tile_width) > rwidth) x1 = rwidth;
+	if((y1 = y0 + pass->tile_height) > rheight) y1 = rheight;
+
+	for(i=y0; i<y1; i++) {
+		j = x0;
+		while(j < x1) {
+			for(k=0; k<PACKET_SIZE && j < x1; j++) {
+				if(!near_damage(j, i)) continue;
+				sx[k] = j;
+				primray(ray + k, rx + j + pan_x, ry + i + pan_y);
+				gpix[k] = gbuf + (ry + i) * renderbuf.width + rx + j;
+				k++;
+			}
+			if(!k) break;
+			trace_packet(ray, k, color, gpix);
+
+			while(--k >= 0) {
+				put_sample(pass, sx[k], i, color + k);
+			}
+		}
+	}
+}
+
+static void put_sample(struct rpass *pass, int x, int y, cgm_vec3 *color)
+{
+	int r, g, b, w, h;
+	uint32_t pcol;
+
+	if(color->x > 1.0f) color->x = 1.0f;
+	if(color->y > 1.0f) color->y = 1.0f;
+	if(color->z > 1.0f) color->z = 1.0f;
+	r = cround64(color->x * 255.0f);
+	g = cround64(color->y * 255.0f);
+	b = cround64(color->z * 255.0f);
+	pcol = PACK_RGB32(r, g, b);
+
+	((uint32_t*)renderbuf.pixels)[roffs + y * renderbuf.width + x] = pcol;
+
+	if(pass->fb) {
+		w = pass->xstep;
+		if(x + w > rwidth) w = rwidth - x;
+		h = pass->ystep;
+		if(y + h > rheight) h = rheight - y;
+
+		fillrect(pass->fb + roffs, x, y, w, h, pcol);
+	}
+}
+
+/* same as calling ray_trace for each ray, but finds the primary hits for all
+ * of them at once, with the packet intersection kernel. If gpix is not null,
+ * the primary hits are also recorded there, for re-shading later.
+ */
+static void trace_packet(const cgm_ray *rays, int count, cgm_vec3 *res,
+		struct gbuf_pixel **gpix)
+{
+	int i;
+	struct raypacket pk;
 	struct rayhit hit;
 
-	if(maxiter <= 0 || !scn_intersect(scn, ray, &hit)) {
+	RSTAT_ADD(prim_rays, count);
+
+	if(!opt.rend_packets || max_ray_depth <= 0) {
+		for(i=0; i<count; i++) {
+			if(max_ray_depth > 0 && csc_intersect(&csc, rays + i, &hit)) {
+				res[i] = shade(rays + i, &hit, max_ray_depth, 1.0f);
+			} else {
+				hit.obj = 0;
+				res[i] = bgcolor(rays + i);
+			}
+			if(gpix) {
+				gpix[i]->obj = hit.obj;
+				gpix[i]->t = hit.t;
+			}
+		}
+		return;
+	}
+
+	pk.count = count;
+	for(i=0; i<count; i++) {
+		packet_setray(&pk, i, rays + i);
+	}
+	csc_intersect_packet(&csc, &pk);
+
+	for(i=0; i<count; i++) {
+		if(gpix) {
+			gpix[i]->obj = pk.obj[i];
+			gpix[i]->t = pk.t[i];
+		}
+		if(pk.obj[i]) {
+			hit.t = pk.t[i];
+			hit.obj = pk.obj[i];
+			ray_hit_attr(rays + i, &hit);
+			res[i] = shade(rays + i, &hit, max_ray_depth, 1.0f);
+		} else {
+			res[i] = bgcolor(rays + i);
+		}
+	}
+}
+
+int ray_trace(const cgm_ray *ray, int maxiter, float thru, cgm_vec3 *res)
+{
+	struct rayhit hit;
+
+	if(maxiter <= 0 || !csc_intersect(&csc, ray, &hit)) {
 		*res = bgcolor(ray);
 		return 0;
 	}
 
-	*res = shade(ray, &hit, maxiter);
+	*res = shade(ray, &hit, maxiter, thru);
 	return 1;
 }
 
+void rstat_clear(struct rstats *st)
+{
+	memset(st, 0, sizeof *st);
+}
+
+void rstat_merge(struct rstats *dest, const struct rstats *src)
+{
+	dest->prim_rays += src->prim_rays;
+	dest->shadow_rays += src->shadow_rays;
+	dest->refl_rays += src->refl_rays;
+	dest->obj_tests += src->obj_tests;
+	dest->pkt_tests += src->pkt_tests;
+	dest->passes += src->passes;
+	dest->msec += src->msec;
+}
+
+void rstat_format(const struct rstats *st, char *buf)
+{
+	unsigned long rays = st->prim_rays + st->shadow_rays + st->refl_rays;
+	unsigned long krays_sec = st->msec ? rays / st->msec : 0;
+
+	sprintf(buf, "%lu ms, %lu rays (%lu prim, %lu shadow, %lu refl), %lu tests, %lu.%03lu Mrays/s",
+			st->msec, rays, st->prim_rays, st->shadow_rays, st->refl_rays,
+			st->obj_tests + st->pkt_tests, krays_sec / 1000, krays_sec % 1000);
+}
+
 cgm_vec3 bgcolor(const cgm_ray *ray)
 {
 	return cgm_vvec(0, 0, 0);
 }
 
-cgm_vec3 shade(const cgm_ray *ray, const struct rayhit *hit, int maxiter)
+/* deterministic pseudo-random number in [0, 1) derived from the ray itself, so
+ * that the image doesn't depend on which thread traces what
+ */
+static float ray_random(const cgm_ray *ray)
+{
+	int i;
+	uint32_t x, h = 0x811c9dc5;
+	const float *fptr = &ray->origin.x;
+
+	for(i=0; i<3; i++) {
+		memcpy(&x, fptr + i, sizeof x);
+		h = (h ^ x) * 0x01000193;
+		memcpy(&x, &ray->dir.x + i, sizeof x);
+		h = (h ^ x) * 0x01000193;
+	}
+	h ^= h >> 16;
+	h *= 0x7feb352d;
+	h ^= h >> 15;
+	return (float)(h >> 8) / 16777216.0f;
+}
+
+/* Decides if a secondary ray from a hit on mtl is worth tracing. thru is the
+ * throughput of the new ray, and scale the factor its color is multiplied
+ * with, which russian roulette increases for the paths it lets through, to
+ * make up for the ones it terminates.
+ */
+static int continue_path(const cgm_ray *ray, const struct material *mtl, int maxiter,
+		float *thru, float *scale)
+{
+	float p;
+
+	if(mtl->max_depth > 0 && max_ray_depth - maxiter >= mtl->max_depth) {
+		return 0;
+	}
+	if(*thru >= opt.rend_min_contrib) {
+		return 1;
+	}
+	if(!opt.rend_roulette) {
+		return 0;
+	}
+
+	p = *thru / opt.rend_min_contrib;
+	if(ray_random(ray) >= p) {
+		return 0;
+	}
+	*thru = opt.rend_min_contrib;
+	*scale /= p;
+	return 1;
+}
+
+cgm_vec3 shade(const cgm_ray *ray, const struct rayhit *hit, int maxiter, float thru)
 {
 	int i, num_lights;
+	float rthru, rscale;
 	cgm_vec3 color, dcol, scol, texel, norm, vdir;
 	cgm_ray rray;
 	struct material *mtl;
@@ -221,8 +1302,13 @@ cgm_vec3 shade(const cgm_ray *ray, const struct rayhit *hit, int maxiter)
 		rray.dir = vdir;
 		cgm_vreflect(&rray.dir, &norm);
 		cgm_vscale(&rray.dir, -500.0f);
-		ray_trace(&rray, maxiter - 1, &color);
-		cgm_vadd_scaled(&scol, &color, mtl->refl);		/* TODO fresnel */
+		rthru = thru * mtl->refl;
+		rscale = mtl->refl;		/* TODO fresnel */
+		if(continue_path(&rray, mtl, maxiter, &rthru, &rscale)) {
+			RSTAT_ADD(refl_rays, 1);
+			ray_trace(&rray, maxiter - 1, rthru, &color);
+			cgm_vadd_scaled(&scol, &color, rscale);
+		}
 	}
 
 	if(mtl->texmap) {
@@ -248,8 +1334,11 @@ int calc_light(const struct rayhit *hit, const struct light *lt,
 	ray.origin = hit->pos;
 	ray.dir = ldir;
 
-	if(lt->shadows && scn_intersect(scn, &ray, 0)) {
-		return 0;	/* in shadow */
+	if(lt->shadows) {
+		RSTAT_ADD(shadow_rays, 1);
+		if(csc_occluded(&csc, &ray)) {
+			return 0;	/* in shadow */
+		}
 	}
 
 	cgm_vnormalize(&ldir);
@@ -30,15 +30,30 @@ extern cgm_vec3 ambient;
 struct scene;
 
 int rend_init(void);
+void rend_destroy(void);
 void rend_size(int xsz, int ysz);
 void rend_pan(int xoffs, int yoffs);
 void rend_begin(int x, int y, int w, int h);
+/* drops the cached primary hits, so that the next render traces everything
+ * from scratch, even if nothing changed
+ */
+void rend_invalidate(void);
+
+/* runs one render pass, returns 0 when the render is complete */
 int render(uint32_t *fb);
+/* Same as render, but returns after about msec milliseconds, even in the middle
+ * of a pass, which continues on the next call. msec <= 0 means no time limit.
+ */
+int render_timed(uint32_t *fb, int msec);
 
-int ray_trace(const cgm_ray *ray, int maxiter, cgm_vec3 *res);
+/* thru is the fraction of the ray's color which ends up in the pixel, 1 for
+ * primary rays. Secondary rays contributing less than opt.rend_min_contrib are
+ * not traced.
+ */
+int ray_trace(const cgm_ray *ray, int maxiter, float thru, cgm_vec3 *res);
 
 cgm_vec3 bgcolor(const cgm_ray *ray);
-cgm_vec3 shade(const cgm_ray *ray, const struct rayhit *hit, int maxiter);
+cgm_vec3 shade(const cgm_ray *ray, const struct rayhit *hit, int maxiter, float thru);
 
 int calc_light(const struct rayhit *hit, const struct light *lt,
 		const cgm_vec3 *norm, const cgm_vec3 *vdir, cgm_vec3 *dcol, cgm_vec3 *scol);
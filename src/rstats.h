@@ -0,0 +1,54 @@
+/*
+RetroRay - integrated standalone vintage modeller/renderer
+Copyright (C) 2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef RSTATS_H_
+#define RSTATS_H_
+
+#include "util.h"
+
+/* Ray statistics. Each render thread accumulates its own counters without any
+ * locking, through rstat_cur, and render merges them at the end of each pass.
+ * Build with -DNO_RSTATS to compile all the counting out.
+ */
+struct rstats {
+	unsigned long prim_rays, shadow_rays, refl_rays;
+	unsigned long obj_tests;	/* ray-object tests (scalar and occlusion) */
+	unsigned long pkt_tests;	/* packet-object tests (SIMD kernel) */
+	unsigned long passes, msec;
+};
+
+/* totals of the last pass, and of all passes since rend_begin */
+extern struct rstats rstat_pass, rstat_frame;
+
+#ifndef NO_RSTATS
+#define RSTAT_TLS	THREAD_LOCAL
+
+extern RSTAT_TLS struct rstats *rstat_cur;
+
+#define RSTAT_ADD(field, n)	(rstat_cur->field += (n))
+#else
+#define RSTAT_ADD(field, n)
+#endif
+
+void rstat_clear(struct rstats *st);
+void rstat_merge(struct rstats *dest, const struct rstats *src);
+
+/* short human-readable summary for the UI and the log */
+void rstat_format(const struct rstats *st, char *buf);
+#define RSTAT_FMT_SIZE	256
+
+#endif	/* RSTATS_H_ */
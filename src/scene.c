@@ -20,11 +20,28 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "app.h"
 #include "scene.h"
 #include "geom.h"
+#include "trimesh.h"
+#include "acache.h"
 #include "darray.h"
 #include "logger.h"
+#include "options.h"
 #include "treestor.h"
+#include "rstats.h"
 
 static struct material *default_material(void);
+static int save_accel_cache(struct scene *scn, const char *fname);
+
+/* incremented every time an object matrix is recalculated, for scn_update_accel
+ * to detect object transformations after the fact.
+ */
+static unsigned int xform_gen;
+/* global, so that generations are unique across scenes */
+static unsigned int accel_gen;
+/* Assigned to objects when they're created, and whenever their geometry
+ * changes, so that the renderer can tell if its cached hits are still valid,
+ * even if an object is freed and another is allocated at the same address.
+ */
+static unsigned int geom_gen;
 
 struct scene *create_scene(void)
 {
@@ -37,6 +54,11 @@ struct scene *create_scene(void)
 	scn->objects = darr_alloc(0, sizeof *scn->objects);
 	scn->lights = darr_alloc(0, sizeof *scn->lights);
 	scn->mtl = darr_alloc(0, sizeof *scn->mtl);
+
+	bvh_init(&scn->bvh);
+	scn->objbox = darr_alloc(0, sizeof *scn->objbox);
+	scn->bvh_valid = 0;
+	scn->accel_gen = 0;
 	return scn;
 }
 
@@ -49,6 +71,9 @@ void free_scene(struct scene *scn)
 	darr_free(scn->objects);
 	darr_free(scn->lights);
 	darr_free(scn->mtl);
+
+	bvh_destroy(&scn->bvh);
+	darr_free(scn->objbox);
 	free(scn);
 }
 
@@ -67,6 +92,8 @@ void scn_clear(struct scene *scn)
 		free(scn->mtl[i]);
 	}
 	darr_clear(scn->mtl);
+
+	scn->bvh_valid = 0;
 }
 
 static struct material *read_material(struct ts_node *tsmtl)
@@ -97,6 +124,7 @@ static struct material *read_material(struct ts_node *tsmtl)
 	mtl->refl = ts_get_attr_num(tsmtl, "reflect", mtl->refl);
 	mtl->trans = ts_get_attr_num(tsmtl, "transmit", mtl->trans);
 	mtl->ior = ts_get_attr_num(tsmtl, "ior", mtl->ior);
+	mtl->max_depth = ts_get_attr_int(tsmtl, "maxdepth", mtl->max_depth);
 
 	return mtl;
 }
@@ -115,6 +143,10 @@ static struct object *read_object(struct scene *scn, struct ts_node *tsobj)
 		objtype = OBJ_SPHERE;
 	} else if(strcmp(str, "box") == 0) {
 		objtype = OBJ_BOX;
+	} else if(strcmp(str, "csg") == 0) {
+		objtype = OBJ_CSG;
+	} else if(strcmp(str, "mesh") == 0) {
+		objtype = OBJ_MESH;
 	} else {
 		warnmsg("ignoring unknown object type: %s\n", str);
 		return 0;
@@ -148,7 +180,48 @@ static struct object *read_object(struct scene *scn, struct ts_node *tsobj)
 	}
 
 	obj->xform_valid = 0;
-	/* TODO csg */
+
+	if(objtype == OBJ_CSG) {
+		struct csgnode *csg = (struct csgnode*)obj;
+		struct ts_node *tsn;
+		struct object *sub;
+
+		if((str = ts_get_attr_str(tsobj, "op", 0))) {
+			if(strcmp(str, "union") == 0) {
+				csg->op = CSG_UNION;
+			} else if(strcmp(str, "intersection") == 0) {
+				csg->op = CSG_INTERSECTION;
+			} else if(strcmp(str, "difference") == 0) {
+				csg->op = CSG_DIFFERENCE;
+			} else {
+				warnmsg("%s: unknown csg operation: %s\n", obj->name, str);
+			}
+		}
+
+		tsn = tsobj->child_list;
+		while(tsn) {
+			if(strcmp(tsn->name, "object") == 0) {
+				if(!(sub = read_object(scn, tsn))) {
+					free_object(obj);
+					return 0;
+				}
+				if(csg_add_object(csg, sub) == -1) {
+					warnmsg("%s: unsupported csg operand: %s, ignoring\n", obj->name, sub->name);
+					free_object(sub);
+				}
+			}
+			tsn = tsn->next;
+		}
+	}
+
+	if(objtype == OBJ_MESH) {
+		if(!(str = ts_get_attr_str(tsobj, "file", 0))) {
+			warnmsg("%s: mesh object without a mesh file\n", obj->name);
+		} else if(load_object_mesh((struct meshobj*)obj, str) == -1) {
+			/* keep it around empty, so that it's not lost when saving */
+			warnmsg("%s: failed to load mesh: %s\n", obj->name, str);
+		}
+	}
 	return obj;
 }
 
@@ -186,6 +259,7 @@ int scn_load(struct scene *scn, const char *fname)
 	struct object *obj;
 	struct light *lt;
 	float *vec;
+	struct accel_cache *ac = 0;
 
 	if(!(ts = ts_load(fname)) || strcmp(ts->name, "rrscene") != 0) {
 		errormsg("failed to load: %s\n", fname);
@@ -194,6 +268,11 @@ int scn_load(struct scene *scn, const char *fname)
 
 	scn_clear(scn);
 
+	if(opt.rend_accel_cache) {
+		ac = acache_open(fname);
+		tmesh_set_cache(ac);
+	}
+
 	tsn = ts->child_list;
 	while(tsn) {
 		if(strcmp(tsn->name, "material") == 0) {
@@ -225,12 +304,69 @@ int scn_load(struct scene *scn, const char *fname)
 		tsn = tsn->next;
 	}
 
+	if(opt.rend_accel_cache && (!ac || acache_stale(ac))) {
+		save_accel_cache(scn, fname);
+	}
+
 	res = 0;
 end:
+	tmesh_set_cache(0);
+	acache_close(ac);
 	ts_free_tree(ts);
 	return res;
 }
 
+static void get_meshes(struct object *obj, struct trimesh ***meshes)
+{
+	int i, num;
+	struct trimesh *tm;
+	struct csgnode *csg;
+
+	switch(obj->type) {
+	case OBJ_MESH:
+		if(!(tm = ((struct meshobj*)obj)->mesh) || !tm->fname || tm->num_tri <= 0) {
+			break;
+		}
+		num = darr_size(*meshes);
+		for(i=0; i<num; i++) {
+			if((*meshes)[i] == tm) break;
+		}
+		if(i >= num) {
+			darr_push(*meshes, &tm);
+		}
+		break;
+
+	case OBJ_CSG:
+		csg = (struct csgnode*)obj;
+		num = darr_size(csg->subobj);
+		for(i=0; i<num; i++) {
+			get_meshes(csg->subobj[i], meshes);
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+/* writes the acceleration cache of a scene file, if it uses any meshes */
+static int save_accel_cache(struct scene *scn, const char *fname)
+{
+	int i, num, res = 0;
+	struct trimesh **meshes;
+
+	meshes = darr_alloc(0, sizeof *meshes);
+	num = scn_num_objects(scn);
+	for(i=0; i<num; i++) {
+		get_meshes(scn->objects[i], &meshes);
+	}
+	if(!darr_empty(meshes)) {
+		res = acache_save(fname, meshes, darr_size(meshes));
+	}
+	darr_free(meshes);
+	return res;
+}
+
 #define ADD_ATTR_STR(tsn, aname, s) \
 	do { \
 		struct ts_attr *attr; \
@@ -298,6 +434,7 @@ static struct ts_node *cons_tsmtl(struct material *mtl)
 	ADD_ATTR_NUM(tsmtl, "reflect", mtl->refl);
 	ADD_ATTR_NUM(tsmtl, "transmit", mtl->trans);
 	ADD_ATTR_NUM(tsmtl, "ior", mtl->ior);
+	ADD_ATTR_NUM(tsmtl, "maxdepth", mtl->max_depth);
 
 	return tsmtl;
 err:
@@ -323,6 +460,12 @@ static struct ts_node *cons_tsobj(struct object *obj)
 	case OBJ_BOX:
 		typestr = "box";
 		break;
+	case OBJ_CSG:
+		typestr = "csg";
+		break;
+	case OBJ_MESH:
+		typestr = "mesh";
+		break;
 	default:
 		typestr = 0;
 	}
@@ -339,6 +482,27 @@ static struct ts_node *cons_tsobj(struct object *obj)
 	ADD_ATTR_VEC(tsobj, "scale", obj->scale.x, obj->scale.y, obj->scale.z);
 	ADD_ATTR_VEC(tsobj, "pivot", obj->pivot.x, obj->pivot.y, obj->pivot.z);
 
+	if(obj->type == OBJ_CSG) {
+		int i, num;
+		struct ts_node *tssub;
+		struct csgnode *csg = (struct csgnode*)obj;
+		static const char *opstr[] = {"union", "intersection", "difference"};
+
+		ADD_ATTR_STR(tsobj, "op", opstr[csg->op]);
+
+		num = darr_size(csg->subobj);
+		for(i=0; i<num; i++) {
+			if(!(tssub = cons_tsobj(csg->subobj[i]))) {
+				goto err;
+			}
+			ts_add_child(tsobj, tssub);
+		}
+	}
+
+	if(obj->type == OBJ_MESH && ((struct meshobj*)obj)->fname) {
+		ADD_ATTR_STR(tsobj, "file", ((struct meshobj*)obj)->fname);
+	}
+
 	return tsobj;
 err:
 	ts_free_node(tsobj);
@@ -419,6 +583,9 @@ int scn_save(struct scene *scn, const char *fname)
 		errormsg("failed to write: %s\n", fname);
 		goto err;
 	}
+	if(opt.rend_accel_cache) {
+		save_accel_cache(scn, fname);
+	}
 
 	res = 0;
 err:
@@ -430,6 +597,7 @@ err:
 int scn_add_object(struct scene *scn, struct object *obj)
 {
 	darr_push(scn->objects, &obj);
+	scn->bvh_valid = 0;
 	return 0;
 }
 
@@ -447,6 +615,7 @@ int scn_rm_object(struct scene *scn, int idx)
 		scn->objects[idx] = scn->objects[numobj - 1];
 	}
 	darr_pop(scn->objects);
+	scn->bvh_valid = 0;
 	return 0;
 }
 
@@ -528,6 +697,7 @@ int scn_add_light(struct scene *scn, struct light *light)
 {
 	darr_push(scn->objects, &light);
 	darr_push(scn->lights, &light);
+	scn->bvh_valid = 0;
 	return 0;
 }
 
@@ -582,50 +752,126 @@ struct light *scn_find_light(const struct scene *scn, const char *mname)
 }
 
 
-int scn_intersect(const struct scene *scn, const cgm_ray *ray, struct rayhit *hit)
+/* rebuild from scratch after this many refits, to keep the tree quality from
+ * degrading too much while objects are moved around interactively.
+ */
+#define MAX_REFITS	32
+
+void scn_update_accel(struct scene *scn)
 {
 	int i, numobj;
-	struct rayhit hit0, tmphit;
-
-	hit0.t = FLT_MAX;
-	hit0.obj = 0;
 
 	numobj = darr_size(scn->objects);
 	for(i=0; i<numobj; i++) {
-		if(scn->objects[i]->type == OBJ_LIGHT) continue;
-		if(ray_object(ray, scn->objects[i], &tmphit) && tmphit.t < hit0.t) {
-			hit0 = tmphit;
+		if(!scn->objects[i]->xform_valid) {
+			calc_object_matrix(scn->objects[i]);
 		}
 	}
 
-	if(hit0.obj) {
-		if(hit) *hit = hit0;
+	if(scn->bvh_valid && scn->xform_gen == xform_gen) {
+		return;
+	}
+
+	if(darr_size(scn->objbox) != numobj) {
+		darr_resize(scn->objbox, numobj);
+	}
+	for(i=0; i<numobj; i++) {
+		calc_object_bounds(scn->objects[i], scn->objbox + i);
+	}
+
+	if(!scn->bvh_valid || scn->num_refits >= MAX_REFITS) {
+		if(bvh_build(&scn->bvh, scn->objbox, numobj, opt.rend_bvh) == -1) {
+			return;
+		}
+		scn->num_refits = 0;
+	} else {
+		bvh_refit(&scn->bvh, scn->objbox);
+		scn->num_refits++;
+	}
+	scn->bvh_valid = 1;
+	scn->xform_gen = xform_gen;
+	scn->accel_gen = ++accel_gen;
+}
+
+struct isect_data {
+	const struct scene *scn;
+	struct rayhit *hit;
+	int lights;
+};
+
+static int isect_object(const cgm_ray *ray, int idx, float *tmax, void *cls)
+{
+	struct isect_data *data = cls;
+	struct object *obj = data->scn->objects[idx];
+	float t;
+
+	if(obj->type == OBJ_LIGHT && !data->lights) {
+		return 0;
+	}
+	RSTAT_ADD(obj_tests, 1);
+	/* only the distance here, hit attributes are calculated for the closest */
+	if(ray_object_t(ray, obj, &t) && t < *tmax) {
+		data->hit->t = t;
+		data->hit->obj = obj;
+		*tmax = t;
 		return 1;
 	}
 	return 0;
 }
 
-int scn_pick(const struct scene *scn, const cgm_ray *ray, struct rayhit *hit)
+int scn_intersect(const struct scene *scn, const cgm_ray *ray, struct rayhit *hit)
 {
-	int i, numobj;
-	struct rayhit hit0, tmphit;
+	struct rayhit hit0;
+	struct isect_data data;
 
-	hit0.t = FLT_MAX;
-	hit0.obj = 0;
+	data.scn = scn;
+	data.hit = &hit0;
+	data.lights = 0;
 
-	numobj = darr_size(scn->objects);
-	for(i=0; i<numobj; i++) {
-		if(ray_object(ray, scn->objects[i], &tmphit) && tmphit.t < hit0.t) {
-			hit0 = tmphit;
+	if(bvh_intersect(&scn->bvh, ray, FLT_MAX, isect_object, &data)) {
+		if(hit) {
+			*hit = hit0;
+			ray_hit_attr(ray, hit);
 		}
+		return 1;
+	}
+	return 0;
+}
+
+static int occl_object(const cgm_ray *ray, int idx, float *tmax, void *cls)
+{
+	const struct scene *scn = cls;
+	struct object *obj = scn->objects[idx];
+
+	if(obj->type == OBJ_LIGHT) {
+		return 0;
 	}
+	RSTAT_ADD(obj_tests, 1);
+	return ray_object_occl(ray, obj);
+}
 
-	if(hit0.obj) {
-		if(hit) *hit = hit0;
+int scn_occluded(const struct scene *scn, const cgm_ray *ray)
+{
+	return bvh_any_hit(&scn->bvh, ray, 1.0f, occl_object, (void*)scn);
+}
+
+int scn_pick(const struct scene *scn, const cgm_ray *ray, struct rayhit *hit)
+{
+	struct rayhit hit0;
+	struct isect_data data;
+
+	data.scn = scn;
+	data.hit = &hit0;
+	data.lights = 1;
+
+	if(bvh_intersect(&scn->bvh, ray, FLT_MAX, isect_object, &data)) {
+		if(hit) {
+			*hit = hit0;
+			ray_hit_attr(ray, hit);
+		}
 		return 1;
 	}
 	return 0;
-
 }
 
 /* --- object functions --- */
@@ -658,6 +904,21 @@ struct object *create_object(int type)
 		sprintf(buf, "light%03d", objid[type]++);
 		break;
 
+	case OBJ_CSG:
+		if(!(obj = calloc(1, sizeof(struct csgnode)))) {
+			goto err;
+		}
+		((struct csgnode*)obj)->subobj = darr_alloc(0, sizeof(struct object*));
+		sprintf(buf, "csg%03d", objid[type]++);
+		break;
+
+	case OBJ_MESH:
+		if(!(obj = calloc(1, sizeof(struct meshobj)))) {
+			goto err;
+		}
+		sprintf(buf, "mesh%03d", objid[type]++);
+		break;
+
 	default:
 		if(!(obj = calloc(1, sizeof *obj))) {
 			goto err;
@@ -676,6 +937,7 @@ struct object *create_object(int type)
 	cgm_midentity(obj->dir_xform);
 	cgm_midentity(obj->inv_xform);
 	obj->xform_valid = 1;
+	obj->geom_gen = ++geom_gen;
 	obj->mtl = default_material();
 
 	set_object_name(obj, buf);
@@ -688,12 +950,77 @@ err:
 
 void free_object(struct object *obj)
 {
+	int i;
+	struct csgnode *csg;
+
 	if(!obj) return;
 
+	if(obj->type == OBJ_CSG) {
+		csg = (struct csgnode*)obj;
+		for(i=0; i<darr_size(csg->subobj); i++) {
+			free_object(csg->subobj[i]);
+		}
+		darr_free(csg->subobj);
+	} else if(obj->type == OBJ_MESH) {
+		free_trimesh(((struct meshobj*)obj)->mesh);
+		free(((struct meshobj*)obj)->fname);
+	}
+
 	free(obj->name);
 	free(obj);
 }
 
+int csg_add_object(struct csgnode *csg, struct object *obj)
+{
+	/* csg_spans only knows the entry/exit distances of solid primitives */
+	switch(obj->type) {
+	case OBJ_SPHERE:
+	case OBJ_BOX:
+	case OBJ_CSG:
+		break;
+	default:
+		return -1;
+	}
+
+	darr_push(csg->subobj, &obj);
+	csg->xform_valid = 0;
+	csg->geom_gen = ++geom_gen;
+	return 0;
+}
+
+int load_object_mesh(struct meshobj *mobj, const char *fname)
+{
+	char *str;
+	struct trimesh *tm;
+
+	if(!(str = strdup(fname))) {
+		errormsg("failed to allocate mesh filename\n");
+		return -1;
+	}
+	free(mobj->fname);
+	mobj->fname = str;
+
+	if(!(tm = load_trimesh(fname))) {
+		return -1;
+	}
+	free_trimesh(mobj->mesh);
+	mobj->mesh = tm;
+	mobj->xform_valid = 0;	/* the bounds changed, see scn_update_accel */
+	mobj->geom_gen = ++geom_gen;
+	return 0;
+}
+
+void set_object_mesh(struct meshobj *mobj, struct trimesh *tm)
+{
+	if(tm) {
+		tmesh_ref(tm);
+	}
+	free_trimesh(mobj->mesh);
+	mobj->mesh = tm;
+	mobj->xform_valid = 0;
+	mobj->geom_gen = ++geom_gen;
+}
+
 int set_object_name(struct object *obj, const char *name)
 {
 	char *str = strdup(name);
@@ -737,7 +1064,95 @@ void calc_object_matrix(struct object *obj)
 	cgm_mcopy(obj->inv_xform, mat);
 	cgm_minverse(obj->inv_xform);
 
+	if(obj->type == OBJ_CSG) {
+		struct csgnode *csg = (struct csgnode*)obj;
+		struct object *sub;
+
+		csg->num_prims = 0;
+		for(i=0; i<darr_size(csg->subobj); i++) {
+			sub = csg->subobj[i];
+			calc_object_matrix(sub);
+			csg->num_prims += sub->type == OBJ_CSG ? ((struct csgnode*)sub)->num_prims : 1;
+		}
+	}
+
 	obj->xform_valid = 1;
+	xform_gen++;
+}
+
+/* bounds of a csg tree in the space of the csg node */
+static void calc_csg_bounds(const struct csgnode *csg, struct aabox *box)
+{
+	int i, num;
+	struct aabox subbox;
+
+	aabox_init(box);
+	if(!(num = darr_size(csg->subobj))) {
+		return;
+	}
+	calc_object_bounds(csg->subobj[0], box);
+
+	switch(csg->op) {
+	case CSG_UNION:
+		for(i=1; i<num; i++) {
+			calc_object_bounds(csg->subobj[i], &subbox);
+			aabox_union(box, &subbox);
+		}
+		break;
+
+	case CSG_INTERSECTION:
+		for(i=1; i<num; i++) {
+			calc_object_bounds(csg->subobj[i], &subbox);
+			if(subbox.vmin.x > box->vmin.x) box->vmin.x = subbox.vmin.x;
+			if(subbox.vmin.y > box->vmin.y) box->vmin.y = subbox.vmin.y;
+			if(subbox.vmin.z > box->vmin.z) box->vmin.z = subbox.vmin.z;
+			if(subbox.vmax.x < box->vmax.x) box->vmax.x = subbox.vmax.x;
+			if(subbox.vmax.y < box->vmax.y) box->vmax.y = subbox.vmax.y;
+			if(subbox.vmax.z < box->vmax.z) box->vmax.z = subbox.vmax.z;
+		}
+		break;
+
+	default:
+		break;	/* difference: can't be larger than the first sub-object */
+	}
+}
+
+void calc_object_bounds(const struct object *obj, struct aabox *box)
+{
+	const struct trimesh *mesh;
+
+	switch(obj->type) {
+	case OBJ_SPHERE:
+	case OBJ_LIGHT:
+		cgm_vcons(&box->vmin, -1, -1, -1);
+		cgm_vcons(&box->vmax, 1, 1, 1);
+		break;
+
+	case OBJ_BOX:
+		cgm_vcons(&box->vmin, -0.5, -0.5, -0.5);
+		cgm_vcons(&box->vmax, 0.5, 0.5, 0.5);
+		break;
+
+	case OBJ_CSG:
+		calc_csg_bounds((const struct csgnode*)obj, box);
+		break;
+
+	case OBJ_MESH:
+		mesh = ((const struct meshobj*)obj)->mesh;
+		if(!mesh || !mesh->bvh.num_nodes) {
+			aabox_init(box);
+			return;
+		}
+		*box = mesh->bvh.nodes[0].box;
+		break;
+
+	default:
+		/* not intersectable */
+		aabox_init(box);
+		return;
+	}
+
+	aabox_xform(box, obj->xform);
 }
 
 /* --- lights --- */
@@ -20,12 +20,14 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "cgmath/cgmath.h"
 #include "material.h"
+#include "bvh.h"
 
 enum {
 	OBJ_NULL,
 	OBJ_SPHERE,
 	OBJ_BOX,
 	OBJ_CSG,
+	OBJ_MESH,
 
 	OBJ_LIGHT,
 
@@ -39,16 +41,40 @@ enum {
 	cgm_quat rot; \
 	float xform[16], dir_xform[16], inv_xform[16]; \
 	int xform_valid; \
+	unsigned int geom_gen;	/* see geom_gen in scene.c */ \
 	struct material *mtl
 
 struct object {
 	OBJ_COMMON_ATTR;
 };
 
+enum {
+	CSG_UNION,
+	CSG_INTERSECTION,
+	CSG_DIFFERENCE		/* first sub-object minus all the rest */
+};
+
+/* The sub-objects are combined in order: ((sub0 op sub1) op sub2) ...
+ * Their transforms are relative to the csg node, and they can be csg nodes
+ * themselves. The whole tree is rendered with the material of the root.
+ */
 struct csgnode {
 	OBJ_COMMON_ATTR;
 	int op;
-	struct object *subobj;	/* darr */
+	struct object **subobj;	/* darr */
+	int num_prims;			/* primitives in the whole subtree, see calc_object_matrix */
+};
+
+struct trimesh;
+
+/* Triangle mesh, loaded from a file. The object transform is applied to the
+ * rays instead of the mesh, so that the triangle BVH never has to be rebuilt,
+ * and any number of mesh objects can share the same mesh.
+ */
+struct meshobj {
+	OBJ_COMMON_ATTR;
+	char *fname;
+	struct trimesh *mesh;
 };
 
 struct light {
@@ -62,6 +88,13 @@ struct scene {
 	struct object **objects;	/* darr */
 	struct light **lights;
 	struct material **mtl;		/* darr */
+
+	/* acceleration structure, maintained by scn_update_accel */
+	struct bvh bvh;
+	struct aabox *objbox;		/* world-space bounds of each object */
+	int bvh_valid, num_refits;
+	unsigned int xform_gen;
+	unsigned int accel_gen;		/* changes every time the BVH is rebuilt or refit */
 };
 
 struct rayhit;	/* declared in rt.h */
@@ -91,7 +124,15 @@ int scn_num_lights(const struct scene *scn);
 int scn_light_index(const struct scene *scn, const struct light *mtl);
 struct light *scn_find_light(const struct scene *scn, const char *mname);
 
+/* recalculates invalid object matrices, and rebuilds or refits the BVH if any
+ * object was added, removed, or transformed since the last call. Must be called
+ * before scn_intersect/scn_pick, whenever the scene might have changed.
+ */
+void scn_update_accel(struct scene *scn);
+
 int scn_intersect(const struct scene *scn, const cgm_ray *ray, struct rayhit *hit);
+/* shadow ray query: is anything in the way between ray origin and origin + dir */
+int scn_occluded(const struct scene *scn, const cgm_ray *ray);
 int scn_pick(const struct scene *scn, const cgm_ray *ray, struct rayhit *hit);
 
 /* --- objects --- */
@@ -100,7 +141,21 @@ void free_object(struct object *obj);
 
 int set_object_name(struct object *obj, const char *name);
 
+/* adds obj as the last sub-object of the csg node, which takes ownership of it.
+ * Only spheres, boxes, and csg nodes can be operands; returns -1 otherwise,
+ * leaving obj to the caller.
+ */
+int csg_add_object(struct csgnode *csg, struct object *obj);
+
+/* loads a mesh file into a mesh object, replacing any previous mesh. Objects
+ * loading the same file share a single copy of the mesh.
+ */
+int load_object_mesh(struct meshobj *mobj, const char *fname);
+/* makes the object an instance of tm, adding a reference to it */
+void set_object_mesh(struct meshobj *mobj, struct trimesh *tm);
+
 void calc_object_matrix(struct object *obj);
+void calc_object_bounds(const struct object *obj, struct aabox *box);
 
 /* --- lights --- */
 struct light *create_light(void);
@@ -22,10 +22,13 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "geom.h"
 #include "cmesh.h"
 #include "meshgen.h"
+#include "trimesh.h"
 #include "font.h"
 #include "rend.h"
 #include "modui.h"
 #include "options.h"
+#include "rstats.h"
+#include "darray.h"
 
 static int vpdirty, vpnav, projdirty;
 static rtk_rect totalrend;
@@ -55,6 +58,8 @@ static void moveobj(struct object *obj, int px0, int py0, int px1, int py1);
 static void rotobj(struct object *obj, int px0, int py0, int px1, int py1);
 static void scaleobj(struct object *obj, int px0, int py0, int px1, int py1);
 
+static void show_rstats(void);
+static void clip_view_rect(rtk_rect *r);
 static void act_render(void);
 static void act_viewer(void);
 static void save_render(void);
@@ -228,9 +233,11 @@ static void mdl_display(void)
 
 	/* render layer */
 	if(rendering) {
-		if(!render(framebuf)) {
+		/* time-sliced, to keep the UI responsive while the render converges */
+		if(!render_timed(framebuf, opt.rend_budget)) {
 			rendering = 0;
 		}
+		show_rstats();
 		app_redisplay(rendrect.x, rendrect.y, rendrect.width, rendrect.height);
 	}
 
@@ -261,6 +268,9 @@ static void mdl_display(void)
 
 static void draw_object(struct object *obj)
 {
+	int i;
+	struct csgnode *csg;
+
 	if(!obj->xform_valid) {
 		calc_object_matrix(obj);
 	}
@@ -309,6 +319,20 @@ static void draw_object(struct object *obj)
 		gaw_end();
 		break;
 
+	case OBJ_CSG:
+		/* just the sub-objects, with their transforms relative to the csg node */
+		csg = (struct csgnode*)obj;
+		for(i=0; i<darr_size(csg->subobj); i++) {
+			draw_object(csg->subobj[i]);
+		}
+		break;
+
+	case OBJ_MESH:
+		if(((struct meshobj*)obj)->mesh) {
+			cmesh_draw(((struct meshobj*)obj)->mesh->cmesh);
+		}
+		break;
+
 	default:
 		break;
 	}
@@ -363,22 +387,24 @@ static void draw_grid(void)
 
 static void mdl_reshape(int x, int y)
 {
-	scr_aspect = (float)x / (float)(y - TOOLBAR_HEIGHT);
+	/* the view is the area between the toolbar and the status bar */
+	scr_aspect = (float)x / (float)(y - TOOLBAR_HEIGHT - STATUS_HEIGHT);
 
 	viewport[0] = 0;
-	viewport[1] = TOOLBAR_HEIGHT;
-	viewport[2] = x;
 #ifdef GFX_GL
-	/* XXX temp render-rect viewport match hack, until I fix it properly */
-	viewport[3] = y;
+	viewport[1] = STATUS_HEIGHT;	/* GL viewports start from the bottom */
 #else
-	viewport[3] = y - TOOLBAR_HEIGHT;
+	viewport[1] = TOOLBAR_HEIGHT;
 #endif
+	viewport[2] = x;
+	viewport[3] = y - TOOLBAR_HEIGHT - STATUS_HEIGHT;
 	gaw_viewport(viewport[0], viewport[1], viewport[2], viewport[3]);
 
 	update_projmat();
 
 	rtk_resize(toolbar, win_width, TOOLBAR_HEIGHT);
+	rtk_move(statuswin, 0, win_height - STATUS_HEIGHT);
+	rtk_resize(statuswin, win_width, STATUS_HEIGHT);
 
 	inval_vport();
 }
@@ -492,10 +518,11 @@ static void mdl_mouse(int bn, int press, int x, int y)
 			app_rband(0, 0, 0, 0);
 
 			if(cur_tool == TOOL_REND_AREA) {
+				rtk_fix_rect(&rband);
+				clip_view_rect(&rband);
 				if(rband.width && rband.height) {
 					rendering = 1;
 					rend_size(win_width, win_height);
-					rtk_fix_rect(&rband);
 					rendrect = rband;
 					rend_begin(rband.x, rband.y, rband.width, rband.height);
 					app_redisplay(rband.x, rband.y, rband.width, rband.height);
@@ -511,6 +538,7 @@ static void mdl_mouse(int bn, int press, int x, int y)
 
 		} else if(bn == 0 && x == rband.x && y == rband.y) {
 			primray(&pickray, x, y);
+			scn_update_accel(scn);
 			if(scn_pick(scn, &pickray, &hit)) {
 				if(cur_tool == TOOL_DBG) {
 					dbg_hit = hit;
@@ -754,15 +782,15 @@ static void act_rmobj(void)
 }
 
 
-void primray(cgm_ray *ray, int x, int y)
+void primray(cgm_ray *ray, float x, float y)
 {
 	float nx, ny;
 	cgm_vec3 npos, farpt;
 	float inv_pv[16];
 
-	y = win_height - (y - TOOLBAR_HEIGHT);
+	y = win_height - STATUS_HEIGHT - y;	/* from the bottom of the view */
 	nx = (float)(x - viewport[0]) / (float)viewport[2];
-	ny = (float)(y - viewport[1]) / (float)viewport[3];
+	ny = (float)y / (float)viewport[3];
 
 	cgm_mcopy(inv_pv, proj_matrix_inv);
 	cgm_mmul(inv_pv, view_matrix_inv);
@@ -893,13 +921,41 @@ static void scaleobj(struct object *obj, int px0, int py0, int px1, int py1)
 	inval_vport();
 }
 
+static void show_rstats(void)
+{
+	char buf[128];
+	unsigned long rays, krays_sec;
+
+	rays = rstat_frame.prim_rays + rstat_frame.shadow_rays + rstat_frame.refl_rays;
+	krays_sec = rstat_frame.msec ? rays / rstat_frame.msec : 0;
+
+	sprintf(buf, "%s: %lu passes, %lu.%03lu s, %luk rays, %lu.%03lu Mrays/s",
+			rendering ? "rendering" : "done", rstat_frame.passes,
+			rstat_frame.msec / 1000, rstat_frame.msec % 1000, rays / 1000,
+			krays_sec / 1000, krays_sec % 1000);
+	set_status(buf);
+}
+
+/* keeps render regions out of the toolbar and the status bar */
+static void clip_view_rect(rtk_rect *r)
+{
+	int y0 = r->y;
+	int y1 = r->y + r->height;
+
+	if(y0 < TOOLBAR_HEIGHT) y0 = TOOLBAR_HEIGHT;
+	if(y1 > win_height - STATUS_HEIGHT) y1 = win_height - STATUS_HEIGHT;
+	r->y = y0;
+	r->height = y1 > y0 ? y1 - y0 : 0;
+}
+
 static void act_render(void)
 {
 	rendering = 1;
 	rend_size(win_width, win_height);
-	rendrect.x = rendrect.y = 0;
+	rendrect.x = 0;
+	rendrect.y = TOOLBAR_HEIGHT;
 	rendrect.width = win_width;
-	rendrect.height = win_height;
+	rendrect.height = win_height - TOOLBAR_HEIGHT - STATUS_HEIGHT;
 	rend_begin(rendrect.x, rendrect.y, rendrect.width, rendrect.height);
 	app_redisplay(rendrect.x, rendrect.y, rendrect.width, rendrect.height);
 	totalrend = rendrect;
@@ -0,0 +1,285 @@
+/*
+RetroRay - integrated standalone vintage modeller/renderer
+Copyright (C) 2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include "tpool.h"
+#include "logger.h"
+
+#if defined(__unix__) || defined(unix) || defined(__APPLE__)
+#define USE_PTHREAD
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef USE_PTHREAD
+struct task_queue {
+	pthread_mutex_t lock;
+	int head, tail;		/* remaining tasks: [head, tail) */
+};
+
+struct worker {
+	struct thread_pool *tp;
+	int id;
+	pthread_t thread;
+};
+#endif
+
+struct thread_pool {
+	int num_threads;
+
+#ifdef USE_PTHREAD
+	struct worker *workers;
+	struct task_queue *queues;
+
+	pthread_mutex_t lock;
+	pthread_cond_t job_cond, done_cond;
+	int job_id, busy, quit;
+
+	tpool_func func;
+	void *cls;
+#endif
+};
+
+#ifdef USE_PTHREAD
+static void *worker_main(void *arg);
+#endif
+
+
+struct thread_pool *tpool_create(int num_threads)
+{
+	struct thread_pool *tp;
+#ifdef USE_PTHREAD
+	int i;
+#endif
+
+	if(!(tp = calloc(1, sizeof *tp))) {
+		errormsg("failed to allocate thread pool\n");
+		return 0;
+	}
+
+#ifdef USE_PTHREAD
+	if(num_threads <= 0) {
+		num_threads = tpool_num_processors();
+	}
+	tp->num_threads = num_threads;
+
+	/* with a single worker, tasks run in the calling thread, see tpool_run */
+	if(num_threads <= 1) {
+		tp->num_threads = 1;
+		return tp;
+	}
+
+	if(!(tp->workers = calloc(num_threads, sizeof *tp->workers)) ||
+			!(tp->queues = calloc(num_threads, sizeof *tp->queues))) {
+		errormsg("failed to allocate %d thread pool workers\n", num_threads);
+		free(tp->workers);
+		free(tp);
+		return 0;
+	}
+
+	pthread_mutex_init(&tp->lock, 0);
+	pthread_cond_init(&tp->job_cond, 0);
+	pthread_cond_init(&tp->done_cond, 0);
+
+	for(i=0; i<num_threads; i++) {
+		pthread_mutex_init(&tp->queues[i].lock, 0);
+	}
+
+	for(i=0; i<num_threads; i++) {
+		tp->workers[i].tp = tp;
+		tp->workers[i].id = i;
+		if(pthread_create(&tp->workers[i].thread, 0, worker_main, tp->workers + i) != 0) {
+			errormsg("failed to create worker thread %d, continuing with %d\n", i, i);
+			break;
+		}
+	}
+	if(!i) {
+		/* fallback to running everything in the calling thread */
+		free(tp->workers);
+		free(tp->queues);
+		tp->workers = 0;
+		tp->queues = 0;
+		tp->num_threads = 1;
+		return tp;
+	}
+	tp->num_threads = i;
+
+	infomsg("thread pool: %d worker threads\n", tp->num_threads);
+#else
+	tp->num_threads = 1;
+#endif
+	return tp;
+}
+
+void tpool_destroy(struct thread_pool *tp)
+{
+#ifdef USE_PTHREAD
+	int i;
+#endif
+
+	if(!tp) return;
+
+#ifdef USE_PTHREAD
+	if(tp->workers) {
+		pthread_mutex_lock(&tp->lock);
+		tp->quit = 1;
+		pthread_cond_broadcast(&tp->job_cond);
+		pthread_mutex_unlock(&tp->lock);
+
+		for(i=0; i<tp->num_threads; i++) {
+			pthread_join(tp->workers[i].thread, 0);
+		}
+		for(i=0; i<tp->num_threads; i++) {
+			pthread_mutex_destroy(&tp->queues[i].lock);
+		}
+		pthread_mutex_destroy(&tp->lock);
+		pthread_cond_destroy(&tp->job_cond);
+		pthread_cond_destroy(&tp->done_cond);
+
+		free(tp->workers);
+		free(tp->queues);
+	}
+#endif
+	free(tp);
+}
+
+int tpool_num_threads(const struct thread_pool *tp)
+{
+	return tp->num_threads;
+}
+
+#ifdef USE_PTHREAD
+void tpool_run(struct thread_pool *tp, int count, tpool_func func, void *cls)
+{
+	int i, n;
+
+	if(count <= 0) return;
+
+	if(!tp->workers) {
+		for(i=0; i<count; i++) {
+			func(i, 0, cls);
+		}
+		return;
+	}
+
+	n = tp->num_threads;
+	for(i=0; i<n; i++) {
+		tp->queues[i].head = (int)((long)count * i / n);
+		tp->queues[i].tail = (int)((long)count * (i + 1) / n);
+	}
+
+	pthread_mutex_lock(&tp->lock);
+	tp->func = func;
+	tp->cls = cls;
+	tp->busy = n;
+	tp->job_id++;
+	pthread_cond_broadcast(&tp->job_cond);
+
+	while(tp->busy > 0) {
+		pthread_cond_wait(&tp->done_cond, &tp->lock);
+	}
+	pthread_mutex_unlock(&tp->lock);
+}
+
+int tpool_num_processors(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
+static int pop_task(struct task_queue *q)
+{
+	int task = -1;
+
+	pthread_mutex_lock(&q->lock);
+	if(q->head < q->tail) {
+		task = q->head++;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return task;
+}
+
+static int steal_task(struct task_queue *q)
+{
+	int task = -1;
+
+	pthread_mutex_lock(&q->lock);
+	if(q->head < q->tail) {
+		task = --q->tail;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return task;
+}
+
+static void run_tasks(struct thread_pool *tp, int tid)
+{
+	int i, task, n = tp->num_threads;
+
+	for(;;) {
+		if((task = pop_task(tp->queues + tid)) == -1) {
+			for(i=1; i<n; i++) {
+				if((task = steal_task(tp->queues + (tid + i) % n)) != -1) {
+					break;
+				}
+			}
+			if(task == -1) return;	/* nothing left anywhere */
+		}
+		tp->func(task, tid, tp->cls);
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct thread_pool *tp = w->tp;
+	int job = 0;
+
+	pthread_mutex_lock(&tp->lock);
+	for(;;) {
+		while(tp->job_id == job && !tp->quit) {
+			pthread_cond_wait(&tp->job_cond, &tp->lock);
+		}
+		if(tp->quit) break;
+		job = tp->job_id;
+		pthread_mutex_unlock(&tp->lock);
+
+		run_tasks(tp, w->id);
+
+		pthread_mutex_lock(&tp->lock);
+		if(--tp->busy <= 0) {
+			pthread_cond_signal(&tp->done_cond);
+		}
+	}
+	pthread_mutex_unlock(&tp->lock);
+	return 0;
+}
+
+#else	/* !USE_PTHREAD */
+
+void tpool_run(struct thread_pool *tp, int count, tpool_func func, void *cls)
+{
+	int i;
+	for(i=0; i<count; i++) {
+		func(i, 0, cls);
+	}
+}
+
+int tpool_num_processors(void)
+{
+	return 1;
+}
+#endif
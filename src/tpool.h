@@ -0,0 +1,43 @@
+/*
+RetroRay - integrated standalone vintage modeller/renderer
+Copyright (C) 2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef TPOOL_H_
+#define TPOOL_H_
+
+/* Fixed-size worker thread pool. On systems without threads (DOS), the pool
+ * has a single "worker", which is the calling thread itself.
+ */
+struct thread_pool;
+
+/* task is the task index in [0, count), tid the index of the worker running it */
+typedef void (*tpool_func)(int task, int tid, void *cls);
+
+/* num_threads <= 0 creates one worker per processor */
+struct thread_pool *tpool_create(int num_threads);
+void tpool_destroy(struct thread_pool *tp);
+
+int tpool_num_threads(const struct thread_pool *tp);
+
+/* Runs func for every task in [0, count) and blocks until all of them are done.
+ * Each worker starts with a contiguous range of tasks, and once it runs out, it
+ * steals tasks from the end of the ranges of other workers.
+ */
+void tpool_run(struct thread_pool *tp, int count, tpool_func func, void *cls);
+
+int tpool_num_processors(void);
+
+#endif	/* TPOOL_H_ */
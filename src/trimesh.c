@@ -0,0 +1,478 @@
+/*
+RetroRay - integrated standalone vintage modeller/renderer
+Copyright (C) 2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "trimesh.h"
+#include "cmesh.h"
+#include "geom.h"
+#include "logger.h"
+#include "options.h"
+
+/* Per-ray state of the watertight ray/triangle test (Woop, Benthin, Wald,
+ * "Watertight Ray/Triangle Intersection", JCGT 2013). The ray is sheared and
+ * scaled so that it points down the +z axis from the origin, and the test
+ * becomes a 2D point in triangle test, on the xy projection of each triangle.
+ * Since the edge functions of neighbouring triangles are calculated from the
+ * same projected vertices, rays through shared edges and vertices can't slip
+ * between them.
+ */
+struct tri_query {
+	const struct trimesh *tm;
+	int kx, ky, kz;
+	float sx, sy, sz;
+	float tmin;
+
+	/* results of the nearest hit query */
+	int tri;			/* index in the BVH leaf order */
+	float t, bary[3];
+};
+
+/* list of meshes loaded from files, for load_trimesh to share them */
+static struct trimesh *loaded;
+
+static struct accel_cache *cache;
+
+static struct trimesh *cached_trimesh(struct cmesh *cm, const char *fname,
+		const struct file_hash *src);
+static void calc_face_box(struct aabox *box, const float *varr, int nelem,
+		const unsigned int *idx, int face);
+static void init_query(struct tri_query *q, const struct trimesh *tm, const cgm_ray *ray,
+		float tmin);
+static int leaf_nearest(const cgm_ray *ray, const struct bvh *bvh, int first, int count,
+		float *tmax, void *cls);
+static int leaf_any(const cgm_ray *ray, const struct bvh *bvh, int first, int count,
+		float *tmax, void *cls);
+
+
+struct trimesh *create_trimesh(struct cmesh *cm)
+{
+	int i, j, k, face, nelem;
+	struct trimesh *tm;
+	struct aabox *boxes;
+	const float *varr, *vptr;
+	const unsigned int *idx;
+	float *dst;
+
+	if(!(tm = calloc(1, sizeof *tm))) {
+		errormsg("failed to allocate triangle mesh\n");
+		return 0;
+	}
+	tm->cmesh = cm;
+	tm->refcount = 1;
+	bvh_init(&tm->bvh);
+
+	if(!(varr = cmesh_attrib_ro(cm, CMESH_ATTR_VERTEX))) {
+		return tm;	/* empty mesh */
+	}
+	nelem = cmesh_attrib_nelem(cm, CMESH_ATTR_VERTEX);
+	idx = cmesh_indexed(cm) ? cmesh_index_ro(cm) : 0;
+	tm->num_tri = cmesh_poly_count(cm);
+	if(tm->num_tri <= 0) {
+		tm->num_tri = 0;
+		return tm;
+	}
+
+	if(!(boxes = malloc(tm->num_tri * sizeof *boxes))) {
+		errormsg("failed to allocate bounds for %d triangles\n", tm->num_tri);
+		goto err;
+	}
+	for(i=0; i<tm->num_tri; i++) {
+		calc_face_box(boxes + i, varr, nelem, idx, i);
+	}
+	tm->bvh_method = opt.rend_bvh;
+	if(bvh_build(&tm->bvh, boxes, tm->num_tri, tm->bvh_method) == -1) {
+		free(boxes);
+		goto err;
+	}
+	free(boxes);
+
+	/* copy the vertices of each triangle, in BVH leaf order */
+	if(!(tm->vert = malloc(tm->num_tri * 9 * sizeof *tm->vert))) {
+		errormsg("failed to allocate vertices for %d triangles\n", tm->num_tri);
+		goto err;
+	}
+	dst = tm->vert;
+	for(i=0; i<tm->num_tri; i++) {
+		face = tm->bvh.prims[i];
+		for(j=0; j<3; j++) {
+			k = idx ? idx[face * 3 + j] : face * 3 + j;
+			vptr = varr + k * nelem;
+			*dst++ = vptr[0];
+			*dst++ = vptr[1];
+			*dst++ = vptr[2];
+		}
+	}
+
+	dbgmsg("triangle mesh: %d triangles, %d BVH nodes\n", tm->num_tri, tm->bvh.num_nodes);
+	return tm;
+
+err:
+	tm->cmesh = 0;	/* ownership stays with the caller on failure */
+	free_trimesh(tm);
+	return 0;
+}
+
+struct trimesh *load_trimesh(const char *fname)
+{
+	struct trimesh *tm;
+	struct cmesh *cm;
+	struct file_hash src;
+
+	tm = loaded;
+	while(tm) {
+		if(strcmp(tm->fname, fname) == 0) {
+			return tmesh_ref(tm);
+		}
+		tm = tm->next;
+	}
+
+	if(!(cm = cmesh_alloc())) {
+		errormsg("failed to allocate mesh\n");
+		return 0;
+	}
+	if(cmesh_load(cm, fname) == -1) {
+		cmesh_free(cm);
+		return 0;
+	}
+	if(hash_file(fname, &src) == -1) {
+		src.hash = src.size = 0;
+	}
+	if(!(tm = cached_trimesh(cm, fname, &src)) && !(tm = create_trimesh(cm))) {
+		cmesh_free(cm);
+		return 0;
+	}
+	tm->src = src;
+	if(!(tm->fname = strdup(fname))) {
+		errormsg("failed to allocate mesh filename\n");
+		free_trimesh(tm);
+		return 0;
+	}
+	tm->next = loaded;
+	loaded = tm;
+	return tm;
+}
+
+void tmesh_set_cache(struct accel_cache *ac)
+{
+	cache = ac;
+}
+
+static struct trimesh *cached_trimesh(struct cmesh *cm, const char *fname,
+		const struct file_hash *src)
+{
+	struct trimesh *tm;
+
+	if(!cache || !cmesh_attrib_ro(cm, CMESH_ATTR_VERTEX) || cmesh_poly_count(cm) <= 0) {
+		return 0;
+	}
+
+	if(!(tm = calloc(1, sizeof *tm))) {
+		errormsg("failed to allocate triangle mesh\n");
+		return 0;
+	}
+	tm->num_tri = cmesh_poly_count(cm);
+	tm->bvh_method = opt.rend_bvh;
+	if(acache_lookup(cache, fname, src, tm->bvh_method, tm) == -1) {
+		free(tm);
+		return 0;
+	}
+	tm->cmesh = cm;
+	tm->refcount = 1;
+
+	dbgmsg("triangle mesh: %d triangles, %d BVH nodes (cached)\n", tm->num_tri, tm->bvh.num_nodes);
+	return tm;
+}
+
+struct trimesh *tmesh_ref(struct trimesh *tm)
+{
+	tm->refcount++;
+	return tm;
+}
+
+void free_trimesh(struct trimesh *tm)
+{
+	struct trimesh **link;
+
+	if(!tm || --tm->refcount > 0) return;
+
+	if(tm->fname) {
+		link = &loaded;
+		while(*link && *link != tm) {
+			link = &(*link)->next;
+		}
+		if(*link) *link = tm->next;
+		free(tm->fname);
+	}
+
+	if(tm->cmesh) {
+		cmesh_free(tm->cmesh);
+	}
+	if(tm->cache) {
+		acache_close(tm->cache);
+	} else {
+		free(tm->vert);
+		bvh_destroy(&tm->bvh);
+	}
+	free(tm);
+}
+
+static void calc_face_box(struct aabox *box, const float *varr, int nelem,
+		const unsigned int *idx, int face)
+{
+	int i, k;
+	const float *v;
+
+	aabox_init(box);
+	for(i=0; i<3; i++) {
+		k = idx ? idx[face * 3 + i] : face * 3 + i;
+		v = varr + k * nelem;
+		if(v[0] < box->vmin.x) box->vmin.x = v[0];
+		if(v[1] < box->vmin.y) box->vmin.y = v[1];
+		if(v[2] < box->vmin.z) box->vmin.z = v[2];
+		if(v[0] > box->vmax.x) box->vmax.x = v[0];
+		if(v[1] > box->vmax.y) box->vmax.y = v[1];
+		if(v[2] > box->vmax.z) box->vmax.z = v[2];
+	}
+}
+
+int tmesh_ray_t(const struct trimesh *tm, const cgm_ray *ray, float tmin, float tmax,
+		float *t)
+{
+	struct tri_query q;
+
+	if(!tm->num_tri) return 0;
+
+	init_query(&q, tm, ray, tmin);
+	if(!bvh_intersect_leaves(&tm->bvh, ray, tmax, leaf_nearest, &q)) {
+		return 0;
+	}
+	*t = q.t;
+	return 1;
+}
+
+int tmesh_ray_occl(const struct trimesh *tm, const cgm_ray *ray, float tmin, float tmax)
+{
+	struct tri_query q;
+
+	if(!tm->num_tri) return 0;
+
+	init_query(&q, tm, ray, tmin);
+	return bvh_any_hit_leaves(&tm->bvh, ray, tmax, leaf_any, &q);
+}
+
+static void init_query(struct tri_query *q, const struct trimesh *tm, const cgm_ray *ray,
+		float tmin)
+{
+	int tmp;
+	const float *dir = &ray->dir.x;
+
+	q->tm = tm;
+	q->tmin = tmin;
+	q->tri = -1;
+
+	/* the largest component of the direction becomes z, and x/y are swapped
+	 * if it's negative, to preserve the winding of the triangles
+	 */
+	if(fabs(dir[0]) > fabs(dir[1])) {
+		q->kz = fabs(dir[0]) > fabs(dir[2]) ? 0 : 2;
+	} else {
+		q->kz = fabs(dir[1]) > fabs(dir[2]) ? 1 : 2;
+	}
+	q->kx = q->kz == 2 ? 0 : q->kz + 1;
+	q->ky = q->kx == 2 ? 0 : q->kx + 1;
+	if(dir[q->kz] < 0.0f) {
+		tmp = q->kx;
+		q->kx = q->ky;
+		q->ky = tmp;
+	}
+
+	q->sx = dir[q->kx] / dir[q->kz];
+	q->sy = dir[q->ky] / dir[q->kz];
+	q->sz = 1.0f / dir[q->kz];
+}
+
+/* returns the hit distance scaled by the determinant in *tdet, and the
+ * unnormalized barycentric coordinates in bary, or 0 if the ray misses
+ */
+static int ray_tri(const struct tri_query *q, const cgm_ray *ray, const float *tri,
+		float *bary, float *tdet, float *detres)
+{
+	const float *org = &ray->origin.x;
+	int kx = q->kx, ky = q->ky, kz = q->kz;
+	float ax, ay, az, bx, by, bz, cx, cy, cz, u, v, w, det;
+
+	/* vertices relative to the ray origin, sheared to ray space */
+	az = tri[kz] - org[kz];
+	bz = tri[3 + kz] - org[kz];
+	cz = tri[6 + kz] - org[kz];
+	ax = tri[kx] - org[kx] - q->sx * az;
+	ay = tri[ky] - org[ky] - q->sy * az;
+	bx = tri[3 + kx] - org[kx] - q->sx * bz;
+	by = tri[3 + ky] - org[ky] - q->sy * bz;
+	cx = tri[6 + kx] - org[kx] - q->sx * cz;
+	cy = tri[6 + ky] - org[ky] - q->sy * cz;
+
+	/* scaled barycentric coordinates, from the 2D edge functions */
+	u = cx * by - cy * bx;
+	v = ax * cy - ay * cx;
+	w = bx * ay - by * ax;
+
+	/* exactly on an edge: the float result might have the wrong sign, so
+	 * recalculate it in double precision to get it consistently right
+	 */
+	if(u == 0.0f || v == 0.0f || w == 0.0f) {
+		u = (float)((double)cx * (double)by - (double)cy * (double)bx);
+		v = (float)((double)ax * (double)cy - (double)ay * (double)cx);
+		w = (float)((double)bx * (double)ay - (double)by * (double)ax);
+	}
+
+	if((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f)) {
+		return 0;
+	}
+	if((det = u + v + w) == 0.0f) {
+		return 0;
+	}
+
+	bary[0] = u;
+	bary[1] = v;
+	bary[2] = w;
+	*tdet = (u * az + v * bz + w * cz) * q->sz;
+	*detres = det;
+	return 1;
+}
+
+static int leaf_nearest(const cgm_ray *ray, const struct bvh *bvh, int first, int count,
+		float *tmax, void *cls)
+{
+	int i, res = 0;
+	float bary[3], tdet, det, t, inv;
+	struct tri_query *q = cls;
+	const float *v = q->tm->vert + first * 9;
+
+	for(i=0; i<count; i++) {
+		if(ray_tri(q, ray, v, bary, &tdet, &det)) {
+			inv = 1.0f / det;
+			t = tdet * inv;
+			if(t >= q->tmin && t <= *tmax) {
+				*tmax = q->t = t;
+				q->tri = first + i;
+				q->bary[0] = bary[0] * inv;
+				q->bary[1] = bary[1] * inv;
+				q->bary[2] = bary[2] * inv;
+				res = 1;
+			}
+		}
+		v += 9;
+	}
+	return res;
+}
+
+static int leaf_any(const cgm_ray *ray, const struct bvh *bvh, int first, int count,
+		float *tmax, void *cls)
+{
+	int i;
+	float bary[3], tdet, det, t;
+	struct tri_query *q = cls;
+	const float *v = q->tm->vert + first * 9;
+
+	for(i=0; i<count; i++) {
+		if(ray_tri(q, ray, v, bary, &tdet, &det)) {
+			t = tdet / det;
+			if(t >= q->tmin && t <= *tmax) {
+				return 1;
+			}
+		}
+		v += 9;
+	}
+	return 0;
+}
+
+void tmesh_hit_attr(const struct trimesh *tm, const cgm_ray *ray, float tmin,
+		struct rayhit *hit)
+{
+	int i, face, nelem, vidx[3];
+	struct tri_query q;
+	const float *v, *attr;
+	const unsigned int *idx;
+	cgm_vec3 e1, e2, fnorm;
+	float *b;
+
+	cgm_raypos(&hit->pos, ray, hit->t);
+
+	/* the distance was calculated exactly the same way, so the same triangle
+	 * will come up again. The margin is just for the BVH node bounds tests.
+	 */
+	init_query(&q, tm, ray, tmin);
+	if(!tm->num_tri || !bvh_intersect_leaves(&tm->bvh, ray, hit->t * 1.0001f + 1e-6f,
+				leaf_nearest, &q)) {
+		hit->norm = ray->dir;
+		cgm_vneg(&hit->norm);
+		hit->uv.x = hit->uv.y = 0.0f;
+		return;
+	}
+	b = q.bary;
+
+	v = tm->vert + q.tri * 9;
+	cgm_vcons(&e1, v[3] - v[0], v[4] - v[1], v[5] - v[2]);
+	cgm_vcons(&e2, v[6] - v[0], v[7] - v[1], v[8] - v[2]);
+	cgm_vcross(&fnorm, &e1, &e2);
+
+	face = tm->bvh.prims[q.tri];
+	idx = cmesh_indexed(tm->cmesh) ? cmesh_index_ro(tm->cmesh) : 0;
+	for(i=0; i<3; i++) {
+		vidx[i] = idx ? idx[face * 3 + i] : face * 3 + i;
+	}
+
+	if((attr = cmesh_attrib_ro(tm->cmesh, CMESH_ATTR_NORMAL))) {
+		nelem = cmesh_attrib_nelem(tm->cmesh, CMESH_ATTR_NORMAL);
+		hit->norm.x = hit->norm.y = hit->norm.z = 0.0f;
+		for(i=0; i<3; i++) {
+			const float *n = attr + vidx[i] * nelem;
+			hit->norm.x += n[0] * b[i];
+			hit->norm.y += n[1] * b[i];
+			hit->norm.z += n[2] * b[i];
+		}
+	} else {
+		hit->norm = fnorm;
+	}
+
+	if((attr = cmesh_attrib_ro(tm->cmesh, CMESH_ATTR_TEXCOORD))) {
+		nelem = cmesh_attrib_nelem(tm->cmesh, CMESH_ATTR_TEXCOORD);
+		hit->uv.x = hit->uv.y = 0.0f;
+		for(i=0; i<3; i++) {
+			const float *tc = attr + vidx[i] * nelem;
+			hit->uv.x += tc[0] * b[i];
+			hit->uv.y += tc[1] * b[i];
+		}
+	} else {
+		hit->uv.x = b[1];
+		hit->uv.y = b[2];
+	}
+
+	/* meshes are surfaces, not solids, so both sides are shaded the same. The
+	 * winding and the vertex normals are not always consistent, so the normal
+	 * is flipped to the side of the face the ray came from.
+	 */
+	if(cgm_vdot(&fnorm, &ray->dir) > 0.0f) {
+		cgm_vneg(&fnorm);
+	}
+	if(cgm_vdot(&hit->norm, &fnorm) < 0.0f) {
+		cgm_vneg(&hit->norm);
+	}
+}
@@ -0,0 +1,80 @@
+/*
+RetroRay - integrated standalone vintage modeller/renderer
+Copyright (C) 2025  John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef TRIMESH_H_
+#define TRIMESH_H_
+
+#include "cgmath/cgmath.h"
+#include "bvh.h"
+#include "acache.h"
+
+struct cmesh;
+struct rayhit;
+
+/* Triangle mesh prepared for raytracing: the triangles of a cmesh, with a BVH
+ * over them. Vertex positions are copied in the order the triangles appear in
+ * the BVH leaves, so that each leaf is a contiguous range of the vertex array,
+ * and bvh.prims maps them back to the faces of the cmesh, for the rest of the
+ * vertex attributes.
+ *
+ * Meshes are shared by all the objects using them (instances), which only
+ * differ in their transforms, and are reference counted.
+ */
+struct trimesh {
+	struct cmesh *cmesh;
+	int num_tri;
+	float *vert;		/* 9 floats per triangle: v0, v1, v2 */
+	struct bvh bvh;
+	int bvh_method;
+
+	/* the BVH and vertices are mapped from this cache, if set, see acache.h */
+	struct accel_cache *cache;
+
+	int refcount;
+	char *fname;		/* file it was loaded from, if any, see load_trimesh */
+	struct file_hash src;	/* content hash of the file */
+	struct trimesh *next;
+};
+
+/* takes ownership of cm, which must not be modified afterwards. The new mesh
+ * has a single reference.
+ */
+struct trimesh *create_trimesh(struct cmesh *cm);
+/* loads a mesh file, or adds a reference to the same mesh, if it's already
+ * loaded. The BVH and vertices are taken from the cache set by tmesh_set_cache,
+ * if they're up to date there.
+ */
+struct trimesh *load_trimesh(const char *fname);
+/* acceleration cache for load_trimesh, or 0 to always build the BVH */
+void tmesh_set_cache(struct accel_cache *ac);
+/* adds a reference */
+struct trimesh *tmesh_ref(struct trimesh *tm);
+/* releases a reference, and frees the mesh when there are none left */
+void free_trimesh(struct trimesh *tm);
+
+/* closest triangle hit within [tmin, tmax], for a ray in mesh space */
+int tmesh_ray_t(const struct trimesh *tm, const cgm_ray *ray, float tmin, float tmax,
+		float *t);
+/* any triangle hit within [tmin, tmax] */
+int tmesh_ray_occl(const struct trimesh *tm, const cgm_ray *ray, float tmin, float tmax);
+/* finds the triangle at distance hit->t again, and calculates the hit
+ * attributes in mesh space. The normal always faces the ray origin.
+ */
+void tmesh_hit_attr(const struct trimesh *tm, const cgm_ray *ray, float tmin,
+		struct rayhit *hit);
+
+#endif	/* TRIMESH_H_ */
@@ -33,6 +33,13 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define PACKED
 #endif
 
+/* per-thread variables, for scratch state of the render threads */
+#if defined(__GNUC__) && !defined(__WATCOMC__)
+#define THREAD_LOCAL	__thread
+#else
+#define THREAD_LOCAL	/* no threads */
+#endif
+
 unsigned int get_cs(void);
 #define get_cpl()	((int)(get_cs() & 3))
 